@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include "session.h"
+#include "dpotrf_batch.h"
+
+#define min(a,b) ( a < b ? a : b)
+
+cl_int generateMatrices(session * s, cl_ulong size, cl_ulong count, host_buffer * hb, char ** log);
+int performCholesky(session * s, host_buffer * hbA, cl_ulong size, cl_ulong count, int * errCount, int * failCount, cl_ulong * duration, char ** log);
+
+#pragma weak clGetExtensionFunctionAddressForPlatform
+extern void * clGetExtensionFunctionAddressForPlatform(cl_platform_id, const char *);
+
+#pragma weak clGetExtensionFunctionAddress
+extern void * clGetExtensionFunctionAddress(const char *);
+
+/* L is the reference matrix of batch element b. We compute A = L*Lt to then
+ * perform cholesky factorization on A (and we should find L back)*/
+
+#define L(x,y,b) (1.0 / ((double)(x+y)+5.0+(b%16)))
+// Default matrix size and count (both can be given on the command line)
+#define SIZE 16
+#define COUNT 10000
+
+int main(int argc, char ** argv) {
+
+   int size = (argc > 1 ? atoi(argv[1]) : SIZE);
+   int count = (argc > 2 ? atoi(argv[2]) : COUNT);
+   if (size < BATCH_MIN_SIZE || size > BATCH_MAX_SIZE || count <= 0) {
+      fprintf(stderr, "Usage: %s [matrix size (%d-%d)] [matrix count]\n", argv[0], BATCH_MIN_SIZE, BATCH_MAX_SIZE);
+      return 1;
+   }
+
+   cl_uint nb_platf;
+   clGetPlatformIDs(0, NULL, &nb_platf);
+
+   printf("%d OpenCL platform%s found\n", nb_platf, nb_platf > 1 ? "s" : "");
+
+   cl_platform_id platfs[nb_platf];
+   clGetPlatformIDs(nb_platf, platfs, NULL);
+
+   cl_uint p;
+   for (p=0; p<nb_platf; p++) {
+
+      size_t plat_name_size;
+      clGetPlatformInfo(platfs[p], CL_PLATFORM_NAME, 0, NULL, &plat_name_size);
+      char plat_name[plat_name_size];
+      clGetPlatformInfo(platfs[p], CL_PLATFORM_NAME, plat_name_size, &plat_name, NULL);
+
+      size_t plat_vendor_size;
+      clGetPlatformInfo(platfs[p], CL_PLATFORM_VENDOR, 0, NULL, &plat_vendor_size);
+      char plat_vendor[plat_vendor_size];
+      clGetPlatformInfo(platfs[p], CL_PLATFORM_VENDOR, plat_vendor_size, &plat_vendor, NULL);
+
+      cl_uint nb_devs;
+      clGetDeviceIDs(platfs[p], CL_DEVICE_TYPE_ALL, 0, NULL, &nb_devs);
+      printf("\nBenchmarking platform: %s (%s) - %d device%s\n\n", plat_name, plat_vendor, nb_devs, nb_devs > 1 ? "s" : "");
+
+      cl_device_id devs[nb_devs];
+      clGetDeviceIDs(platfs[p], CL_DEVICE_TYPE_ALL, nb_devs, devs, NULL);
+
+      cl_uint d;
+      for (d=0; d<nb_devs; d++) {
+         size_t dev_name_size;
+         clGetDeviceInfo(devs[d], CL_DEVICE_NAME, 0, NULL, &dev_name_size);
+         char dev_name[dev_name_size];
+         clGetDeviceInfo(devs[d], CL_DEVICE_NAME, dev_name_size, dev_name, NULL);
+
+         printf("  - Benchmarking device %s:\n", dev_name);
+
+         int errCount, failCount;
+         cl_ulong duration;
+         char * log;
+
+         session * s = NULL;
+         int err = createSession(1, &devs[d], &s, &log);
+
+         // Generated in host memory of the session, factored in place
+         host_buffer hbA;
+         if (err == CL_SUCCESS) {
+            printf("      - Computing input matrices (%d matrices of size %d)...\n", count, size);
+            err = generateMatrices(s, size, count, &hbA, &log);
+         }
+
+         if (err == CL_SUCCESS) {
+            err = performCholesky(s, &hbA, size, count, &errCount, &failCount, &duration, &log);
+         }
+
+         if (err != CL_SUCCESS) {
+            printf("      - Error %d: %s\n", err, log);
+         }
+         else {
+            printf("      - Execution time: %.3f ms and %s (%d errors, %d not positive definite).\n", 
+               duration/1e6, (errCount == 0 && failCount == 0 ? "succeeded" : "failed"), errCount, failCount);
+         }
+         if (s != NULL) releaseSession(s);
+         printf("\n");
+      }
+
+      
+      if (strstr(plat_name, "SOCL") != NULL) {
+         
+         void (*clShutdown)(void) = (clGetExtensionFunctionAddressForPlatform != NULL ?
+                                     clGetExtensionFunctionAddressForPlatform(platfs[p], "clShutdown") :
+                                    (clGetExtensionFunctionAddress != NULL ?
+                                     clGetExtensionFunctionAddress("clShutdown"):
+                                     NULL));
+
+         if (clShutdown != NULL) {
+            clShutdown();
+         }
+      }
+   }
+
+   printf("\nDone.\n");
+
+   return 0;
+}
+
+/* Compute each matrix = L*Lt in a host buffer of the session, without
+ * padding: matrix b at b*size*size, row-major */
+cl_int generateMatrices(session * s, cl_ulong size, cl_ulong count, host_buffer * hb, char ** log) {
+   size_t x, y, z, b;
+
+   cl_int err = sessionHostBuffer(s, count * size * size * sizeof(double), hb, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+
+   for (b=0; b<count; b++) {
+      double * mat = (double *)hb->ptr + b*size*size;
+      for (y=0; y<size; y++) {
+         for (x=0; x<=y; x++) {
+            mat[y*size+x] = 0.0;
+            for (z=0; z <= min(x,y); z++) {
+               mat[y*size+x] += L(z,y,b) * L(z,x,b);
+            }
+         }
+      }
+   }
+
+   return CL_SUCCESS;
+}
+
+/* Factor the matrices of hbA in place */
+int performCholesky(session * s, host_buffer * hbA, cl_ulong size, cl_ulong count, int * errCount, int * failCount, cl_ulong * duration, char ** log) {
+
+   cl_event ev_writeA, ev_ker, ev_readA, ev_readInfo;
+   int x, y;
+   size_t b;
+   cl_int err;
+
+   size_t infoSize = count * sizeof(cl_int);
+
+   // Statuses in host memory usable by the device as well (in place or
+   // pinned, see sessionHostBuffer)
+   host_buffer hbInfo;
+   err = sessionHostBuffer(s, infoSize, &hbInfo, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+
+   cl_mem bufA, bufInfo;
+   cl_event ev_writeInfo;
+   err = sessionToDevice(s, s->cq, hbA, 0, NULL, &bufA, &ev_writeA, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+   err = sessionToDevice(s, s->cq, &hbInfo, 0, NULL, &bufInfo, &ev_writeInfo, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+
+   cl_event deps[] = {ev_writeA, ev_writeInfo};
+   err = batchCholesky(s, bufA, count, size, size*size, size, bufInfo, 2, deps, &ev_ker, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+
+   err = sessionToHost(s, s->cq, hbA, bufA, 1, &ev_ker, &ev_readA, log);
+   if (err == CL_SUCCESS) {
+      err = sessionToHost(s, s->cq, &hbInfo, bufInfo, 1, &ev_ker, &ev_readInfo, log);
+   }
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+
+   clFinish(s->cq);
+
+   clGetEventInfo(ev_ker, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &err, NULL);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Error with ND Range Command");
+      return err;
+   }
+
+   cl_ulong start, end;
+   err = clGetEventProfilingInfo(ev_ker, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+   err |= clGetEventProfilingInfo(ev_ker, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to get event profiling info");
+      return err;
+   }
+
+   *duration = end-start;
+
+   clReleaseEvent(ev_readInfo);
+   clReleaseEvent(ev_readA);
+   clReleaseEvent(ev_ker);
+   clReleaseEvent(ev_writeInfo);
+   clReleaseEvent(ev_writeA);
+   sessionRelease(s, bufInfo);
+   sessionRelease(s, bufA);
+
+   double * matsB = hbA->ptr;
+   cl_int * info = hbInfo.ptr;
+
+   // Check result
+   *errCount = 0;
+   *failCount = 0;
+   for (b=0; b<count; b++) {
+      double * mat = matsB + b*size*size;
+      if (info[b] != 0) *failCount += 1;
+      for (y=0; y<size; y++) {
+         for (x=0; x<=y; x++) {
+            if (fabs(mat[y*size+x]-L(x,y,b)) > 10e-9) {
+               *errCount += 1;
+            }
+         }
+      }
+   }
+
+   releaseHostBuffer(s, &hbInfo);
+   releaseHostBuffer(s, hbA);
+
+   return 0;
+}
@@ -0,0 +1,10 @@
+// Helpers shared by the kernel files (inlined by #include "blocks.cl")
+
+// Linear group id g -> block row gy of the lower triangle of blocks, with
+// g = gy*(gy+1)/2 + gx
+int block_row(int g) {
+   int gy = (int)((sqrt(8.0*g+1.0)-1.0)/2.0);
+   while ((gy+1)*(gy+2)/2 <= g) gy++;
+   while (gy*(gy+1)/2 > g) gy--;
+   return gy;
+}
@@ -1,72 +1,303 @@
+// Precision: double, or float with -D SINGLE (mixed-precision solves)
+#ifdef SINGLE
+typedef float real;
+#else
 #pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+#endif
+
+// Tile size and rows per work-item, given at build time with
+// -D TS=<size> -D WPT=<rows> (TS must be divisible by WPT)
+#ifndef TS
+#define TS 16
+#endif
+#ifndef WPT
+#define WPT 1
+#endif
+
+// Work-group height
+#define RTS (TS/WPT)
+
+// Work-group size of dresidual_norm, a power of 2 within the device limit
+// given at build time with -D NORM_WG=<size>
+#ifndef NORM_WG
+#define NORM_WG 256
+#endif
+
+// Offset of tile (Y, X) with X <= Y in the packed lower-triangular tile storage:
+// lower tiles row after row, diagonal tiles only store their lower triangle
+size_t tile_off(size_t Y, size_t X) {
+   return Y*(Y+1)/2*(TS*TS) - Y*(TS*TS - TS*(TS+1)/2) + X*(TS*TS);
+}
+
+// Element (y, x) of tile (Y, X) with X <= Y is part of the matrix: not past
+// n, and not in the upper triangle of a diagonal tile (only stored packed)
+int tile_valid(unsigned long n, size_t Y, size_t X, int y, int x) {
+   return (Y*TS+y < n) && (X*TS+x < n) && (X < Y || x <= y);
+}
+
+// Element (y, x) of tile (Y, X) with X <= Y, 0 outside of the matrix
+real tile_element(__global const real * m, unsigned long n, size_t Y, size_t X, int y, int x) {
+   return tile_valid(n, Y, X, y, x) ? m[tile_off(Y, X) + (X == Y ? y*(y+1)/2 : y*TS) + x] : 0.0;
+}
+
+#include "blocks.cl"
+
+/**
+ * acc += tile (AY, AX) * tile (BY, BX)^T of m, for the WPT elements of the
+ * work-item: rows y, y+TS/WPT, ... of column x (the loads of b are shared
+ * between them). Tiles are loaded to a and b, that must not be overwritten
+ * before a barrier.
+ */
+void tile_product(__global const real * m, unsigned long n, size_t AY, size_t AX, size_t BY, size_t BX,
+                  __local real * a, __local real * b, real * acc) {
+
+   int x = get_local_id(0);
+   int y0 = get_local_id(1);
+
+   #pragma unroll
+   for (int k=0; k<WPT; k++) {
+      int y = y0 + k*RTS;
+      a[y*TS+x] = tile_element(m, n, AY, AX, y, x);
+      b[y*TS+x] = tile_element(m, n, BY, BX, y, x);
+   }
+
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   #pragma unroll
+   for (int u=0; u<TS; u++) {
+      real bv = b[x*TS+u];
+      #pragma unroll
+      for (int k=0; k<WPT; k++) {
+         acc[k] += a[(y0+k*RTS)*TS+u] * bv;
+      }
+   }
+}
+
+/**
+ * Update block (gy, gx) of the trailing matrix (relative to block step+1)
+ * with the sub-diagonal blocks of column step.
+ */
+void update_block(__global real * m, unsigned long n, unsigned long step, int gx, int gy,
+                  __local real * a, __local real * b) {
+
+   int x = get_local_id(0);
+   int y0 = get_local_id(1);
+
+   real acc[WPT];
+
+   #pragma unroll
+   for (int k=0; k<WPT; k++) {
+      acc[k] = 0.0;
+   }
+
+   // Rows/columns past n (partial edge blocks) are loaded as zeros and never stored
+   tile_product(m, n, step+1+gy, step, step+1+gx, step, a, b, acc);
+
+   #pragma unroll
+   for (int k=0; k<WPT; k++) {
+      int y = y0 + k*RTS;
+      size_t curr_off = tile_off(step+1+gy, step+1+gx)            // global current block offset
+                      + (gx == gy ? y*(y+1)/2 : y*TS) + x;       // (diagonal blocks are packed)
+
+      if (tile_valid(n, step+1+gy, step+1+gx, y, x)) m[curr_off] -= acc[k];
+   }
+}
 
 /**
  * Update other blocks (version 1.0)
- * 
- * Parameters: 
- *  - m : matrix
+ *
+ * Parameters:
+ *  - m : matrix (packed lower-triangular tiles)
+ *  - n : matrix width (any value, elements past n in the last blocks are masked)
+ *  - step : iteration (in step of TS columns)
+ *  - first : first block column to update (relative to block step+1)
+ *
+ * Call with:
+ *  - global : (TS*t) x TS/WPT with t = b*(b+1)/2, b = (n-(step+1)*TS)/TS rounded up, minus first
+ !  - local : TS x TS/WPT
+ *
+ * Only the lower triangle of blocks is updated: the linear group id is
+ * mapped to a block (gy, gx) with gx <= gy, so no idle group is launched.
+ *
+ */
+__kernel void dgemm(__global real * m, unsigned long n, unsigned long step, unsigned long first) {
+
+   __local real a[TS*TS];
+   __local real b[TS*TS];
+
+   int g = get_group_id(0);
+   int gy = block_row(g);
+   int gx = g - gy*(gy+1)/2;
+
+   update_block(m, n, step, gx+first, gy+first, a, b);
+}
+
+/**
+ * Update the first block column of the trailing matrix only (look-ahead)
+ *
+ * Parameters:
+ *  - m : matrix (packed lower-triangular tiles)
  *  - n : matrix width
- *  - step : iteration (in step of 16 columns)
+ *  - step : iteration (in step of TS columns)
  *
  * Call with:
- *  - global : (n-step*16) x (n-step*16)
- !  - local : 16 x 16
- * 
+ *  - global : (TS*b) x TS/WPT with b = (n-(step+1)*TS)/TS rounded up
+ !  - local : TS x TS/WPT
+ *
  */
-__kernel void dgemm(__global double * m, unsigned long n, unsigned long step) {
-   
+__kernel void dgemm_panel(__global real * m, unsigned long n, unsigned long step) {
+
+   __local real a[TS*TS];
+   __local real b[TS*TS];
+
+   update_block(m, n, step, 0, get_group_id(0), a, b);
+}
+
+
+/**
+ * Residual of a factorization, per tile (version 1.0)
+ *
+ * Parameters:
+ *  - l : factor L (packed lower-triangular tiles)
+ *  - a : original matrix A (packed lower-triangular tiles)
+ *  - n : matrix width
+ *  - partial : 2 values per work-group, the squared Frobenius norms of the
+ *              tile of A - L*Lt and of the tile of A
+ *
+ * Call with:
+ *  - global : (TS*t) x TS/WPT with t = b*(b+1)/2, b = n/TS rounded up
+ !  - local : TS x TS/WPT
+ *
+ * Tiles are mapped to the lower triangle as in dgemm, and (L*Lt)(gy, gx) is
+ * accumulated with the tile product of update_block. Off-diagonal elements
+ * are counted twice since A is symmetric.
+ *
+ */
+__kernel void dresidual(__global const real * l, __global const real * a, unsigned long n, __global real * partial) {
+
    int x = get_local_id(0);
-   int y = get_local_id(1);
-   int gx = get_group_id(0);
-   int gy = get_group_id(1);
-
-   int off = y*16+x;                // local offset
-   int diag_off = step*16*(n+1) + y*n + x;       // global diagonal block offset
-   int a_off = diag_off + (gy+1)*n*16;       // sub-diagonal block 1 offset 
-   int b_off = diag_off + (gx+1)*n*16;       // sub-diagonal block 2 offset
-   int curr_off = diag_off + (gy+1)*n*16 + (gx+1)*16;   // global current block offset
-
-   __local double a[16*16];
-   __local double b[16*16];
-   __local double curr[16*16];
-
-   if (gx <= gy) {
-      curr[off] = m[curr_off];
-      a[off] = m[a_off];
-      b[off] = m[b_off];
+   int y0 = get_local_id(1);
+
+   __local real la[TS*TS];
+   __local real lb[TS*TS];
+
+   int g = get_group_id(0);
+   int gy = block_row(g);
+   int gx = g - gy*(gy+1)/2;
+
+   real acc[WPT];
+
+   #pragma unroll
+   for (int k=0; k<WPT; k++) {
+      acc[k] = 0.0;
+   }
+
+   for (int t=0; t<=gx; t++) {
+      tile_product(l, n, gy, t, gx, t, la, lb, acc);
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+
+   real r2 = 0.0, a2 = 0.0;
+
+   #pragma unroll
+   for (int k=0; k<WPT; k++) {
+      int y = y0 + k*RTS;
+      real av = tile_element(a, n, gy, gx, y, x);
+      real r = (tile_valid(n, gy, gx, y, x) ? av - acc[k] : 0.0);
+      real w = (gx == gy && x == y ? 1.0 : 2.0);
+      r2 += w * r * r;
+      a2 += w * av * av;
    }
 
+   // Sums over the work-group in la and lb (any number of work-items)
+   int off = y0*TS + x;
+   la[off] = r2;
+   lb[off] = a2;
+
    barrier(CLK_LOCAL_MEM_FENCE);
 
-   if (gx <= gy) {
-      double my[8];
-      #define red(u) a[u+y*16] * b[u+x*16]
-      my[0] = red(0) + red(8);
-      my[1] = red(1) + red(9);
-      my[2] = red(2) + red(10);
-      my[3] = red(3) + red(11);
-      my[4] = red(4) + red(12);
-      my[5] = red(5) + red(13);
-      my[6] = red(6) + red(14);
-      my[7] = red(7) + red(15);
-
-      my[0] += my[4];
-      my[1] += my[5];
-      my[2] += my[6];
-      my[3] += my[7];
-
-      my[0] += my[2];
-      my[1] += my[3];
-
-      my[0] += my[1];
-
-/*      my[0] = 0.0;
-      for (int i=0; i<16; i++) {
-         my[0] += a[i+y*16] * b[i+x*16];
-      }*/
-
-      m[curr_off] = curr[off] - my[0]; 
+   for (int s=1; s<TS*RTS; s*=2) {
+      if (off % (2*s) == 0 && off+s < TS*RTS) {
+         la[off] += la[off+s];
+         lb[off] += lb[off+s];
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+
+   if (off == 0) {
+      partial[2*g] = la[0];
+      partial[2*g+1] = lb[0];
    }
-   
 }
 
+/**
+ * Normwise backward error ||A - L*Lt|| / ||A|| (Frobenius norms)
+ *
+ * Parameters:
+ *  - partial : output of dresidual
+ *  - count : number of work-groups of dresidual
+ *  - result : the backward error (1 value)
+ *
+ * Call with:
+ *  - global : NORM_WG
+ !  - local : NORM_WG
+ *
+ */
+__kernel void dresidual_norm(__global const real * partial, unsigned long count, __global real * result) {
+
+   int i = get_local_id(0);
+
+   __local real sums[2*NORM_WG];
+
+   real r = 0.0, av = 0.0;
+   for (size_t g=i; g<count; g+=NORM_WG) {
+      r += partial[2*g];
+      av += partial[2*g+1];
+   }
+   sums[i] = r;
+   sums[NORM_WG+i] = av;
+
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for (int s=NORM_WG/2; s>0; s/=2) {
+      if (i < s) {
+         sums[i] += sums[i+s];
+         sums[NORM_WG+i] += sums[NORM_WG+i+s];
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+
+   if (i == 0) result[0] = sqrt(sums[0] / sums[NORM_WG]);
+}
+
+/**
+ * Copy a block of a blocked matrix to the packed layout (version 1.0)
+ *
+ * Parameters:
+ *  - block : block (Y, X) with X <= Y, row-major, or packed lower-triangular
+ *            tiles (of size TS) if X == Y
+ *  - m : matrix (packed lower-triangular tiles)
+ *  - n : block width (multiple of TS)
+ *  - Y, X : position of the block
+ *
+ * Call with:
+ *  - global : n x n
+ !  - local : TS x TS
+ *
+ */
+__kernel void dpack_block(__global const real * block, __global real * m, unsigned long n, unsigned long Y, unsigned long X) {
+
+   size_t x = get_global_id(0);
+   size_t y = get_global_id(1);
+
+   if (X == Y && x > y) return;
+
+   // Tiles of the block are tiles of the matrix, as n is a multiple of TS
+   int tx = x % TS, ty = y % TS;
+   size_t bx = x / TS, by = y / TS;
+   size_t mx = X*(n/TS) + bx, my = Y*(n/TS) + by;
+
+   size_t src = (X == Y ? tile_off(by, bx) + (bx == by ? ty*(ty+1)/2 : ty*TS) + tx : y*n + x);
+   m[tile_off(my, mx) + (mx == my ? ty*(ty+1)/2 : ty*TS) + tx] = block[src];
+}
@@ -0,0 +1,78 @@
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+
+/**
+ * Update other blocks per big block (version 2)
+ *
+ * Parameters:
+ *  - aBlock : sub-diagonal block for y
+ *  - bBlock : sub-diagonal block for x
+ *  - currBlock : current block
+ *
+ * Call with:
+ *  - global : n/4 x n/4     (n multiple of 64)
+ !  - local : 16 x 16
+ *
+ * Compared to version 1, each work-item computes a 4x4 micro-tile of the
+ * output in registers. A work-group computes a 64x64 tile and stages
+ * 64x16 panels of aBlock and bBlock in local memory, so every value read
+ * from local memory is used 4 times instead of once.
+ *
+ */
+__kernel void dgemm_block(__global double * aBlock, __global double * bBlock, __global double * currBlock) {
+
+   int x = get_local_id(0);
+   int y = get_local_id(1);
+   int w = get_global_size(0)*4;
+
+   int lid = y*16+x;
+   int row0 = get_group_id(1)*64;      // first row of the tile
+   int col0 = get_group_id(0)*64;      // first column of the tile
+
+   // Panels are stored transposed (k-major) so that the inner loop reads
+   // consecutive rows for consecutive work-items
+   __local double a[16*64];
+   __local double b[16*64];
+
+   double res[4][4];
+   for (int i=0; i<4; i++) {
+      for (int j=0; j<4; j++) {
+         res[i][j] = 0.0;
+      }
+   }
+
+   for (int k=0; k<w; k+=16) {
+
+      // Each work-item loads 4 elements of each panel
+      for (int t=0; t<4; t++) {
+         int e = lid + t*256;
+         int r = e / 16;
+         int kk = e % 16;
+         a[kk*64+r] = aBlock[(row0+r)*w + k + kk];
+         b[kk*64+r] = bBlock[(col0+r)*w + k + kk];
+      }
+
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      for (int kk=0; kk<16; kk++) {
+         double ra[4], rb[4];
+         for (int i=0; i<4; i++) {
+            ra[i] = a[kk*64 + y + i*16];
+            rb[i] = b[kk*64 + x + i*16];
+         }
+         for (int i=0; i<4; i++) {
+            for (int j=0; j<4; j++) {
+               res[i][j] += ra[i] * rb[j];
+            }
+         }
+      }
+
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+
+   for (int i=0; i<4; i++) {
+      for (int j=0; j<4; j++) {
+         currBlock[(row0 + y + i*16)*w + col0 + x + j*16] -= res[i][j];
+      }
+   }
+
+}
@@ -1,47 +1,134 @@
 #pragma OPENCL EXTENSION cl_khr_fp64 : enable
 
+// Tile size, given at build time with -D TS=<size> (-D WPT=<rows> is
+// accepted for consistency with the other kernels, rows are always owned
+// by a single work-item here)
+#ifndef TS
+#define TS 16
+#endif
+
+// Offset of tile (Y, X) with X <= Y in the packed lower-triangular tile storage:
+// lower tiles row after row, diagonal tiles only store their lower triangle
+size_t tile_off(size_t Y, size_t X) {
+   return Y*(Y+1)/2*(TS*TS) - Y*(TS*TS - TS*(TS+1)/2) + X*(TS*TS);
+}
+
 /**
- * Cholesky decomposition (version 1.0)
- * 
+ * Cholesky decomposition (version 2.0)
+ *
  * Call with:
- *    group size      = 16x16
- *    grid size       = 16x16
+ *    group size      = TS x 1
+ *    grid size       = TS x 1
  *
  * Parameters:
- *  - m : matrix
- *  - n : matrix width
- *  - step : iteration (in block of 16 columns)
- * 
+ *  - m : matrix (packed lower-triangular tiles)
+ *  - n : matrix width (any value, the last diagonal block may be partial)
+ *  - step : iteration (in block of TS columns)
+ *
+ * Each work-item owns a row of the diagonal block and keeps it in registers
+ * (TS is a compile-time constant so loops are fully unrolled). Only the
+ * current column goes through local memory, double-buffered so that a
+ * column needs a single barrier (instead of three with one work-item per
+ * element, most of them idle at the end).
+ *
  */
 __kernel void dpotrf(__global double * m, unsigned long n, unsigned long step) {
-   
-   __local double s[16*16];
-   
-   int x = get_local_id(0);
-   int y = get_local_id(1);
 
-   int off = y*16+x;                // local offset
-   int diag_off = step*16*(n+1) + y*n + x;       // global diagonal block offset
+   int y = get_local_id(0);
 
-   // Load diagonal block
-   __local double diag[16*16];
-   diag[off] = m[diag_off];
+   __local double col[2][TS];
 
-   for (int i=0; i<16; i++) {
+   double r[TS];
 
-      if (x == i && y == i) diag[off] = sqrt(diag[off]);
+   // Load row y of the diagonal block
+   // Elements outside of the matrix (partial edge block) are padded with the identity
+   // The upper triangle is not stored (and never read)
+   size_t row_off = tile_off(step, step) + y*(y+1)/2;      // global row offset
+   int valid_row = (step*TS+y < n);
 
-      barrier(CLK_LOCAL_MEM_FENCE);
+   #pragma unroll
+   for (int x=0; x<TS; x++) {
+      r[x] = (valid_row && x <= y) ? m[row_off+x] : (x == y ? 1.0 : 0.0);
+   }
+
+   #pragma unroll
+   for (int k=0; k<TS; k++) {
 
-      if (x == i && y > i) diag[off] /= diag[i*16+i];
+      // Column k, updated by the previous columns
+      col[k%2][y] = r[k];
 
       barrier(CLK_LOCAL_MEM_FENCE);
 
-      if (x > i && y > i && x <= y) diag[off] -= diag[x*16+i] * diag[y*16+i];
+      double d = sqrt(col[k%2][k]);
 
-      barrier(CLK_LOCAL_MEM_FENCE);
+      if (y == k) r[k] = d;
+      if (y > k) r[k] /= d;
+
+      #pragma unroll
+      for (int x=k+1; x<TS; x++) {
+         if (y >= x) r[x] -= r[k] * (col[k%2][x] / d);
+      }
+   }
+
+   if (valid_row) {
+      #pragma unroll
+      for (int x=0; x<TS; x++) {
+         if (x <= y) m[row_off+x] = r[x];
+      }
+   }
+
+}
+
+#ifdef cl_khr_subgroups
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+
+/**
+ * Cholesky decomposition (sub-group version)
+ *
+ * Call with: same as dpotrf, the work-group must be a single sub-group
+ *
+ * Parameters: same as dpotrf
+ *
+ * Rows are kept in registers as in dpotrf, columns are exchanged with
+ * sub-group broadcasts: there is neither local memory nor barrier.
+ *
+ */
+__kernel void dpotrf_sg(__global double * m, unsigned long n, unsigned long step) {
+
+   int y = get_sub_group_local_id();
+
+   double r[TS];
+
+   size_t row_off = tile_off(step, step) + y*(y+1)/2;
+   int valid_row = (step*TS+y < n);
+
+   #pragma unroll
+   for (int x=0; x<TS; x++) {
+      r[x] = (valid_row && x <= y) ? m[row_off+x] : (x == y ? 1.0 : 0.0);
+   }
+
+   #pragma unroll
+   for (int k=0; k<TS; k++) {
+
+      double d = sqrt(sub_group_broadcast(r[k], k));
+
+      if (y == k) r[k] = d;
+      if (y > k) r[k] /= d;
+
+      #pragma unroll
+      for (int x=k+1; x<TS; x++) {
+         double lx = sub_group_broadcast(r[k], x);
+         if (y >= x) r[x] -= r[k] * lx;
+      }
+   }
+
+   if (valid_row) {
+      #pragma unroll
+      for (int x=0; x<TS; x++) {
+         if (x <= y) m[row_off+x] = r[x];
+      }
    }
 
-   m[diag_off] = diag[off]; 
-   
 }
+
+#endif
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include "dpotrf_batch.h"
+
+// Work-group size of the sub-group version
+#define SG_GROUP_SIZE 64
+
+cl_int batchCholesky(session * s, cl_mem m, cl_ulong count, cl_ulong size, cl_ulong stride, cl_ulong ld,
+                     cl_mem info, cl_uint nb_wait, const cl_event * wait, cl_event * ev, char ** log) {
+   cl_int err;
+
+   if (size < BATCH_MIN_SIZE || size > BATCH_MAX_SIZE || ld < size) {
+      *log = strdup("Unsupported matrix size");
+      return CL_INVALID_VALUE;
+   }
+
+   if (count == 0) {
+      *log = strdup("Empty batch");
+      return CL_INVALID_VALUE;
+   }
+
+   char options[64];
+   sprintf(options, "-D MS=%d", (int)size);
+
+   cl_kernel kernel;
+   size_t global, local;
+
+   // Sub-group version, on a single device supporting large enough sub-groups
+   // (the launch geometry depends on the sub-group size)
+   size_t sg = 0;
+   if (s->nb_dev == 1) {
+      err = sessionSubGroupKernel(s, "dpotrf_batch.cl", "dpotrf_batch", "dpotrf_batch_sg", options, SG_GROUP_SIZE, size, &kernel, &sg, log);
+   }
+   else err = sessionKernel(s, "dpotrf_batch.cl", "dpotrf_batch", options, &kernel, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+
+   if (sg > 0) {
+      size_t per_group = SG_GROUP_SIZE / sg;
+      local = SG_GROUP_SIZE;
+      global = (count + per_group - 1) / per_group * local;
+   }
+   else {
+      size_t per_group = (size < 64 ? 64/size : 1);
+      local = per_group * size;
+      global = (count + per_group - 1) / per_group * local;
+   }
+
+   err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &m);
+   err |= clSetKernelArg(kernel, 1, sizeof(cl_ulong), &count);
+   err |= clSetKernelArg(kernel, 2, sizeof(cl_ulong), &stride);
+   err |= clSetKernelArg(kernel, 3, sizeof(cl_ulong), &ld);
+   err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &info);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to set kernel parameter");
+      return err;
+   }
+
+   err = clEnqueueNDRangeKernel(s->cq, kernel, 1, NULL, &global, &local, nb_wait, wait, ev);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to enqueue kernel execution command");
+      return err;
+   }
+
+   return CL_SUCCESS;
+}
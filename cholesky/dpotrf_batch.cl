@@ -0,0 +1,148 @@
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+
+// Matrix size, given at build time with -D MS=<size> (1 to 64)
+#ifndef MS
+#define MS 16
+#endif
+
+// Matrices per work-group for dpotrf_batch
+#define MPG (MS < 64 ? 64/MS : 1)
+
+/**
+ * Batched Cholesky decomposition of small matrices (work-group version)
+ *
+ * Parameters:
+ *  - m : matrices (row-major, lower triangle used)
+ *  - count : number of matrices
+ *  - stride : distance between two matrices (in elements)
+ *  - ld : distance between two rows of a matrix (in elements)
+ *  - info : 0 for each factored matrix, k+1 if the leading minor of order
+ *           k+1 is not positive definite (the factor is then undefined)
+ *
+ * Call with:
+ *  - global : MPG*MS x 1 per MPG matrices, count/MPG rounded up
+ !  - local : MPG*MS x 1     (MPG = 64/MS, or 1 if MS = 64)
+ *
+ * Each work-item owns a row of a matrix and keeps it in registers (MS is a
+ * compile-time constant so loops are fully unrolled). Only the current column
+ * goes through local memory. It is double-buffered so that a step needs two
+ * barriers.
+ *
+ */
+__kernel void dpotrf_batch(__global double * m, unsigned long count, unsigned long stride, unsigned long ld, __global int * info) {
+
+   __local double col[2][MPG*MS];
+
+   int lid = get_local_id(0);
+   int j = lid / MS;                // matrix in the work-group
+   int y = lid % MS;                // row owned by the work-item
+   int c = j*MS;                    // current column of the matrix in col
+
+   size_t b = get_group_id(0)*MPG + j;
+   int valid = (b < count);
+
+   __global double * a = m + b*stride + y*ld;
+
+   double r[MS];
+
+   #pragma unroll
+   for (int x=0; x<MS; x++) {
+      r[x] = (valid && x <= y) ? a[x] : 0.0;
+   }
+
+   int fail = 0;
+
+   #pragma unroll
+   for (int k=0; k<MS; k++) {
+
+      if (y == k) col[k%2][c+k] = sqrt(r[k]);
+
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      double d = col[k%2][c+k];
+      if (fail == 0 && !(d > 0.0)) fail = k+1;
+
+      if (y == k) r[k] = d;
+      if (y > k) {
+         r[k] /= d;
+         col[k%2][c+y] = r[k];
+      }
+
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      #pragma unroll
+      for (int x=k+1; x<MS; x++) {
+         if (y >= x) r[x] -= r[k] * col[k%2][c+x];
+      }
+   }
+
+   if (valid) {
+      #pragma unroll
+      for (int x=0; x<MS; x++) {
+         if (x <= y) a[x] = r[x];
+      }
+      if (y == 0) info[b] = fail;
+   }
+}
+
+#ifdef cl_khr_subgroups
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+
+/**
+ * Batched Cholesky decomposition of small matrices (sub-group version)
+ *
+ * Parameters: same as dpotrf_batch
+ *
+ * Call with:
+ *  - global : local * (count / sub-groups per work-group, rounded up)
+ !  - local : any multiple of the sub-group size, sub-group size >= MS
+ *
+ * Each sub-group factors a matrix, one row per work-item. Columns are
+ * exchanged with sub-group broadcasts, so there is neither local memory
+ * nor barrier.
+ *
+ */
+__kernel void dpotrf_batch_sg(__global double * m, unsigned long count, unsigned long stride, unsigned long ld, __global int * info) {
+
+   int y = get_sub_group_local_id();      // row owned by the work-item
+
+   size_t b = get_group_id(0)*get_num_sub_groups() + get_sub_group_id();
+   int valid = (b < count && y < MS);
+
+   __global double * a = m + b*stride + y*ld;
+
+   double r[MS];
+
+   #pragma unroll
+   for (int x=0; x<MS; x++) {
+      r[x] = (valid && x <= y) ? a[x] : 0.0;
+   }
+
+   int fail = 0;
+
+   #pragma unroll
+   for (int k=0; k<MS; k++) {
+
+      double d = sqrt(sub_group_broadcast(r[k], k));
+      if (fail == 0 && !(d > 0.0)) fail = k+1;
+
+      if (y == k) r[k] = d;
+      if (y > k) r[k] /= d;
+
+      #pragma unroll
+      for (int x=k+1; x<MS; x++) {
+         double lx = sub_group_broadcast(r[k], x);
+         if (y >= x) r[x] -= r[k] * lx;
+      }
+   }
+
+   if (valid) {
+      #pragma unroll
+      for (int x=0; x<MS; x++) {
+         if (x <= y) a[x] = r[x];
+      }
+      if (y == 0) info[b] = fail;
+   }
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef DPOTRF_BATCH_H
+#define DPOTRF_BATCH_H
+
+#include <CL/cl.h>
+
+#include "session.h"
+
+// Supported matrix sizes
+#define BATCH_MIN_SIZE 1
+#define BATCH_MAX_SIZE 64
+
+/* Factor "count" independent SPD matrices of size "size" in a single launch.
+ *
+ * Matrix b starts at element b*stride of "m" and is stored row-major with
+ * "ld" elements between rows. Only the lower triangle is read and written.
+ * info[b] (an int buffer of "count" elements) receives 0 on success, or k+1
+ * if the leading minor of order k+1 is not positive definite.
+ *
+ * Kernels are specialized for "size" at build time. When the device supports
+ * sub-groups at least as large as the matrices, each matrix is factored by a
+ * sub-group, otherwise by a part of a work-group.
+ */
+cl_int batchCholesky(session * s, cl_mem m, cl_ulong count, cl_ulong size, cl_ulong stride, cl_ulong ld,
+                     cl_mem info, cl_uint nb_wait, const cl_event * wait, cl_event * ev, char ** log);
+
+#endif
@@ -0,0 +1,146 @@
+// Precision: double, or float with -D SINGLE (mixed-precision solves)
+#ifdef SINGLE
+typedef float real;
+#else
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+#endif
+
+// Tile size and rows per work-item, given at build time with
+// -D TS=<size> -D WPT=<rows> (TS must be divisible by WPT)
+#ifndef TS
+#define TS 16
+#endif
+#ifndef WPT
+#define WPT 1
+#endif
+
+// Work-group height
+#define RTS (TS/WPT)
+
+// Offset of tile (Y, X) with X <= Y in the packed lower-triangular tile storage:
+// lower tiles row after row, diagonal tiles only store their lower triangle
+size_t tile_off(size_t Y, size_t X) {
+   return Y*(Y+1)/2*(TS*TS) - Y*(TS*TS - TS*(TS+1)/2) + X*(TS*TS);
+}
+
+/**
+ * Panel factorization: Cholesky decomposition of the diagonal block and
+ * update of the sub-diagonal blocks below it (version 1.0)
+ *
+ * Parameters:
+ *  - m : matrix (packed lower-triangular tiles)
+ *  - n : matrix width (any value, the last diagonal block may be partial,
+ *        rows past n in the last block are masked)
+ *  - step : iteration (in step of TS columns)
+ *  - done : work-groups done with each step (one counter per step, zero
+ *           before the first step)
+ *
+ * Call with:
+ *  - global : TS x (n-(step+1)*TS rounded up to a multiple of TS, at least TS)/WPT
+ !  - local : TS x TS/WPT
+ *
+ * Replaces dpotrf followed by dtrsm. Every work-group factors the diagonal
+ * block in local memory, then solves its sub-diagonal block with it: the
+ * factor never goes through global memory between the two. It replaces the
+ * diagonal block once every work-group has loaded it (the last work-group to
+ * finish writes it). Both stages keep the columns unscaled until the end
+ * (the pivot is divided out of each update instead), so that the column being
+ * read is never the one being written and a column needs a single barrier.
+ *
+ */
+__kernel void dpotrf_panel(__global real * m, unsigned long n, unsigned long step, __global int * done) {
+
+   int x = get_local_id(0);
+   int y0 = get_local_id(1);
+   int gy = get_group_id(1);
+
+   __local real diag[TS*TS];
+   __local real curr[TS*TS];
+
+   // Load diagonal block and current block
+   // Elements outside of the matrix (partial edge block) are padded with the identity
+   // The upper triangle is not stored (and never read)
+   #pragma unroll
+   for (int k=0; k<WPT; k++) {
+      int y = y0 + k*RTS;
+      int valid = (step*TS+x < n && step*TS+y < n && x <= y);
+      size_t diag_off = tile_off(step, step) + y*(y+1)/2 + x;       // global diagonal block offset
+      diag[y*TS+x] = valid ? m[diag_off] : (x == y ? 1.0 : 0.0);
+
+      int valid_curr = ((step+1+gy)*TS+y < n);
+      size_t curr_off = tile_off(step+1+gy, step) + y*TS + x;       // global current block offset
+      curr[y*TS+x] = valid_curr ? m[curr_off] : 0.0;
+   }
+
+   // Diagonal block: diag(y, x) -= diag(y, i) * diag(x, i) / diag(i, i)
+   for (int i=0; i<TS; i++) {
+
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      real p = diag[i*TS+i];
+
+      #pragma unroll
+      for (int k=0; k<WPT; k++) {
+         int y = y0 + k*RTS;
+         if (x > i && x <= y) diag[y*TS+x] -= diag[y*TS+i] * diag[x*TS+i] / p;
+      }
+   }
+
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   // Scale the columns by the square root of their pivot
+   real l[WPT];
+
+   #pragma unroll
+   for (int k=0; k<WPT; k++) {
+      int y = y0 + k*RTS;
+      l[k] = (x <= y ? diag[y*TS+x] / sqrt(diag[x*TS+x]) : 0.0);
+   }
+
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   #pragma unroll
+   for (int k=0; k<WPT; k++) {
+      int y = y0 + k*RTS;
+      diag[y*TS+x] = l[k];
+   }
+
+   // Sub-diagonal block: curr(y, x) -= curr(y, i) * diag(x, i) / diag(i, i)
+   for (int i=0; i<TS; i++) {
+
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      real lx = diag[x*TS+i] / diag[i*TS+i];
+
+      #pragma unroll
+      for (int k=0; k<WPT; k++) {
+         int y = y0 + k*RTS;
+         if (x > i) curr[y*TS+x] -= curr[y*TS+i] * lx;
+      }
+   }
+
+   __local int last;
+
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   if (x == 0 && y0 == 0) last = (atomic_inc(&done[step]) == get_num_groups(1)-1);
+
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   real d = diag[x*TS+x];
+
+   #pragma unroll
+   for (int k=0; k<WPT; k++) {
+      int y = y0 + k*RTS;
+
+      int valid_curr = ((step+1+gy)*TS+y < n);
+      size_t curr_off = tile_off(step+1+gy, step) + y*TS + x;
+      if (valid_curr) m[curr_off] = curr[y*TS+x] / d;
+
+      int valid = (step*TS+x < n && step*TS+y < n && x <= y);
+      size_t diag_off = tile_off(step, step) + y*(y+1)/2 + x;
+      if (last && valid) m[diag_off] = diag[y*TS+x];
+   }
+
+}
@@ -0,0 +1,200 @@
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+
+// Tile size and rows per work-item, given at build time with
+// -D TS=<size> -D WPT=<rows> (TS must be divisible by WPT)
+#ifndef TS
+#define TS 16
+#endif
+#ifndef WPT
+#define WPT 1
+#endif
+
+// Work-group height
+#define RTS (TS/WPT)
+
+// Row stride of local tiles read by column (avoids bank conflicts)
+#define LS (TS+1)
+
+// Offset of tile (Y, X) with X <= Y in the packed lower-triangular tile storage:
+// lower tiles row after row, diagonal tiles only store their lower triangle
+size_t tile_off(size_t Y, size_t X) {
+   return Y*(Y+1)/2*(TS*TS) - Y*(TS*TS - TS*(TS+1)/2) + X*(TS*TS);
+}
+
+/**
+ * Substitution with a diagonal block: rhsBlock = diagBlock^-1 * rhsBlock
+ * (forward), or diagBlock^-T * rhsBlock (backward) (version 1.0)
+ *
+ * Parameters:
+ *  - diagBlock : factored diagonal block (packed lower-triangular tiles)
+ *  - rhsBlock : right-hand sides of the block (row-major, n x nrhs)
+ *  - n : block width (multiple of TS)
+ *  - nrhs : number of right-hand sides (multiple of TS)
+ *  - trans : 0 for the forward substitution, 1 for the backward one
+ *
+ * Call with:
+ *  - global : nrhs x TS/WPT
+ !  - local : TS x TS/WPT
+ *
+ * Each work-group solves TS right-hand sides, one tile of TS rows after the
+ * other (last tile first for the backward substitution), as dtrsm_block does
+ * for the rows of a panel: tile products of the solved tiles accumulated in
+ * registers, then the diagonal tile solved with one work-item per
+ * right-hand side.
+ *
+ */
+__kernel void dtrsm_rhs(__global const double * diagBlock, __global double * rhsBlock, unsigned long n, unsigned long nrhs, int trans) {
+
+   int x = get_local_id(0);
+   int y0 = get_local_id(1);
+   size_t col = get_global_id(0);
+
+   __local double b[TS*TS];      // tile of the right-hand sides
+   __local double l[TS*LS];      // tile of the diagonal block, op(L)(y, i) in l[y*LS+i]
+
+   size_t tiles = n/TS;
+
+   for (size_t jj=0; jj<tiles; jj++) {
+      size_t j = (trans ? tiles-1-jj : jj);
+
+      double acc[WPT];
+
+      #pragma unroll
+      for (int k=0; k<WPT; k++) {
+         int y = y0 + k*RTS;
+         acc[k] = rhsBlock[(j*TS+y)*nrhs + col];
+      }
+
+      // acc(y, x) -= sum over solved tiles t of op(L)(j, t) * B(t, x)
+      for (size_t tt=0; tt<jj; tt++) {
+         size_t t = (trans ? tiles-1-tt : tt);
+
+         #pragma unroll
+         for (int k=0; k<WPT; k++) {
+            int y = y0 + k*RTS;
+            b[y*TS+x] = rhsBlock[(t*TS+y)*nrhs + col];
+            if (trans) l[x*LS+y] = diagBlock[tile_off(t, j) + y*TS + x];
+            else l[y*LS+x] = diagBlock[tile_off(j, t) + y*TS + x];
+         }
+
+         barrier(CLK_LOCAL_MEM_FENCE);
+
+         for (int i=0; i<TS; i++) {
+            double bx = b[i*TS+x];
+            #pragma unroll
+            for (int k=0; k<WPT; k++) {
+               int y = y0 + k*RTS;
+               acc[k] -= l[y*LS+i] * bx;
+            }
+         }
+
+         barrier(CLK_LOCAL_MEM_FENCE);
+      }
+
+      // Diagonal tile (lower triangle, read transposed by the backward substitution)
+      #pragma unroll
+      for (int k=0; k<WPT; k++) {
+         int y = y0 + k*RTS;
+         b[y*TS+x] = acc[k];
+         l[y*LS+x] = (x <= y ? diagBlock[tile_off(j, j) + y*(y+1)/2 + x] : 0.0);
+      }
+
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      if (y0 == 0) {
+         for (int r=0; r<TS; r++) {
+            int c = (trans ? TS-1-r : r);
+            double v = b[c*TS+x];
+            if (trans) {
+               for (int i=c+1; i<TS; i++) {
+                  v -= l[i*LS+c] * b[i*TS+x];
+               }
+            }
+            else {
+               for (int i=0; i<c; i++) {
+                  v -= l[c*LS+i] * b[i*TS+x];
+               }
+            }
+            b[c*TS+x] = v / l[c*LS+c];
+         }
+      }
+
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      #pragma unroll
+      for (int k=0; k<WPT; k++) {
+         int y = y0 + k*RTS;
+         rhsBlock[(j*TS+y)*nrhs + col] = b[y*TS+x];
+      }
+
+      // The solved tile is read back by the next updates, b and l are reused
+      barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+   }
+
+}
+
+/**
+ * Update of right-hand sides: c = c - a * b, or c - a^T * b (version 1.0)
+ *
+ * Parameters:
+ *  - a : sub-diagonal block of the factor (row-major, n x n)
+ *  - b : solved right-hand sides (row-major, n x nrhs)
+ *  - c : right-hand sides to update (row-major, n x nrhs)
+ *  - n : block width (multiple of TS)
+ *  - nrhs : number of right-hand sides (multiple of TS)
+ *  - trans : 0 for the forward substitution (a), 1 for the backward one (a^T)
+ *
+ * Call with:
+ *  - global : nrhs x n/WPT
+ !  - local : TS x TS/WPT
+ *
+ */
+__kernel void dgemm_rhs(__global const double * a, __global const double * b, __global double * c, unsigned long n, unsigned long nrhs, int trans) {
+
+   int x = get_local_id(0);
+   int y0 = get_local_id(1);
+   size_t col = get_global_id(0);
+   size_t row0 = get_group_id(1) * TS;
+
+   __local double la[TS*LS];     // tile of op(a), op(a)(y, i) in la[y*LS+i]
+   __local double lb[TS*TS];
+
+   double acc[WPT];
+
+   #pragma unroll
+   for (int k=0; k<WPT; k++) {
+      acc[k] = 0.0;
+   }
+
+   for (size_t t=0; t<n/TS; t++) {
+
+      #pragma unroll
+      for (int k=0; k<WPT; k++) {
+         int y = y0 + k*RTS;
+         lb[y*TS+x] = b[(t*TS+y)*nrhs + col];
+         // Both read along the rows of a (coalesced)
+         if (trans) la[x*LS+y] = a[(t*TS+y)*n + row0 + x];
+         else la[y*LS+x] = a[(row0+y)*n + t*TS + x];
+      }
+
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      for (int i=0; i<TS; i++) {
+         double bx = lb[i*TS+x];
+         #pragma unroll
+         for (int k=0; k<WPT; k++) {
+            int y = y0 + k*RTS;
+            acc[k] += la[y*LS+i] * bx;
+         }
+      }
+
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+
+   #pragma unroll
+   for (int k=0; k<WPT; k++) {
+      int y = y0 + k*RTS;
+      c[(row0+y)*nrhs + col] -= acc[k];
+   }
+
+}
@@ -1,135 +1,114 @@
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
 
-#define OP_N 1
-#define OP_T 2
-#define OP_C 3
-
-#define UPLO_U 1
-#define UPLO_L 2
-
-#define c(x,y) c[x*ldc+y]
-
-int dsyrk(int uplo, int trans, int n, int k, double alpha, double *a, int lda, doublr beta, double *c, int ldc) {
-
-  int i,j;
-
-  int nrowa = trans == OP_N ? n : k;
-  int upper = (uplo == UPLO_U);
-
-  int info = 0;
-  if (!upper && uplo != UPLO_L) info = 1
-  else if (trans != OP_N && trans != OP_T && trans != OP_C) info =2
-  else if (n < 0) info = 3
-  else if (k < 0) info = 4
-  else if (lda < max(1,nrowa)) info = 7
-  else if (ldc < max(1,n)) info = 10;
-
-  if (info != 0) return info;
-
-  /* Quick return if possible. */
-  if (n == 0 || alpha == 0.0 || k == 0 || beta == 1.0) return;
-  
-  int gx = get_global_id(0);
-  int gy = get_global_id(1);
-
-
-  /* And when alpha.eq.zero. */
-  if (alpha == 0.0) {
-    if (upper) {
-      if (beta == 0.0) if (gy < n && gx < gy) c(gx,gy) = 0.0
-      else if (gy < n && gx < gy) c(gx,gy) *= beta;
-    }
-    else {
-      if (beta == 0.0) if (gy < n && gx >= gy && gx < n) c(gx,gy) = 0.0
-      else if (gy < n && gx >= gy && gx < n) c(gx,gy) *= beta;
-    }
-  }
-            
-    
-  /* Start the operations. */
-  if (trans == OP_N) {
-
-    /* Form  C := alpha*A*A**T + beta*C. */
-
-    if (u
-
-      IF (LSAME(TRANS,'N')) THEN
-*
-*        Form  C := alpha*A*A**T + beta*C.
-*
-          IF (UPPER) THEN
-              DO 130 J = 1,N
-                  IF (BETA.EQ.ZERO) THEN
-                      DO 90 I = 1,J
-                          C(I,J) = ZERO
-   90                 CONTINUE
-                  ELSE IF (BETA.NE.ONE) THEN
-                      DO 100 I = 1,J
-                          C(I,J) = BETA*C(I,J)
-  100                 CONTINUE
-                  END IF
-                  DO 120 L = 1,K
-                      IF (A(J,L).NE.ZERO) THEN
-                          TEMP = ALPHA*A(J,L)
-                          DO 110 I = 1,J
-                              C(I,J) = C(I,J) + TEMP*A(I,L)
-  110                     CONTINUE
-                      END IF
-  120             CONTINUE
-  130         CONTINUE
-          ELSE
-              DO 180 J = 1,N
-                  IF (BETA.EQ.ZERO) THEN
-                      DO 140 I = J,N
-                          C(I,J) = ZERO
-  140                 CONTINUE
-                  ELSE IF (BETA.NE.ONE) THEN
-                      DO 150 I = J,N
-                          C(I,J) = BETA*C(I,J)
-  150                 CONTINUE
-                  END IF
-                  DO 170 L = 1,K
-                      IF (A(J,L).NE.ZERO) THEN
-                          TEMP = ALPHA*A(J,L)
-                          DO 160 I = J,N
-                              C(I,J) = C(I,J) + TEMP*A(I,L)
-  160                     CONTINUE
-                      END IF
-  170             CONTINUE
-  180         CONTINUE
-          END IF
-      ELSE
-*
-*        Form  C := alpha*A**T*A + beta*C.
-*
-          IF (UPPER) THEN
-              DO 210 J = 1,N
-                  DO 200 I = 1,J
-                      TEMP = ZERO
-                      DO 190 L = 1,K
-                          TEMP = TEMP + A(L,I)*A(L,J)
-  190                 CONTINUE
-                      IF (BETA.EQ.ZERO) THEN
-                          C(I,J) = ALPHA*TEMP
-                      ELSE
-                          C(I,J) = ALPHA*TEMP + BETA*C(I,J)
-                      END IF
-  200             CONTINUE
-  210         CONTINUE
-          ELSE
-              DO 240 J = 1,N
-                  DO 230 I = J,N
-                      TEMP = ZERO
-                      DO 220 L = 1,K
-                          TEMP = TEMP + A(L,I)*A(L,J)
-  220                 CONTINUE
-                      IF (BETA.EQ.ZERO) THEN
-                          C(I,J) = ALPHA*TEMP
-                      ELSE
-                          C(I,J) = ALPHA*TEMP + BETA*C(I,J)
-                      END IF
-  230             CONTINUE
-  240         CONTINUE
-          END IF
-      END IF
-*
-      RETURN
+// Tile size of the packed diagonal blocks, given at build time with
+// -D TS=<size>
+#ifndef TS
+#define TS 16
+#endif
+
+// Each work-item computes an MT x MT micro-tile of the output, given at
+// build time with -D MT=<size> (the block width must be a multiple of 16*MT)
+#ifndef MT
+#define MT 4
+#endif
+
+// Output tile of a work-group of 16 x 16 work-items
+#define OT (16*MT)
+
+// Offset of tile (Y, X) with X <= Y in the packed lower-triangular tile storage:
+// lower tiles row after row, diagonal tiles only store their lower triangle
+size_t tile_off(size_t Y, size_t X) {
+   return Y*(Y+1)/2*(TS*TS) - Y*(TS*TS - TS*(TS+1)/2) + X*(TS*TS);
+}
+
+#include "blocks.cl"
+
+/**
+ * Symmetric rank-k update of diagonal blocks per big block (version 2)
+ *
+ * Parameters:
+ *  - aBlock : sub-diagonal block of the row (n x n)
+ *  - cBlock : current diagonal block (packed lower-triangular tiles)
+ *  - n : block width (multiple of 16*MT)
+ *
+ * Call with:
+ *  - global : (16*t) x 16 with t = b*(b+1)/2, b = n/(16*MT)
+ !  - local : 16 x 16
+ *
+ * cBlock -= aBlock * aBlock^T on the lower triangle only, computed as
+ * dgemm_block (version 2) does: each work-item accumulates its micro-tile in
+ * registers, from 16-column panels of aBlock staged in local memory. As in
+ * dgemm, the linear group id is mapped to an output tile (gy, gx) with
+ * gx <= gy, so tiles of the upper triangle are never computed.
+ *
+ */
+__kernel void dsyrk(__global const double * aBlock, __global double * cBlock, unsigned long n) {
+
+   int x = get_local_id(0);
+   int y = get_local_id(1);
+
+   int lid = y*16+x;
+
+   // Linear group id g -> (gy, gx) with g = gy*(gy+1)/2 + gx
+   int g = get_group_id(0);
+   int gy = block_row(g);
+   int gx = g - gy*(gy+1)/2;
+
+   int row0 = gy*OT;       // first row of the tile
+   int col0 = gx*OT;       // first column of the tile
+
+   // Panels are stored transposed (k-major) so that the inner loop reads
+   // consecutive rows for consecutive work-items
+   __local double a[16*OT];
+   __local double b[16*OT];
+
+   double res[MT][MT];
+   for (int i=0; i<MT; i++) {
+      for (int j=0; j<MT; j++) {
+         res[i][j] = 0.0;
+      }
+   }
+
+   for (size_t k=0; k<n; k+=16) {
+
+      // Each work-item loads MT elements of each panel: rows of tile gy and
+      // rows of tile gx of aBlock
+      for (int t=0; t<MT; t++) {
+         int e = lid + t*256;
+         int r = e / 16;
+         int kk = e % 16;
+         a[kk*OT+r] = aBlock[(row0+r)*n + k + kk];
+         b[kk*OT+r] = aBlock[(col0+r)*n + k + kk];
+      }
+
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      for (int kk=0; kk<16; kk++) {
+         double ra[MT], rb[MT];
+         for (int i=0; i<MT; i++) {
+            ra[i] = a[kk*OT + y + i*16];
+            rb[i] = b[kk*OT + x + i*16];
+         }
+         for (int i=0; i<MT; i++) {
+            for (int j=0; j<MT; j++) {
+               res[i][j] += ra[i] * rb[j];
+            }
+         }
+      }
+
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+
+   // The upper triangle of diagonal tiles is not stored
+   for (int i=0; i<MT; i++) {
+      for (int j=0; j<MT; j++) {
+         int r = row0 + y + i*16;
+         int c = col0 + x + j*16;
+         if (c <= r) {
+            int ty = r/TS, tx = c/TS, yy = r%TS;
+            cBlock[tile_off(ty, tx) + (tx == ty ? yy*(yy+1)/2 : yy*TS) + c%TS] -= res[i][j];
+         }
+      }
+   }
+
+}
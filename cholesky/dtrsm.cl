@@ -1,51 +1,89 @@
 #pragma OPENCL EXTENSION cl_khr_fp64 : enable
 
+// Tile size and rows per work-item, given at build time with
+// -D TS=<size> -D WPT=<rows> (TS must be divisible by WPT)
+#ifndef TS
+#define TS 16
+#endif
+#ifndef WPT
+#define WPT 1
+#endif
+
+// Work-group height
+#define RTS (TS/WPT)
+
+// Offset of tile (Y, X) with X <= Y in the packed lower-triangular tile storage:
+// lower tiles row after row, diagonal tiles only store their lower triangle
+size_t tile_off(size_t Y, size_t X) {
+   return Y*(Y+1)/2*(TS*TS) - Y*(TS*TS - TS*(TS+1)/2) + X*(TS*TS);
+}
+
 /**
  * Update sub-diagonal blocks (version 1.0)
- * 
- * Parameters: 
- *  - m : matrix
- *  - n : matrix width
- *  - step : iteration (in step of 16 columns)
+ *
+ * Parameters:
+ *  - m : matrix (packed lower-triangular tiles)
+ *  - n : matrix width (any value, rows past n in the last block are masked)
+ *  - step : iteration (in step of TS columns)
  *
  * Call with:
- *  - global : 16 x (n-step*16)
- !  - local : 16 x 16
- * 
+ *  - global : TS x (n-(step+1)*TS rounded up to a multiple of TS)/WPT
+ !  - local : TS x TS/WPT
+ *
+ * Each work-item handles WPT rows of its block (rows y, y+TS/WPT, ...).
+ *
  */
 __kernel void dtrsm(__global double * m, unsigned long n, unsigned long step) {
-   
+
    int x = get_local_id(0);
-   int y = get_local_id(1);
-   int Y = get_global_id(1);
+   int y0 = get_local_id(1);
    int gy = get_group_id(1);
 
-   int off = y*16+x;                // local offset
-   int diag_off = step*16*(n+1) + y*n + x;       // global diagonal block offset
-   int curr_off = diag_off + (gy+1)*n*16;   // global current block offset
-
    // Load diagonal block and current block
-   __local double diag[16*16];
-   __local double curr[16*16];
-   diag[off] = m[diag_off];
-   curr[off] = m[curr_off];
+   // The diagonal block is never partial here (there would be no block below it)
+   __local double diag[TS*TS];
+   __local double curr[TS*TS];
+
+   #pragma unroll
+   for (int k=0; k<WPT; k++) {
+      int y = y0 + k*RTS;
+      size_t diag_off = tile_off(step, step) + y*(y+1)/2 + x;       // global diagonal block offset
+      size_t curr_off = tile_off(step+1+gy, step) + y*TS + x;       // global current block offset
+      int valid = ((step+1+gy)*TS+y < n);
+      diag[y*TS+x] = (x <= y ? m[diag_off] : 0.0);
+      curr[y*TS+x] = valid ? m[curr_off] : 0.0;
+   }
 
    barrier(CLK_LOCAL_MEM_FENCE);
 
-   for (int i=0; i<16; i++) {
+   for (int i=0; i<TS; i++) {
 
-      double d = diag[i*16+i];
+      double d = diag[i*TS+i];
 
-      if (x == i) curr[off] /= d;
+      #pragma unroll
+      for (int k=0; k<WPT; k++) {
+         int y = y0 + k*RTS;
+         if (x == i) curr[y*TS+x] /= d;
+      }
 
       barrier(CLK_LOCAL_MEM_FENCE);
 
-      if (x > i) curr[off] -= curr[y*16+i] * diag[x*16+i];
+      #pragma unroll
+      for (int k=0; k<WPT; k++) {
+         int y = y0 + k*RTS;
+         if (x > i) curr[y*TS+x] -= curr[y*TS+i] * diag[x*TS+i];
+      }
 
       barrier(CLK_LOCAL_MEM_FENCE);
    }
 
-   m[curr_off] = curr[off]; 
-   
+   #pragma unroll
+   for (int k=0; k<WPT; k++) {
+      int y = y0 + k*RTS;
+      size_t curr_off = tile_off(step+1+gy, step) + y*TS + x;
+      int valid = ((step+1+gy)*TS+y < n);
+      if (valid) m[curr_off] = curr[y*TS+x];
+   }
+
 }
 
@@ -1,49 +1,129 @@
 #pragma OPENCL EXTENSION cl_khr_fp64 : enable
 
+// Tile size and rows per work-item, given at build time with
+// -D TS=<size> -D WPT=<rows> (TS must be divisible by WPT)
+#ifndef TS
+#define TS 16
+#endif
+#ifndef WPT
+#define WPT 1
+#endif
+
+// Work-group height
+#define RTS (TS/WPT)
+
+// Row stride of local tiles read by column (avoids bank conflicts)
+#define LS (TS+1)
+
+// Offset of tile (Y, X) with X <= Y in the packed lower-triangular tile storage:
+// lower tiles row after row, diagonal tiles only store their lower triangle
+size_t tile_off(size_t Y, size_t X) {
+   return Y*(Y+1)/2*(TS*TS) - Y*(TS*TS - TS*(TS+1)/2) + X*(TS*TS);
+}
+
 /**
- * Update sub-diagonal blocks per line
- * 
- * Parameters: 
- *  - diagBlock : diagonal block
- *  - currBlock : current sub-diagonal block
+ * Update sub-diagonal blocks: currBlock = currBlock * diagBlock^-T (version 2.0)
+ *
+ * Parameters:
+ *  - diagBlock : factored diagonal block (packed lower-triangular tiles)
+ *  - currBlock : current sub-diagonal block (row-major)
+ *  - n : block width (multiple of TS)
  *
  * Call with:
- *  - global : n x n
- *  - local : n x 1     (n <= 512)
- * 
+ *  - global : TS x n/WPT
+ !  - local : TS x TS/WPT
+ *
+ * Each work-group solves TS rows of the block, one tile of TS columns after
+ * the other. Tile j first gets the update of the tiles already solved, as
+ * tile products accumulated in registers (one element per row of the work-
+ * item). The TS x TS triangular system of diagonal tile j is then solved
+ * one column after the other by all the work-items, with a barrier per
+ * column.
+ *
  */
-__kernel void dtrsm_block(__global double * diagBlock, __global double * currBlock) {
-   
-   int X = get_global_id(0);
-   int Y = get_global_id(1);
+__kernel void dtrsm_block(__global const double * diagBlock, __global double * currBlock, unsigned long n) {
 
-   int w = get_global_size(0);
+   int x = get_local_id(0);
+   int y0 = get_local_id(1);
+   size_t row0 = get_group_id(1) * TS;
 
-   __local double diag[512];
-   __local double curr[512];
+   __local double b[TS*TS];      // tile of the rows of the work-group
+   __local double l[TS*LS];      // tile of the diagonal block
 
-   curr[X] = currBlock[X + Y*w];
+   for (size_t j=0; j<n/TS; j++) {
 
-   double my = 0.0;
+      double acc[WPT];
 
-   for (int i=0; i<w; i++) {
+      #pragma unroll
+      for (int k=0; k<WPT; k++) {
+         int y = y0 + k*RTS;
+         acc[k] = currBlock[(row0+y)*n + j*TS + x];
+      }
 
-      if (X >= i) diag[X] = diagBlock[i + X*w];
-   
-      barrier(CLK_LOCAL_MEM_FENCE);
+      // acc(y, x) -= sum over solved tiles t of B(y, t) * L(j, t)^T
+      for (size_t t=0; t<j; t++) {
+
+         #pragma unroll
+         for (int k=0; k<WPT; k++) {
+            int y = y0 + k*RTS;
+            b[y*TS+x] = currBlock[(row0+y)*n + t*TS + x];
+            l[y*LS+x] = diagBlock[tile_off(j, t) + y*TS + x];
+         }
 
-      if (X == i) {
-         curr[i] = (curr[i] - my) / diag[i];
+         barrier(CLK_LOCAL_MEM_FENCE);
+
+         for (int i=0; i<TS; i++) {
+            double lx = l[x*LS+i];
+            #pragma unroll
+            for (int k=0; k<WPT; k++) {
+               int y = y0 + k*RTS;
+               acc[k] -= b[y*TS+i] * lx;
+            }
+         }
+
+         barrier(CLK_LOCAL_MEM_FENCE);
+      }
+
+      // Diagonal tile, solved column by column: column c is final once the
+      // work-items of column c divide it, the next ones then subtract it
+      #pragma unroll
+      for (int k=0; k<WPT; k++) {
+         int y = y0 + k*RTS;
+         l[y*LS+x] = (x <= y ? diagBlock[tile_off(j, j) + y*(y+1)/2 + x] : 0.0);
       }
 
       barrier(CLK_LOCAL_MEM_FENCE);
 
-      if (X > i) my += curr[i] * diag[X];
+      for (int c=0; c<TS; c++) {
+         if (x == c) {
+            #pragma unroll
+            for (int k=0; k<WPT; k++) {
+               int y = y0 + k*RTS;
+               acc[k] /= l[c*LS+c];
+               b[y*TS+c] = acc[k];
+            }
+         }
 
-      barrier(CLK_LOCAL_MEM_FENCE);
+         barrier(CLK_LOCAL_MEM_FENCE);
+
+         if (x > c) {
+            double lx = l[x*LS+c];
+            #pragma unroll
+            for (int k=0; k<WPT; k++) {
+               int y = y0 + k*RTS;
+               acc[k] -= b[y*TS+c] * lx;
+            }
+         }
+      }
+
+      #pragma unroll
+      for (int k=0; k<WPT; k++) {
+         int y = y0 + k*RTS;
+         currBlock[(row0+y)*n + j*TS + x] = acc[k];
+      }
+
+      // The solved tile is read back by the next updates, b and l are reused
+      barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
    }
 
-   currBlock[X+Y*w] = curr[X]; 
-   
 }
-
@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "matgen.h"
+
+// Rows/columns per block and reduction length per pass (block sized for L1/L2)
+#define BLOCK 64
+#define ZBLOCK 256
+
+typedef struct {
+   size_t n;
+   matgen_factor L;
+   matgen_element A;
+   void * arg;
+   double * l;          // lower triangle of L, row y at offset y*(y+1)/2
+   int thread;
+   int threads;
+} matgen_task;
+
+static inline double * row(double * l, size_t y) {
+   return l + y*(y+1)/2;
+}
+
+static void * fillFactor(void * p) {
+   matgen_task * t = p;
+   size_t x, y;
+
+   for (y=t->thread; y<t->n; y+=t->threads) {
+      double * ly = row(t->l, y);
+      for (x=0; x<=y; x++) {
+         ly[x] = t->L(x, y, t->arg);
+      }
+   }
+   return NULL;
+}
+
+static void * fillMatrix(void * p) {
+   matgen_task * t = p;
+   size_t n = t->n;
+   size_t nb = (n+BLOCK-1)/BLOCK;
+   double acc[BLOCK][BLOCK];
+   size_t Y, X, x, y, z;
+
+   // Block rows are distributed cyclically (later rows are more expensive)
+   for (Y=t->thread; Y<nb; Y+=t->threads) {
+      size_t y0 = Y*BLOCK, y1 = (y0+BLOCK < n ? y0+BLOCK : n);
+
+      for (X=0; X<=Y; X++) {
+         size_t x0 = X*BLOCK, x1 = (x0+BLOCK < n ? x0+BLOCK : n);
+
+         for (y=y0; y<y1; y++) {
+            for (x=x0; x<x1; x++) {
+               acc[y-y0][x-x0] = 0.0;
+            }
+         }
+
+         // A(y,x) = sum over z <= x of L(z,y) * L(z,x)
+         size_t z0;
+         for (z0=0; z0<x1; z0+=ZBLOCK) {
+            for (y=y0; y<y1; y++) {
+               double * ly = row(t->l, y);
+               for (x=x0; x<x1 && x<=y; x++) {
+                  if (z0 > x) continue;
+                  double * lx = row(t->l, x);
+                  size_t z1 = (z0+ZBLOCK <= x ? z0+ZBLOCK : x+1);
+                  double sum = 0.0;
+                  for (z=z0; z<z1; z++) {
+                     sum += ly[z] * lx[z];
+                  }
+                  acc[y-y0][x-x0] += sum;
+               }
+            }
+         }
+
+         for (y=y0; y<y1; y++) {
+            for (x=x0; x<x1 && x<=y; x++) {
+               *t->A(y, x, t->arg) = acc[y-y0][x-x0];
+            }
+         }
+      }
+   }
+   return NULL;
+}
+
+static void run(matgen_task * tasks, int threads, void * (*fn)(void *)) {
+   pthread_t ids[threads];
+   int started[threads];
+   int i;
+   for (i=1; i<threads; i++) {
+      started[i] = (pthread_create(&ids[i], NULL, fn, &tasks[i]) == 0);
+      // Run it ourselves if the thread cannot be created
+      if (!started[i]) fn(&tasks[i]);
+   }
+   fn(&tasks[0]);
+   for (i=1; i<threads; i++) {
+      if (started[i]) pthread_join(ids[i], NULL);
+   }
+}
+
+void generateSPD(size_t n, matgen_factor L, matgen_element A, void * arg, int threads) {
+
+   if (threads <= 0) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = (cpus > 0 ? cpus : 1);
+   }
+
+   double * l = malloc(n*(n+1)/2 * sizeof(double));
+
+   matgen_task tasks[threads];
+   int i;
+   for (i=0; i<threads; i++) {
+      tasks[i].n = n;
+      tasks[i].L = L;
+      tasks[i].A = A;
+      tasks[i].arg = arg;
+      tasks[i].l = l;
+      tasks[i].thread = i;
+      tasks[i].threads = threads;
+   }
+
+   run(tasks, threads, fillFactor);
+   run(tasks, threads, fillMatrix);
+
+   free(l);
+}
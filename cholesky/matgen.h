@@ -0,0 +1,20 @@
+#ifndef MATGEN_H
+#define MATGEN_H
+
+#include <stddef.h>
+
+/* Reference factor: returns L(x, y) for x <= y */
+typedef double (*matgen_factor)(size_t x, size_t y, void * arg);
+
+/* Returns where element (y, x) of A (x <= y) is stored */
+typedef double * (*matgen_element)(size_t y, size_t x, void * arg);
+
+/* Compute the lower triangle of the SPD matrix A = L*Lt of size n.
+ *
+ * L is evaluated once per element, then A is computed by blocks of rows and
+ * columns distributed over "threads" threads (0 for one per online CPU).
+ * "arg" is given to both callbacks.
+ */
+void generateSPD(size_t n, matgen_factor L, matgen_element A, void * arg, int threads);
+
+#endif
@@ -1,19 +1,70 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include <float.h>
 #include <string.h>
+#include <unistd.h>
 #include <CL/cl.h>
 
-// Buffer size (max 512 because of dtrsm_block, must be divisible by 16)
+#include "session.h"
+#include "packed.h"
+#include "matgen.h"
+#include "profiling.h"
+#include "runtime.h"
+#include "tile_cache.h"
+#include "tiled_file.h"
+#include "tuning.h"
+#include "residual.h"
+
+// Buffer size (must be divisible by 16, divisible by 64 to use the
+// register-blocked dgemm_block)
 #define N 64
 // Buffer count (whole matrix size = N*BCOUNT ^ 2)
+// Only the lower buffers are stored, diagonal ones with the packed layout of packed.h
+// (16x16 tiles, the default tile size of the kernels)
 #define BCOUNT 5
+// Max sub-devices a device is split into for the native schedulers
+#define SUB_DEVICES 4
+// Right-hand sides solved after the factorization (multiple of 16), one
+// block of N rows per block row of the matrix (row-major)
+#define NRHS 16
+
+// Schedulers: session queue, static owner-computes mapping over the
+// devices, dynamic runtime over the devices (runtime.h)
+#define SCHED_QUEUE 0
+#define SCHED_STATIC 1
+#define SCHED_DYNAMIC 2
+// Out-of-core mode: the matrix stays in host memory and blocks are streamed
+// through a device cache (tile_cache.h) on the session queue
+#define SCHED_OUT_OF_CORE 3
+
+// Device blocks of the out-of-core mode (the matrix has BCOUNT*(BCOUNT+1)/2)
+#define CACHE_BLOCKS 6
+// Tasks whose blocks are loaded ahead of time
+#define CACHE_PREFETCH 2
 double epsilon = 10e-8;
+// Max backward error of the factor, ||A - L*Lt|| / ||A|| (Frobenius norms),
+// in units of n*eps as in multi_kernel
+double residual_epsilon = 30.0 * N * BCOUNT * DBL_EPSILON;
+// Max normwise backward error of the solves, ||B - A X|| / (||A|| ||X||)
+double solve_epsilon = 1e-13;
+// The matrix is generated from L and factors are also checked against it
+// element by element (not a matrix read from a file)
+int check_factor = 1;
+
+// Optional Chrome trace of every factorization (see profileTrace)
+FILE * trace = NULL;
+int trace_events = 0;
+int trace_pid = 0;
 
 #define min(a,b) ( a < b ? a : b)
 
-int performCholesky(double * mat[BCOUNT][BCOUNT], cl_ulong n, cl_int nb_dev, cl_device_id * devs, double epsilon, int * errCount, double * maxDiff, cl_ulong * duration, char ** log);
-void benchDev(double * mat[BCOUNT][BCOUNT], cl_int nb_dev, cl_device_id * devs);
+int performCholesky(session * s, int mode, double * mat[BCOUNT][BCOUNT], double * res[BCOUNT][BCOUNT], double * rhs[BCOUNT], double * sol[BCOUNT], cl_ulong n, double epsilon, int * errCount, double * maxDiff, double * residual, double * berr, cache_stats * stats, profile * prof, cl_ulong * duration, char ** log);
+void benchDev(double * mat[BCOUNT][BCOUNT], double * rhs[BCOUNT], cl_int nb_dev, cl_device_id * devs, int mode, int runs);
+void benchSubDevices(double * mat[BCOUNT][BCOUNT], double * rhs[BCOUNT], cl_device_id dev, int runs);
+int factorFile(tiled_file * f, double * mat[BCOUNT][BCOUNT], double * rhs[BCOUNT], cl_device_id dev);
+cl_int factorResidual(session * s, cl_mem (*buf)[BCOUNT], double * mat[BCOUNT][BCOUNT], double * res[BCOUNT][BCOUNT], cl_ulong n, double * residual, char ** log);
 
 #pragma weak clGetExtensionFunctionAddressForPlatform
 extern void * clGetExtensionFunctionAddressForPlatform(cl_platform_id, const char *);
@@ -26,411 +77,1649 @@ extern void * clGetExtensionFunctionAddress(const char *);
 
 #define L(x,y) (100.0 / ((double)(x+y)+100.0))
 
-int main() {
+double factor(size_t x, size_t y, void * arg) {
+   return L(x,y);
+}
+
+double * element(size_t y, size_t x, void * arg) {
+   double * (*mat)[BCOUNT] = arg;
+   size_t X = x/N;
+   size_t Y = y/N;
+   y %= N;
+   x %= N;
+   return mat[Y][X] + (X == Y ? packedIndex(y, x, 16) : y*N+x);
+}
+
+/* Element (y, x) of the symmetric matrix, lower blocks only stored */
+double symmetric(double * mat[BCOUNT][BCOUNT], size_t y, size_t x) {
+   return (x <= y ? *element(y, x, mat) : *element(x, y, mat));
+}
+
+int main(int argc, char ** argv) {
+
+   int X, Y;
+
+   // Factorizations per device, all run through the same session
+   int runs = (argc > 1 ? atoi(argv[1]) : 1);
+   if (runs <= 0) {
+      fprintf(stderr, "Usage: %s [runs] [trace.json|-] [matrix file (size %d in blocks of %d, tiles of 16)]\n", argv[0], N*BCOUNT, N);
+      return 1;
+   }
+
+   if (argc > 2 && strcmp(argv[2], "-") != 0) {
+      trace = fopen(argv[2], "w");
+      if (trace == NULL) {
+         fprintf(stderr, "Unable to open trace file %s\n", argv[2]);
+         return 1;
+      }
+      fprintf(trace, "[\n");
+   }
+
+   double * mat[BCOUNT][BCOUNT];
+   char * log;
+
+   // The matrix is either in memory or in a mapped file (tiled_file.h),
+   // generated if the file does not exist and factored in place at the end.
+   // Sizes are compile-time constants: files of other sizes are rejected.
+   tiled_file * file = NULL;
+   int generate = 1;
+
+   if (argc > 3) {
+      if (access(argv[3], F_OK) == 0) {
+         if (openTiledFile(argv[3], 1, &file, &log) != 0) {
+            fprintf(stderr, "%s\n", log);
+            return 1;
+         }
+         if (file->header->n != N*BCOUNT || file->header->block != N || file->header->tile != 16) {
+            fprintf(stderr, "%s: expected a matrix of size %d in blocks of %d (tiles of 16)\n", argv[3], N*BCOUNT, N);
+            closeTiledFile(file);
+            return 1;
+         }
+         if (file->header->factored) {
+            fprintf(stderr, "%s is already factored\n", argv[3]);
+            closeTiledFile(file);
+            return 1;
+         }
+         generate = 0;
+         check_factor = 0;
+      }
+      else if (createTiledFile(argv[3], N*BCOUNT, N, 16, &file, &log) != 0) {
+         fprintf(stderr, "%s\n", log);
+         return 1;
+      }
+   }
+
+   for (Y = 0; Y<BCOUNT; Y++) {
+      for (X = 0; X<=Y; X++) {
+         mat[Y][X] = (file != NULL ? tiledBlock(file, Y, X) : malloc((X == Y ? packedSize(N, 16) : N * N) * sizeof(double)));
+      }
+   }
+
+   if (generate) {
+      /* compute matN = L*Lt */
+      printf("Computing input matrix (size = %d x %d, %d x %d blocks)...\n", N*BCOUNT, N*BCOUNT, BCOUNT, BCOUNT);
+      generateSPD(N*BCOUNT, factor, element, mat, 0);
+   }
+   else printf("Input matrix read from %s (size = %d x %d, %d x %d blocks)\n", argv[3], N*BCOUNT, N*BCOUNT, BCOUNT, BCOUNT);
+
+   // Right-hand sides B = A * X, column j of X being j+1
+   double * rhs[BCOUNT];
+   for (Y = 0; Y<BCOUNT; Y++) {
+      rhs[Y] = malloc(N * NRHS * sizeof(double));
+   }
+
+   size_t x, y;
+   int j;
+   for (y=0; y<N*BCOUNT; y++) {
+      double sum = 0.0;
+      for (x=0; x<N*BCOUNT; x++) {
+         sum += symmetric(mat, y, x);
+      }
+      for (j=0; j<NRHS; j++) {
+         rhs[y/N][(y%N)*NRHS + j] = sum * (j+1);
+      }
+   }
+
+   cl_uint nb_platf;
+   clGetPlatformIDs(0, NULL, &nb_platf);
+
+   printf("%d OpenCL platform%s found\n", nb_platf, nb_platf > 1 ? "s" : "");
+
+   cl_platform_id platfs[nb_platf];
+   clGetPlatformIDs(nb_platf, platfs, NULL);
+
+   cl_uint p;
+   for (p=0; p<nb_platf; p++) {
+
+      size_t plat_name_size;
+      clGetPlatformInfo(platfs[p], CL_PLATFORM_NAME, 0, NULL, &plat_name_size);
+      char plat_name[plat_name_size];
+      clGetPlatformInfo(platfs[p], CL_PLATFORM_NAME, plat_name_size, &plat_name, NULL);
+
+      size_t plat_vendor_size;
+      clGetPlatformInfo(platfs[p], CL_PLATFORM_VENDOR, 0, NULL, &plat_vendor_size);
+      char plat_vendor[plat_vendor_size];
+      clGetPlatformInfo(platfs[p], CL_PLATFORM_VENDOR, plat_vendor_size, &plat_vendor, NULL);
+
+      cl_uint nb_devs;
+      clGetDeviceIDs(platfs[p], CL_DEVICE_TYPE_ALL, 0, NULL, &nb_devs);
+      printf("\nBenchmarking platform: %s (%s) - %d device%s\n\n", plat_name, plat_vendor, nb_devs, nb_devs > 1 ? "s" : "");
+
+      cl_device_id devs[nb_devs];
+      clGetDeviceIDs(platfs[p], CL_DEVICE_TYPE_ALL, nb_devs, devs, NULL);
+
+      cl_uint d;
+      for (d=0; d<nb_devs; d++) {
+         benchDev(mat, rhs, 1, &devs[d], SCHED_QUEUE, runs);
+         benchDev(mat, rhs, 1, &devs[d], SCHED_OUT_OF_CORE, runs);
+      }
+
+      // Every device of the platform, with one queue per device
+      if (nb_devs > 1) {
+         benchDev(mat, rhs, nb_devs, devs, SCHED_STATIC, runs);
+         benchDev(mat, rhs, nb_devs, devs, SCHED_DYNAMIC, runs);
+      }
+
+      // Sub-devices of each device that can be partitioned
+      for (d=0; d<nb_devs; d++) {
+         benchSubDevices(mat, rhs, devs[d], runs);
+      }
+
+      if (strstr(plat_name, "SOCL") != NULL) {
+
+         benchDev(mat, rhs, nb_devs, devs, SCHED_QUEUE, runs);
+
+         void (*clShutdown)(void) = (clGetExtensionFunctionAddressForPlatform != NULL ?
+                                     clGetExtensionFunctionAddressForPlatform(platfs[p], "clShutdown") :
+                                    (clGetExtensionFunctionAddress != NULL ?
+                                     clGetExtensionFunctionAddress("clShutdown"):
+                                     NULL));
+
+         if (clShutdown != NULL) {
+            clShutdown();
+         }
+      }
+   }
+
+   // Factor written back to the file, on the first device that is not
+   // scheduled by SOCL (shut down above)
+   if (file != NULL) {
+      int done = 0;
+      for (p=0; p<nb_platf && !done; p++) {
+         size_t plat_name_size;
+         clGetPlatformInfo(platfs[p], CL_PLATFORM_NAME, 0, NULL, &plat_name_size);
+         char plat_name[plat_name_size];
+         clGetPlatformInfo(platfs[p], CL_PLATFORM_NAME, plat_name_size, &plat_name, NULL);
+
+         cl_device_id dev;
+         if (strstr(plat_name, "SOCL") == NULL && clGetDeviceIDs(platfs[p], CL_DEVICE_TYPE_ALL, 1, &dev, NULL) == CL_SUCCESS) {
+            done = 1;
+            if (factorFile(file, mat, rhs, dev) == 0) {
+               printf("Factor written to %s\n", argv[3]);
+            }
+         }
+      }
+      closeTiledFile(file);
+   }
+
+   if (trace != NULL) {
+      fprintf(trace, "\n]\n");
+      fclose(trace);
+      printf("\nTrace written to %s\n", argv[2]);
+   }
+
+   printf("\nDone.\n");
+
+
+
+   return 0;
+}
+
+/* Factor the matrix of the file in place with the out-of-core mode: the
+ * factor blocks are transferred straight to the mapping. The input blocks
+ * are read from a copy in memory, that the backward error of the solve of
+ * rhs is computed against once the file holds the factor. */
+int factorFile(tiled_file * f, double * mat[BCOUNT][BCOUNT], double * rhs[BCOUNT], cl_device_id dev) {
+
+   size_t dev_name_size;
+   clGetDeviceInfo(dev, CL_DEVICE_NAME, 0, NULL, &dev_name_size);
+   char dev_name[dev_name_size];
+   clGetDeviceInfo(dev, CL_DEVICE_NAME, dev_name_size, dev_name, NULL);
+
+   printf("\nFactoring the matrix file in place on device %s\n", dev_name);
+
+   int errCount;
+   cl_ulong duration;
+   char * log;
+   double maxDiff, residual, berr;
+   int X, Y;
+
+   double * a[BCOUNT][BCOUNT];
+   double * sol[BCOUNT];
+   for (Y=0; Y<BCOUNT; Y++) {
+      for (X=0; X<=Y; X++) {
+         a[Y][X] = malloc(tiledBlockSize(f, Y, X));
+         memcpy(a[Y][X], mat[Y][X], tiledBlockSize(f, Y, X));
+      }
+      sol[Y] = malloc(N * NRHS * sizeof(double));
+   }
+
+   session * s;
+   int err = createSession(1, &dev, &s, &log);
+   if (err == CL_SUCCESS) {
+      err = performCholesky(s, SCHED_OUT_OF_CORE, a, mat, rhs, sol, N, epsilon, &errCount, &maxDiff, &residual, &berr, NULL, NULL, &duration, &log);
+      releaseSession(s);
+   }
+
+   for (Y=0; Y<BCOUNT; Y++) {
+      for (X=0; X<=Y; X++) {
+         free(a[Y][X]);
+      }
+      free(sol[Y]);
+   }
+
+   if (err != CL_SUCCESS) {
+      printf("  - Error %d: %s\n", err, log);
+      return -1;
+   }
+
+   int ok = (errCount == 0 && residual <= residual_epsilon && berr <= solve_epsilon);
+   printf("  - Execution time: %.3f ms and %s", duration/1e6, (ok ? "succeeded" : "failed"));
+   if (errCount > 0) {
+      printf(" (%d errors, max diff %e, epsilon %e,", errCount, maxDiff, epsilon);
+   }
+   else printf(" (");
+   printf("residual %e, backward error %e)\n", residual, berr);
+
+   f->header->factored = 1;
+   if (syncTiledFile(f, &log) != 0) {
+      printf("  - Error: %s\n", log);
+      return -1;
+   }
+
+   return 0;
+}
+
+/* Split the device in up to SUB_DEVICES equal sub-devices and benchmark the
+ * native schedulers over them */
+void benchSubDevices(double * mat[BCOUNT][BCOUNT], double * rhs[BCOUNT], cl_device_id dev, int runs) {
+
+   cl_uint max_sub = 0, units = 0;
+   if (clGetDeviceInfo(dev, CL_DEVICE_PARTITION_MAX_SUB_DEVICES, sizeof(max_sub), &max_sub, NULL) != CL_SUCCESS
+         || clGetDeviceInfo(dev, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL) != CL_SUCCESS
+         || max_sub < 2 || units < 2) {
+      return;
+   }
+
+   cl_uint parts = min(min(max_sub, units), SUB_DEVICES);
+   cl_device_partition_property props[] = {CL_DEVICE_PARTITION_EQUALLY, units/parts, 0};
+
+   cl_uint nb_sub;
+   if (clCreateSubDevices(dev, props, 0, NULL, &nb_sub) != CL_SUCCESS || nb_sub < 2) {
+      return;
+   }
+
+   cl_device_id subs[nb_sub];
+   if (clCreateSubDevices(dev, props, nb_sub, subs, NULL) != CL_SUCCESS) {
+      return;
+   }
+
+   benchDev(mat, rhs, nb_sub, subs, SCHED_STATIC, runs);
+   benchDev(mat, rhs, nb_sub, subs, SCHED_DYNAMIC, runs);
+
+   cl_uint i;
+   for (i=0; i<nb_sub; i++) {
+      clReleaseDevice(subs[i]);
+   }
+}
+
+void benchDev(double * mat[BCOUNT][BCOUNT], double * rhs[BCOUNT], cl_int nb_dev, cl_device_id * devs, int mode, int runs) {
+
+   char title[256];
+
+   if (nb_dev == 1) {
+      cl_device_id dev = devs[0];
+      size_t dev_name_size;
+      clGetDeviceInfo(dev, CL_DEVICE_NAME, 0, NULL, &dev_name_size);
+      char dev_name[dev_name_size];
+      clGetDeviceInfo(dev, CL_DEVICE_NAME, dev_name_size, dev_name, NULL);
+
+      if (mode == SCHED_OUT_OF_CORE) {
+         printf("  - Benchmarking out-of-core mode on device %s:\n", dev_name);
+         snprintf(title, sizeof(title), "%s, out-of-core", dev_name);
+      }
+      else {
+         printf("  - Benchmarking device %s:\n", dev_name);
+         snprintf(title, sizeof(title), "%s", dev_name);
+      }
+   }
+   else if (mode != SCHED_QUEUE) {
+      size_t dev_name_size;
+      clGetDeviceInfo(devs[0], CL_DEVICE_NAME, 0, NULL, &dev_name_size);
+      char dev_name[dev_name_size];
+      clGetDeviceInfo(devs[0], CL_DEVICE_NAME, dev_name_size, dev_name, NULL);
+
+      const char * name = (mode == SCHED_DYNAMIC ? "dynamic" : "static");
+      printf("  - Benchmarking %s scheduler on %d devices (%s, ...):\n", name, nb_dev, dev_name);
+      snprintf(title, sizeof(title), "%s scheduler (%d devices)", mode == SCHED_DYNAMIC ? "Dynamic" : "Static", nb_dev);
+   }
+   else {
+      printf("  - Benchmarking SOCL scheduler\n");
+      snprintf(title, sizeof(title), "SOCL scheduler (%d devices)", nb_dev);
+   }
+
+   int errCount;
+   cl_ulong duration;
+   char * log;
+   double maxDiff, residual, berr;
+   cache_stats stats;
+   int X, Y;
+
+   session * s = NULL;
+   int err = createSession(nb_dev, devs, &s, &log);
+
+   // Factor of every run, read back to pinned memory (see sessionHostBuffer)
+   host_buffer hbR[BCOUNT][BCOUNT] = {{{0}}};
+   double * matR[BCOUNT][BCOUNT];
+   for (Y=0; Y<BCOUNT && err == CL_SUCCESS; Y++) {
+      for (X=0; X<=Y && err == CL_SUCCESS; X++) {
+         err = sessionHostBuffer(s, (X == Y ? packedSize(N, 16) : N * N) * sizeof(double), &hbR[Y][X], &log);
+         matR[Y][X] = hbR[Y][X].ptr;
+      }
+   }
+
+   // Solutions of the solves, the only blocks read back (the factor stays on
+   // the devices, except in the out-of-core mode where it is in host memory)
+   host_buffer hbX[BCOUNT] = {{0}};
+   double * solR[BCOUNT];
+   for (Y=0; Y<BCOUNT && err == CL_SUCCESS; Y++) {
+      err = sessionHostBuffer(s, N * NRHS * sizeof(double), &hbX[Y], &log);
+      solR[Y] = hbX[Y].ptr;
+   }
+
+   int run;
+   for (run=0; run<runs && err == CL_SUCCESS; run++) {
+      profile * prof = createProfile();
+
+      for (Y=0; Y<BCOUNT; Y++) {
+         for (X=0; X<=Y; X++) {
+            memset(matR[Y][X], 0, (X == Y ? packedSize(N, 16) : N * N) * sizeof(double));
+         }
+      }
+
+      err = performCholesky(s, mode, mat, matR, NULL, NULL, N, epsilon, &errCount, &maxDiff, &residual, &berr, &stats, prof, &duration, &log);
+
+      if (err == CL_SUCCESS) {
+         printf("      - Execution time: %.3f ms and %s",
+               duration/1e6, (errCount == 0 && residual <= residual_epsilon ? "succeeded" : "failed"));
+         if (errCount > 0) {
+            printf(" (%d errors, max diff %e, epsilon %e, residual %e).\n", errCount, maxDiff, epsilon, residual);
+         }
+         else printf(" (residual %e)\n", residual);
+         if (mode == SCHED_OUT_OF_CORE) {
+            printf("      - Tile cache: %d of %d blocks, %d hits, %d misses, %d prefetches, %d evictions, %d stores\n",
+                  stats.slots, BCOUNT*(BCOUNT+1)/2, stats.hits, stats.misses, stats.prefetches, stats.evictions, stats.stores);
+         }
+         profileReport(prof, stdout, "          ");
+
+         if (trace != NULL) {
+            char run_title[300];
+            snprintf(run_title, sizeof(run_title), "%s, run %d", title, run+1);
+            profileTrace(prof, trace, trace_pid++, run_title, &trace_events);
+         }
+      }
+      releaseProfile(prof);
+
+      if (err != CL_SUCCESS) break;
+
+      // Factorization and solve in one pipeline
+      prof = createProfile();
+
+      for (Y=0; Y<BCOUNT; Y++) {
+         memset(solR[Y], 0, N * NRHS * sizeof(double));
+      }
+
+      err = performCholesky(s, mode, mat, mode == SCHED_OUT_OF_CORE ? matR : NULL, rhs, solR, N, epsilon, &errCount, &maxDiff, &residual, &berr, &stats, prof, &duration, &log);
+
+      if (err == CL_SUCCESS) {
+         printf("      - Factorization and solve (%d right-hand sides): %.3f ms and %s (backward error %e, epsilon %e)\n",
+               NRHS, duration/1e6, (errCount == 0 && berr <= solve_epsilon ? "succeeded" : "failed"), berr, solve_epsilon);
+         profileReport(prof, stdout, "          ");
+
+         if (trace != NULL) {
+            char run_title[300];
+            snprintf(run_title, sizeof(run_title), "%s, run %d with solve", title, run+1);
+            profileTrace(prof, trace, trace_pid++, run_title, &trace_events);
+         }
+      }
+      releaseProfile(prof);
+   }
+
+   if (err != CL_SUCCESS) {
+      printf("      - Error %d: %s\n", err, log);
+   }
+   if (s != NULL) {
+      for (Y=0; Y<BCOUNT; Y++) {
+         for (X=0; X<=Y; X++) {
+            if (hbR[Y][X].mem != NULL) releaseHostBuffer(s, &hbR[Y][X]);
+         }
+         if (hbX[Y].mem != NULL) releaseHostBuffer(s, &hbX[Y]);
+      }
+      releaseSession(s);
+   }
+   printf("\n");
+}
+
+/* Distribution of the blocks over the devices of a session
+ *
+ * With the static scheduler, every device has its own queue and the blocks
+ * are mapped 2D block-cyclically on a P x Q grid of devices. Each block is
+ * updated by the device that owns it (owner computes). The final blocks of
+ * a column (factored diagonal block and sub-diagonal blocks) are copied to
+ * the other devices that need them, at most once per device, with copies
+ * ordered by events. With the session queue (single device, or multiple
+ * devices scheduled by the platform), everything goes to that queue.
+ *
+ * With the dynamic scheduler, the mapping only gives the initial location
+ * of the blocks: tasks are then run by the runtime of runtime.h.
+ *
+ * Transfers go to an in-order transfer queue per device, so that they
+ * overlap the kernels: blocks are uploaded in column order (step 0 only
+ * needs column 0) and, with the static scheduler, every column is read back
+ * as soon as it is final.
+ *
+ * Right-hand sides solved after the factorization stay with the diagonal
+ * block of their block row. Commands updating them run on their device, the
+ * solved blocks they read are copied there once per substitution (forward,
+ * then backward).
+ */
+typedef struct {
+   cl_uint nb_q;
+   cl_command_queue * queues;
+   cl_command_queue * transfer;
+   int P, Q;
+
+   // Blocks on their owner and the last command writing them
+   cl_mem buf[BCOUNT][BCOUNT];
+   cl_event events[BCOUNT][BCOUNT];
+   // Device holding the last version of the blocks
+   int location[BCOUNT][BCOUNT];
+
+   // Copies of final blocks on the other devices (NULL if none yet)
+   cl_mem (*copies)[BCOUNT][BCOUNT];
+   cl_event (*copy_events)[BCOUNT][BCOUNT];
+
+   // Where final columns are read back during the factorization (NULL if
+   // only read back at the end) and the read commands
+   double * (*res)[BCOUNT];
+   cl_event reads[BCOUNT][BCOUNT];
+
+   // Right-hand sides (NULL if no solve), the last command writing them and
+   // the device holding their last version
+   cl_mem rhs[BCOUNT];
+   cl_event rhs_events[BCOUNT];
+   int rhs_location[BCOUNT];
+   // Copies of solved right-hand sides, per substitution
+   cl_mem (*rhs_copies)[2][BCOUNT];
+   cl_event (*rhs_copy_events)[2][BCOUNT];
+   cl_event rhs_reads[BCOUNT];
+} schedule;
+
+#define OWNER(sc,Y,X) (((Y) % (sc)->P) * (sc)->Q + ((X) % (sc)->Q))
+
+cl_int createSchedule(session * s, int mode, schedule * sc, char ** log) {
+   memset(sc, 0, sizeof(schedule));
+
+   if (mode != SCHED_QUEUE) {
+      sc->nb_q = s->nb_dev;
+      sc->queues = s->queues;
+      sc->transfer = s->transfer;
+   }
+   else {
+      if (s->cq == NULL) {
+         *log = strdup("The platform does not schedule commands over devices");
+         return CL_INVALID_COMMAND_QUEUE;
+      }
+      sc->nb_q = 1;
+      sc->queues = &s->cq;
+      // No transfer queue for devices scheduled by the platform
+      sc->transfer = (s->nb_dev == 1 ? s->transfer : &s->cq);
+   }
+
+   // Grid as square as possible, P <= Q
+   for (sc->P = 1; (sc->P+1)*(sc->P+1) <= sc->nb_q; sc->P++);
+   while (sc->nb_q % sc->P != 0) sc->P--;
+   sc->Q = sc->nb_q / sc->P;
+
+   int X, Y;
+   for (Y=0; Y<BCOUNT; Y++) {
+      for (X=0; X<=Y; X++) {
+         sc->location[Y][X] = OWNER(sc,Y,X);
+      }
+      sc->rhs_location[Y] = OWNER(sc,Y,Y);
+   }
+
+   sc->copies = calloc(sc->nb_q, sizeof(*sc->copies));
+   sc->copy_events = calloc(sc->nb_q, sizeof(*sc->copy_events));
+   sc->rhs_copies = calloc(sc->nb_q, sizeof(*sc->rhs_copies));
+   sc->rhs_copy_events = calloc(sc->nb_q, sizeof(*sc->rhs_copy_events));
+
+   return CL_SUCCESS;
+}
+
+/* Get the final block (Y, X) on device d and the event to wait for before
+ * reading it: the block itself on its owner, a copy on other devices (made
+ * on first use, on the queue of d) */
+cl_int fetchBlock(session * s, schedule * sc, int d, int Y, int X, size_t size, profile * prof, cl_mem * buf, cl_event * ev, char ** log) {
+   int owner = OWNER(sc, Y, X);
+   if (owner == d) {
+      *buf = sc->buf[Y][X];
+      *ev = sc->events[Y][X];
+      return CL_SUCCESS;
+   }
+
+   if (sc->copies[d][Y][X] == NULL) {
+      cl_int err = sessionBuffer(s, size, &sc->copies[d][Y][X], log);
+      if (err != CL_SUCCESS) {
+         return err;
+      }
+
+      err = clEnqueueCopyBuffer(sc->queues[d], sc->buf[Y][X], sc->copies[d][Y][X], 0, 0, size, 1, &sc->events[Y][X], &sc->copy_events[d][Y][X]);
+      if (err != CL_SUCCESS) {
+         *log = strdup("Unable to enqueue copy buffer command");
+         return err;
+      }
+      profileRecord(prof, sc->copy_events[d][Y][X], "copy", 0, size);
+      profileAnnotate(prof, 1, &sc->events[Y][X], "copy (%d,%d) %d->%d", Y, X, owner, d);
+   }
+
+   *buf = sc->copies[d][Y][X];
+   *ev = sc->copy_events[d][Y][X];
+   return CL_SUCCESS;
+}
+
+/* Get solved right-hand side block X of substitution "pass" (0 forward, 1
+ * backward) on device d, as fetchBlock does for the blocks of the factor */
+cl_int fetchRhs(session * s, schedule * sc, int d, int X, int pass, size_t size, profile * prof, cl_mem * buf, cl_event * ev, char ** log) {
+   int owner = sc->rhs_location[X];
+   if (owner == d) {
+      *buf = sc->rhs[X];
+      *ev = sc->rhs_events[X];
+      return CL_SUCCESS;
+   }
+
+   if (sc->rhs_copies[d][pass][X] == NULL) {
+      cl_int err = sessionBuffer(s, size, &sc->rhs_copies[d][pass][X], log);
+      if (err != CL_SUCCESS) {
+         return err;
+      }
+
+      err = clEnqueueCopyBuffer(sc->queues[d], sc->rhs[X], sc->rhs_copies[d][pass][X], 0, 0, size, 1, &sc->rhs_events[X], &sc->rhs_copy_events[d][pass][X]);
+      if (err != CL_SUCCESS) {
+         *log = strdup("Unable to enqueue copy buffer command");
+         return err;
+      }
+      profileRecord(prof, sc->rhs_copy_events[d][pass][X], "copy", 0, size);
+      profileAnnotate(prof, 1, &sc->rhs_events[X], "copy rhs %d %d->%d", X, owner, d);
+   }
+
+   *buf = sc->rhs_copies[d][pass][X];
+   *ev = sc->rhs_copy_events[d][pass][X];
+   return CL_SUCCESS;
+}
+
+void finishSchedule(schedule * sc) {
+   cl_uint d;
+   for (d=0; d<sc->nb_q; d++) {
+      clFinish(sc->queues[d]);
+      clFinish(sc->transfer[d]);
+   }
+}
+
+/* Read final column X back to sc->res on the transfer queues */
+cl_int readColumn(schedule * sc, int X, size_t size, size_t diag_size, profile * prof, char ** log) {
+   cl_int err;
+   int Y;
+
+   for (Y=X; Y<BCOUNT; Y++) {
+      err = clEnqueueReadBuffer(sc->transfer[sc->location[Y][X]], sc->buf[Y][X], CL_FALSE, 0, X == Y ? diag_size : size, sc->res[Y][X], 1, &sc->events[Y][X], &sc->reads[Y][X]);
+      if (err != CL_SUCCESS) {
+         *log = strdup("Unable to enqueue read buffer command");
+         return err;
+      }
+      profileRecord(prof, sc->reads[Y][X], "read", 0, X == Y ? diag_size : size);
+      profileAnnotate(prof, 1, &sc->events[Y][X], "read (%d,%d)", Y, X);
+   }
+
+   cl_uint d;
+   for (d=0; d<sc->nb_q; d++) {
+      clFlush(sc->transfer[d]);
+   }
+
+   return CL_SUCCESS;
+}
+
+/* Give every buffer back to the session (commands must be complete) */
+void releaseSchedule(session * s, schedule * sc) {
+   int X, Y, pass;
+   cl_uint d;
+
+   for (Y=0; Y<BCOUNT; Y++) {
+      for (X=0; X<=Y; X++) {
+         sessionRelease(s, sc->buf[Y][X]);
+         clReleaseEvent(sc->events[Y][X]);
+         if (sc->reads[Y][X] != NULL) clReleaseEvent(sc->reads[Y][X]);
+
+         for (d=0; d<sc->nb_q; d++) {
+            if (sc->copies[d][Y][X] != NULL) {
+               sessionRelease(s, sc->copies[d][Y][X]);
+               clReleaseEvent(sc->copy_events[d][Y][X]);
+            }
+         }
+      }
+
+      if (sc->rhs[Y] != NULL) {
+         sessionRelease(s, sc->rhs[Y]);
+         clReleaseEvent(sc->rhs_events[Y]);
+         if (sc->rhs_reads[Y] != NULL) clReleaseEvent(sc->rhs_reads[Y]);
+
+         for (d=0; d<sc->nb_q; d++) {
+            for (pass=0; pass<2; pass++) {
+               if (sc->rhs_copies[d][pass][Y] != NULL) {
+                  sessionRelease(s, sc->rhs_copies[d][pass][Y]);
+                  clReleaseEvent(sc->rhs_copy_events[d][pass][Y]);
+               }
+            }
+         }
+      }
+   }
+
+   free(sc->copies);
+   free(sc->copy_events);
+   free(sc->rhs_copies);
+   free(sc->rhs_copy_events);
+}
+
+/* Kernels of the factorization and what their commands need */
+typedef struct {
+   cl_kernel dpotrf, dtrsm, dgemm, dtrsm_block, dgemm_block, dsyrk;
+   cl_kernel dtrsm_rhs, dgemm_rhs;
+   int dgemm_block_v2;
+   tile_config tile;             // configuration of dtrsm_block
+   cl_ulong n, nrhs;
+   profile * prof;
+} block_kernels;
+
+/* Factor diagonal block "diag" of step "step" (tile by tile) after the
+ * commands of the wait list, "done" is the event of the last command */
+cl_int enqueueDiagonal(block_kernels * k, cl_command_queue cq, int step, cl_mem diag, cl_uint nb_wait, const cl_event * wait, cl_event * done, char ** log) {
+   cl_int err;
+   cl_ulong n = k->n;
+
+   // No look-ahead for diagonal blocks: dgemm updates the whole trailing block
+   cl_ulong first = 0;
+
+   err = clSetKernelArg(k->dpotrf, 0, sizeof(cl_mem), &diag);
+   err |= clSetKernelArg(k->dpotrf, 1, sizeof(cl_ulong), &n);
+   err |= clSetKernelArg(k->dtrsm, 0, sizeof(cl_mem), &diag);
+   err |= clSetKernelArg(k->dtrsm, 1, sizeof(cl_ulong), &n);
+   err |= clSetKernelArg(k->dgemm, 0, sizeof(cl_mem), &diag);
+   err |= clSetKernelArg(k->dgemm, 1, sizeof(cl_ulong), &n);
+   err |= clSetKernelArg(k->dgemm, 3, sizeof(cl_ulong), &first);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to set kernel parameter");
+      return err;
+   }
+
+   cl_event ev, last = NULL;
+
+   cl_long i;
+   for (i=0; i<n/16; i++) {
+
+      err = clSetKernelArg(k->dpotrf, 2, sizeof(cl_ulong), &i);
+      err |= clSetKernelArg(k->dgemm, 2, sizeof(cl_ulong), &i);
+      err |= clSetKernelArg(k->dtrsm, 2, sizeof(cl_ulong), &i);
+      if (err != CL_SUCCESS) {
+         *log = strdup("Unable to set kernel parameter");
+         return err;
+      }
+
+      size_t dpotrf_global[] = {16,1,1};
+      size_t dpotrf_local[] = {16,1,1};
+
+      err = clEnqueueNDRangeKernel(cq, k->dpotrf, 2, NULL, dpotrf_global, dpotrf_local, last == NULL ? nb_wait : 1, last == NULL ? wait : &last, &ev);
+      if (err != CL_SUCCESS) {
+         *log = strdup("Unable to enqueue kernel execution command");
+         return err;
+      }
+      profileRecord(k->prof, ev, "dpotrf", 16.0*16*16/3, 0);
+      profileAnnotate(k->prof, last == NULL ? nb_wait : 1, last == NULL ? wait : &last, "dpotrf (%d,%d) tile %ld", step, step, (long)i);
+      if (last != NULL) clReleaseEvent(last);
+      last = ev;
+
+      size_t r = n - (i+1)*16;
+
+      if (r > 0) {
+
+         size_t dtrsm_global[] = {16,r,1};
+         size_t dtrsm_local[] = {16,16,1};
+         err = clEnqueueNDRangeKernel(cq, k->dtrsm, 2, NULL, dtrsm_global, dtrsm_local, 1, &last, &ev);
+         if (err != CL_SUCCESS) {
+            *log = strdup("Unable to enqueue kernel execution command");
+            return err;
+         }
+         profileRecord(k->prof, ev, "dtrsm", 16.0*16*r, 0);
+         profileAnnotate(k->prof, 1, &last, "dtrsm (%d,%d) tile %ld", step, step, (long)i);
+         clReleaseEvent(last);
+         last = ev;
+
+         // Lower triangle of blocks only
+         size_t t = (r/16)*(r/16+1)/2;
+         size_t dgemm_global[] = {16*t,16,1};
+         size_t dgemm_local[] = {16,16,1};
+         err = clEnqueueNDRangeKernel(cq, k->dgemm, 2, NULL, dgemm_global, dgemm_local, 1, &last, &ev);
+         if (err != CL_SUCCESS) {
+            *log = strdup("Unable to enqueue kernel execution command");
+            return err;
+         }
+         profileRecord(k->prof, ev, "dgemm", 2.0*16*16*16*t, 0);
+         profileAnnotate(k->prof, 1, &last, "dgemm (%d,%d) tile %ld", step, step, (long)i);
+         clReleaseEvent(last);
+         last = ev;
+      }
+   }
+
+   *done = last;
+   return CL_SUCCESS;
+}
+
+/* block (Y, X) = block * diag^-T */
+cl_int enqueuePanel(block_kernels * k, cl_command_queue cq, int Y, int X, cl_mem diag, cl_mem block, cl_uint nb_wait, const cl_event * wait, cl_event * done, char ** log) {
+   cl_int err;
+   cl_ulong n = k->n;
+
+   err = clSetKernelArg(k->dtrsm_block, 0, sizeof(cl_mem), &diag);
+   err |= clSetKernelArg(k->dtrsm_block, 1, sizeof(cl_mem), &block);
+   err |= clSetKernelArg(k->dtrsm_block, 2, sizeof(cl_ulong), &n);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to set kernel parameter");
+      return err;
+   }
+
+   // One work-group per ts rows, wpt rows per work-item
+   size_t ts = k->tile.ts;
+   size_t wpt = k->tile.wpt;
+   size_t dtrsm_block_global[] = {ts,n/wpt,1};
+   size_t dtrsm_block_local[] = {ts,ts/wpt,1};
+
+   err = clEnqueueNDRangeKernel(cq, k->dtrsm_block, 2, NULL, dtrsm_block_global, dtrsm_block_local, nb_wait, wait, done);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to enqueue kernel execution command");
+      return err;
+   }
+   profileRecord(k->prof, *done, "dtrsm_block", (double)n*n*n, 0);
+   profileAnnotate(k->prof, nb_wait, wait, "dtrsm_block (%d,%d)", Y, X);
+
+   return CL_SUCCESS;
+}
+
+/* Diagonal block (Y, Y) -= a * a^T, a being block (Y, step) */
+cl_int enqueueSyrk(block_kernels * k, cl_command_queue cq, int Y, int step, cl_mem a, cl_mem diag, cl_uint nb_wait, const cl_event * wait, cl_event * done, char ** log) {
+   cl_int err;
+   cl_ulong n = k->n;
+
+   // Diagonal blocks are symmetric: lower triangle of output tiles only
+   err = clSetKernelArg(k->dsyrk, 0, sizeof(cl_mem), &a);
+   err |= clSetKernelArg(k->dsyrk, 1, sizeof(cl_mem), &diag);
+   err |= clSetKernelArg(k->dsyrk, 2, sizeof(cl_ulong), &n);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to set kernel parameter");
+      return err;
+   }
+
+   // Output tiles of 64x64 (4x4 micro-tiles) with dgemm_block version 2, 16x16 otherwise
+   size_t b = (k->dgemm_block_v2 ? n/64 : n/16);
+   size_t t = b*(b+1)/2;
+   size_t dsyrk_global[] = {16*t,16,1};
+   size_t dsyrk_local[] = {16,16,1};
+
+   err = clEnqueueNDRangeKernel(cq, k->dsyrk, 2, NULL, dsyrk_global, dsyrk_local, nb_wait, wait, done);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to enqueue kernel execution command");
+      return err;
+   }
+   profileRecord(k->prof, *done, "dsyrk", (double)n*n*(n+1), 0);
+   profileAnnotate(k->prof, nb_wait, wait, "dsyrk (%d,%d) step %d", Y, Y, step);
+
+   return CL_SUCCESS;
+}
+
+/* Block (Y, X) -= a * b^T, a and b being blocks (Y, step) and (X, step) */
+cl_int enqueueGemm(block_kernels * k, cl_command_queue cq, int Y, int X, int step, cl_mem a, cl_mem b, cl_mem c, cl_uint nb_wait, const cl_event * wait, cl_event * done, char ** log) {
+   cl_int err;
+   cl_ulong n = k->n;
+
+   err = clSetKernelArg(k->dgemm_block, 0, sizeof(cl_mem), &a);
+   err |= clSetKernelArg(k->dgemm_block, 1, sizeof(cl_mem), &b);
+   err |= clSetKernelArg(k->dgemm_block, 2, sizeof(cl_mem), &c);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to set kernel parameter");
+      return err;
+   }
+
+   size_t dgemm_block_global[] = {k->dgemm_block_v2 ? n/4 : n, k->dgemm_block_v2 ? n/4 : n, 1};
+   size_t dgemm_block_local[] = {16,16,1};
+
+   err = clEnqueueNDRangeKernel(cq, k->dgemm_block, 2, NULL, dgemm_block_global, dgemm_block_local, nb_wait, wait, done);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to enqueue kernel execution command");
+      return err;
+   }
+   profileRecord(k->prof, *done, "dgemm_block", 2.0*n*n*n, 0);
+   profileAnnotate(k->prof, nb_wait, wait, "dgemm_block (%d,%d) step %d", Y, X, step);
+
+   return CL_SUCCESS;
+}
+
+/* Right-hand sides of block row X = diag^-1 * rhs (forward substitution), or
+ * diag^-T * rhs (backward substitution, "trans") */
+cl_int enqueueSolve(block_kernels * k, cl_command_queue cq, int X, cl_int trans, cl_mem diag, cl_mem rhs, cl_uint nb_wait, const cl_event * wait, cl_event * done, char ** log) {
+   cl_int err;
+   cl_ulong n = k->n, nrhs = k->nrhs;
+
+   err = clSetKernelArg(k->dtrsm_rhs, 0, sizeof(cl_mem), &diag);
+   err |= clSetKernelArg(k->dtrsm_rhs, 1, sizeof(cl_mem), &rhs);
+   err |= clSetKernelArg(k->dtrsm_rhs, 2, sizeof(cl_ulong), &n);
+   err |= clSetKernelArg(k->dtrsm_rhs, 3, sizeof(cl_ulong), &nrhs);
+   err |= clSetKernelArg(k->dtrsm_rhs, 4, sizeof(cl_int), &trans);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to set kernel parameter");
+      return err;
+   }
+
+   // One work-group per 16 right-hand sides
+   size_t dtrsm_rhs_global[] = {nrhs,16,1};
+   size_t dtrsm_rhs_local[] = {16,16,1};
+
+   err = clEnqueueNDRangeKernel(cq, k->dtrsm_rhs, 2, NULL, dtrsm_rhs_global, dtrsm_rhs_local, nb_wait, wait, done);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to enqueue kernel execution command");
+      return err;
+   }
+   profileRecord(k->prof, *done, "dtrsm_rhs", (double)n*n*nrhs, 0);
+   profileAnnotate(k->prof, nb_wait, wait, "dtrsm_rhs %d %s", X, trans ? "backward" : "forward");
+
+   return CL_SUCCESS;
+}
+
+/* Right-hand sides of block row Y -= a * b (forward substitution), or
+ * a^T * b (backward substitution, "trans"), b being those of block row X */
+cl_int enqueueSolveUpdate(block_kernels * k, cl_command_queue cq, int Y, int X, cl_int trans, cl_mem a, cl_mem b, cl_mem c, cl_uint nb_wait, const cl_event * wait, cl_event * done, char ** log) {
+   cl_int err;
+   cl_ulong n = k->n, nrhs = k->nrhs;
+
+   err = clSetKernelArg(k->dgemm_rhs, 0, sizeof(cl_mem), &a);
+   err |= clSetKernelArg(k->dgemm_rhs, 1, sizeof(cl_mem), &b);
+   err |= clSetKernelArg(k->dgemm_rhs, 2, sizeof(cl_mem), &c);
+   err |= clSetKernelArg(k->dgemm_rhs, 3, sizeof(cl_ulong), &n);
+   err |= clSetKernelArg(k->dgemm_rhs, 4, sizeof(cl_ulong), &nrhs);
+   err |= clSetKernelArg(k->dgemm_rhs, 5, sizeof(cl_int), &trans);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to set kernel parameter");
+      return err;
+   }
+
+   size_t dgemm_rhs_global[] = {nrhs,n,1};
+   size_t dgemm_rhs_local[] = {16,16,1};
+
+   err = clEnqueueNDRangeKernel(cq, k->dgemm_rhs, 2, NULL, dgemm_rhs_global, dgemm_rhs_local, nb_wait, wait, done);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to enqueue kernel execution command");
+      return err;
+   }
+   profileRecord(k->prof, *done, "dgemm_rhs", 2.0*n*n*nrhs, 0);
+   profileAnnotate(k->prof, nb_wait, wait, "dgemm_rhs %d from %d %s", Y, X, trans ? "backward" : "forward");
+
+   return CL_SUCCESS;
+}
+
+/* Static scheduling: every command is enqueued on the queue of the owner of
+ * the block it writes, ordered by events */
+cl_int factorStatic(session * s, schedule * sc, block_kernels * k, char ** log) {
+   cl_int err;
+   cl_event ev;
+   cl_mem a, b;
+   cl_event a_ev, b_ev;
+   int X, Y, step;
+
+   size_t size = k->n * k->n * sizeof(double);
+   size_t diag_size = packedSize(k->n, 16) * sizeof(double);
+
+   for (step=0; step<BCOUNT; step++) {
+
+      /******************** Diagonal block ***********************/
+      err = enqueueDiagonal(k, sc->queues[OWNER(sc,step,step)], step, sc->buf[step][step], 1, &sc->events[step][step], &ev, log);
+      if (err != CL_SUCCESS) {
+         return err;
+      }
+      clReleaseEvent(sc->events[step][step]);
+      sc->events[step][step] = ev;
+
+      /*********** SUB-DIAGONAL BLOCKS *******************/
+      X = step;
+      for (Y=step+1; Y<BCOUNT; Y++) {
+         int d = OWNER(sc,Y,X);
+
+         // The factored diagonal block, copied to the owner of the block if needed
+         err = fetchBlock(s, sc, d, step, step, diag_size, k->prof, &a, &a_ev, log);
+         if (err != CL_SUCCESS) {
+            return err;
+         }
+
+         cl_event deps[] = {a_ev, sc->events[Y][X]};
+         err = enqueuePanel(k, sc->queues[d], Y, X, a, sc->buf[Y][X], 2, deps, &ev, log);
+         if (err != CL_SUCCESS) {
+            return err;
+         }
+         clReleaseEvent(sc->events[Y][X]);
+         sc->events[Y][X] = ev;
+      }
+
+      // The column is final
+      if (sc->res != NULL) {
+         err = readColumn(sc, step, size, diag_size, k->prof, log);
+         if (err != CL_SUCCESS) {
+            return err;
+         }
+      }
+
+      /*********** OTHER BLOCKS *******************/
+      for (Y=step+1; Y<BCOUNT; Y++) {
+         int d = OWNER(sc,Y,Y);
+
+         err = fetchBlock(s, sc, d, Y, step, size, k->prof, &a, &a_ev, log);
+         if (err != CL_SUCCESS) {
+            return err;
+         }
+
+         cl_event diag_deps[] = {a_ev, sc->events[Y][Y]};
+         err = enqueueSyrk(k, sc->queues[d], Y, step, a, sc->buf[Y][Y], 2, diag_deps, &ev, log);
+         if (err != CL_SUCCESS) {
+            return err;
+         }
+         clReleaseEvent(sc->events[Y][Y]);
+         sc->events[Y][Y] = ev;
+
+         for (X=step+1; X<Y; X++) {
+            d = OWNER(sc,Y,X);
+
+            err = fetchBlock(s, sc, d, Y, step, size, k->prof, &a, &a_ev, log);
+            if (err == CL_SUCCESS) {
+               err = fetchBlock(s, sc, d, X, step, size, k->prof, &b, &b_ev, log);
+            }
+            if (err != CL_SUCCESS) {
+               return err;
+            }
+
+            cl_event deps[] = {a_ev, b_ev, sc->events[Y][X]};
+            err = enqueueGemm(k, sc->queues[d], Y, X, step, a, b, sc->buf[Y][X], 3, deps, &ev, log);
+            if (err != CL_SUCCESS) {
+               return err;
+            }
+            clReleaseEvent(sc->events[Y][X]);
+            sc->events[Y][X] = ev;
+         }
+      }
+   }
+
+   return CL_SUCCESS;
+}
+
+/* Static scheduling of the solve L * L^T * X = B once the commands of the
+ * factorization are enqueued: forward substitution (L * Z = B), then
+ * backward substitution (L^T * X = Z), in place in sc->rhs. Every command
+ * runs on the device of the right-hand sides it writes, ordered by events
+ * after the commands producing the blocks of the factor it reads. */
+cl_int solveStatic(session * s, schedule * sc, block_kernels * k, char ** log) {
+   cl_int err;
+   cl_event ev;
+   cl_mem a, b;
+   cl_event a_ev, b_ev;
+   int X, Y, i, pass;
+
+   size_t size = k->n * k->n * sizeof(double);
+   size_t diag_size = packedSize(k->n, 16) * sizeof(double);
+   size_t rhs_size = k->n * k->nrhs * sizeof(double);
+
+   for (pass=0; pass<2; pass++) {
+      for (i=0; i<BCOUNT; i++) {
+         // Forward: first block row first, backward: last block row first
+         X = (pass ? BCOUNT-1-i : i);
+         int d = sc->rhs_location[X];
+
+         err = fetchBlock(s, sc, d, X, X, diag_size, k->prof, &a, &a_ev, log);
+         if (err != CL_SUCCESS) {
+            return err;
+         }
+
+         cl_event diag_deps[] = {a_ev, sc->rhs_events[X]};
+         err = enqueueSolve(k, sc->queues[d], X, pass, a, sc->rhs[X], 2, diag_deps, &ev, log);
+         if (err != CL_SUCCESS) {
+            return err;
+         }
+         clReleaseEvent(sc->rhs_events[X]);
+         sc->rhs_events[X] = ev;
+
+         // Block rows still to solve: below X (block (Y, X) of the factor),
+         // then above X (block (X, Y), transposed)
+         for (Y=(pass ? 0 : X+1); Y<(pass ? X : BCOUNT); Y++) {
+            d = sc->rhs_location[Y];
+
+            err = fetchBlock(s, sc, d, pass ? X : Y, pass ? Y : X, size, k->prof, &a, &a_ev, log);
+            if (err == CL_SUCCESS) {
+               err = fetchRhs(s, sc, d, X, pass, rhs_size, k->prof, &b, &b_ev, log);
+            }
+            if (err != CL_SUCCESS) {
+               return err;
+            }
+
+            cl_event deps[] = {a_ev, b_ev, sc->rhs_events[Y]};
+            err = enqueueSolveUpdate(k, sc->queues[d], Y, X, pass, a, b, sc->rhs[Y], 3, deps, &ev, log);
+            if (err != CL_SUCCESS) {
+               return err;
+            }
+            clReleaseEvent(sc->rhs_events[Y]);
+            sc->rhs_events[Y] = ev;
+         }
+      }
+   }
+
+   return CL_SUCCESS;
+}
+
+/* Task of the dynamic and out-of-core schedulers, with the blocks it reads
+ * and writes (the last one) */
+typedef struct {
+   block_kernels * k;
+   cl_mem (*buf)[BCOUNT];
+   int kind;
+   int Y, X, step;
+   double cost;
+   int nb_data;
+   int data[3];
+   cl_mem * rhs;              // right-hand sides (solve tasks only)
+} block_task;
+
+enum { TASK_DIAGONAL, TASK_PANEL, TASK_SYRK, TASK_GEMM, TASK_FORWARD, TASK_FORWARD_UPDATE, TASK_BACKWARD, TASK_BACKWARD_UPDATE };
+
+#define BLOCK_ID(Y,X) ((Y)*((Y)+1)/2 + (X))
+#define BLOCK_TASKS (BCOUNT*(BCOUNT+1)*(BCOUNT+2)/6)
+// Right-hand sides come after the blocks of the factor
+#define RHS_ID(Y) (BLOCK_ID(BCOUNT, 0) + (Y))
+#define SOLVE_TASKS (BCOUNT*(BCOUNT+1))
+
+/* Fill "tasks" with the tasks of the factorization in the order of the
+ * static scheduler and return their number */
+int blockTasks(block_kernels * k, cl_mem (*buf)[BCOUNT], block_task * tasks) {
+   double n3 = (double)k->n*k->n*k->n;
+   int X, Y, step;
+   int nb = 0;
+
+   for (step=0; step<BCOUNT; step++) {
+      tasks[nb++] = (block_task){k, buf, TASK_DIAGONAL, step, step, step, n3/3, 1, {BLOCK_ID(step,step)}, NULL};
+
+      for (Y=step+1; Y<BCOUNT; Y++) {
+         tasks[nb++] = (block_task){k, buf, TASK_PANEL, Y, step, step, n3, 2, {BLOCK_ID(step,step), BLOCK_ID(Y,step)}, NULL};
+      }
 
-   int x, y, z, X, Y;
+      for (Y=step+1; Y<BCOUNT; Y++) {
+         tasks[nb++] = (block_task){k, buf, TASK_SYRK, Y, Y, step, n3, 2, {BLOCK_ID(Y,step), BLOCK_ID(Y,Y)}, NULL};
 
-   double * mat[BCOUNT][BCOUNT];
+         for (X=step+1; X<Y; X++) {
+            tasks[nb++] = (block_task){k, buf, TASK_GEMM, Y, X, step, 2*n3, 3, {BLOCK_ID(Y,step), BLOCK_ID(X,step), BLOCK_ID(Y,X)}, NULL};
+         }
+      }
+   }
 
-   for (Y = 0; Y<BCOUNT; Y++) {
-      for (X = 0; X<=Y; X++) {
-         mat[Y][X] = malloc(N * N * sizeof(double));
+   return nb;
+}
+
+/* Fill "tasks" with the tasks of the solve L * L^T * X = B (forward then
+ * backward substitution, as solveStatic) and return their number */
+int solveTasks(block_kernels * k, cl_mem (*buf)[BCOUNT], cl_mem * rhs, block_task * tasks) {
+   double n2 = (double)k->n*k->n*k->nrhs;
+   int X, Y;
+   int nb = 0;
+
+   for (X=0; X<BCOUNT; X++) {
+      tasks[nb++] = (block_task){k, buf, TASK_FORWARD, X, X, 0, n2, 2, {BLOCK_ID(X,X), RHS_ID(X)}, rhs};
+
+      for (Y=X+1; Y<BCOUNT; Y++) {
+         tasks[nb++] = (block_task){k, buf, TASK_FORWARD_UPDATE, Y, X, 0, 2*n2, 3, {BLOCK_ID(Y,X), RHS_ID(X), RHS_ID(Y)}, rhs};
       }
    }
 
-   /* compute matN = L*Lt */
-   printf("Computing input matrix (size = %d x %d, %d x %d blocks)...\n", N*BCOUNT, N*BCOUNT, BCOUNT, BCOUNT);
-   for (y=0; y<N*BCOUNT; y++) {
-      for (x=0; x<=y; x++) {
-         int X = x/N;
-         int Y = y/N;
-         int y2 = y % N;
-         int x2 = x % N;
-         mat[Y][X][y2*N+x2] = 0.0;
-         for (z=0; z <= min(x,y); z++) {
-            mat[Y][X][y2*N+x2] += L(z,y) * L(z,x);
-         }
+   for (X=BCOUNT-1; X>=0; X--) {
+      tasks[nb++] = (block_task){k, buf, TASK_BACKWARD, X, X, 0, n2, 2, {BLOCK_ID(X,X), RHS_ID(X)}, rhs};
+
+      for (Y=0; Y<X; Y++) {
+         tasks[nb++] = (block_task){k, buf, TASK_BACKWARD_UPDATE, Y, X, 0, 2*n2, 3, {BLOCK_ID(X,Y), RHS_ID(X), RHS_ID(Y)}, rhs};
       }
    }
 
-   cl_uint nb_platf;
-   clGetPlatformIDs(0, NULL, &nb_platf);
+   return nb;
+}
 
-   printf("%d OpenCL platform%s found\n", nb_platf, nb_platf > 1 ? "s" : "");
+cl_int submitBlockTask(cl_command_queue cq, void * arg, cl_uint nb_deps, const cl_event * deps, cl_event * done, char ** log) {
+   block_task * t = arg;
+
+   switch (t->kind) {
+      case TASK_DIAGONAL:
+         return enqueueDiagonal(t->k, cq, t->step, t->buf[t->step][t->step], nb_deps, deps, done, log);
+      case TASK_PANEL:
+         return enqueuePanel(t->k, cq, t->Y, t->X, t->buf[t->step][t->step], t->buf[t->Y][t->X], nb_deps, deps, done, log);
+      case TASK_SYRK:
+         return enqueueSyrk(t->k, cq, t->Y, t->step, t->buf[t->Y][t->step], t->buf[t->Y][t->Y], nb_deps, deps, done, log);
+      case TASK_FORWARD:
+      case TASK_BACKWARD:
+         return enqueueSolve(t->k, cq, t->X, t->kind == TASK_BACKWARD, t->buf[t->X][t->X], t->rhs[t->X], nb_deps, deps, done, log);
+      case TASK_FORWARD_UPDATE:
+         return enqueueSolveUpdate(t->k, cq, t->Y, t->X, 0, t->buf[t->Y][t->X], t->rhs[t->X], t->rhs[t->Y], nb_deps, deps, done, log);
+      case TASK_BACKWARD_UPDATE:
+         return enqueueSolveUpdate(t->k, cq, t->Y, t->X, 1, t->buf[t->X][t->Y], t->rhs[t->X], t->rhs[t->Y], nb_deps, deps, done, log);
+      default:
+         return enqueueGemm(t->k, cq, t->Y, t->X, t->step, t->buf[t->Y][t->step], t->buf[t->X][t->step], t->buf[t->Y][t->X], nb_deps, deps, done, log);
+   }
+}
 
-   cl_platform_id platfs[nb_platf];
-   clGetPlatformIDs(nb_platf, platfs, NULL);
+/* Dynamic scheduling: the task graph is run by the runtime, blocks start on
+ * their owner of the static mapping. With right-hand sides (sc->rhs), the
+ * tasks of the solve are part of the same graph. */
+cl_int factorDynamic(session * s, schedule * sc, block_kernels * k, char ** log) {
+   cl_int err;
+   int X, Y, i;
 
-   cl_uint p;
-   for (p=0; p<nb_platf; p++) {
+   runtime * rt;
+   err = createRuntime(s, RHS_ID(BCOUNT), k->prof, &rt, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
 
-      size_t plat_name_size;
-      clGetPlatformInfo(platfs[p], CL_PLATFORM_NAME, 0, NULL, &plat_name_size);
-      char plat_name[plat_name_size];
-      clGetPlatformInfo(platfs[p], CL_PLATFORM_NAME, plat_name_size, &plat_name, NULL);
+   for (Y=0; Y<BCOUNT; Y++) {
+      for (X=0; X<=Y; X++) {
+         runtimeData(rt, BLOCK_ID(Y,X), sc->buf[Y][X], OWNER(sc,Y,X));
+      }
+      if (sc->rhs[Y] != NULL) {
+         runtimeData(rt, RHS_ID(Y), sc->rhs[Y], sc->rhs_location[Y]);
+      }
+   }
 
-      size_t plat_vendor_size;
-      clGetPlatformInfo(platfs[p], CL_PLATFORM_VENDOR, 0, NULL, &plat_vendor_size);
-      char plat_vendor[plat_vendor_size];
-      clGetPlatformInfo(platfs[p], CL_PLATFORM_VENDOR, plat_vendor_size, &plat_vendor, NULL);
+   // Dependencies are inferred from the order of the static scheduler.
+   // The predecessors given to the tasks are complete: they are only given
+   // for the traces.
+   block_task tasks[BLOCK_TASKS + SOLVE_TASKS];
+   int nb = blockTasks(k, sc->buf, tasks);
+   if (sc->rhs[0] != NULL) {
+      nb += solveTasks(k, sc->buf, sc->rhs, tasks + nb);
+   }
 
-      cl_uint nb_devs;
-      clGetDeviceIDs(platfs[p], CL_DEVICE_TYPE_ALL, 0, NULL, &nb_devs);
-      printf("\nBenchmarking platform: %s (%s) - %d device%s\n\n", plat_name, plat_vendor, nb_devs, nb_devs > 1 ? "s" : "");
+   for (i=0; i<nb; i++) {
+      int modes[] = {ACCESS_R, ACCESS_R, ACCESS_R};
+      modes[tasks[i].nb_data-1] = ACCESS_RW;
+      runtimeTask(rt, submitBlockTask, &tasks[i], tasks[i].cost, tasks[i].nb_data, tasks[i].data, modes);
+   }
 
-      cl_device_id devs[nb_devs];
-      clGetDeviceIDs(platfs[p], CL_DEVICE_TYPE_ALL, nb_devs, devs, NULL);
+   err = runtimeRun(rt, log);
 
-      cl_uint d;
-      for (d=0; d<nb_devs; d++) {
-         benchDev(mat, 1, &devs[d]);
+   // Blocks are read back from the device holding their last version
+   for (Y=0; Y<BCOUNT; Y++) {
+      for (X=0; X<=Y; X++) {
+         sc->location[Y][X] = runtimeLocation(rt, BLOCK_ID(Y,X));
+      }
+      if (sc->rhs[Y] != NULL) {
+         sc->rhs_location[Y] = runtimeLocation(rt, RHS_ID(Y));
       }
+   }
 
-      if (strstr(plat_name, "SOCL") != NULL) {
+   releaseRuntime(rt);
+   return err;
+}
 
-         benchDev(mat, nb_devs, devs);
+/* Out-of-core factorization of the blocks of "host" (in place): blocks are
+ * streamed through a cache of nb_slots device buffers on the session queue,
+ * the blocks of the next CACHE_PREFETCH tasks are loaded ahead of time.
+ * Right-hand sides "rhs" (NULL if none) are then solved in place, through
+ * the same cache. */
+cl_int factorOutOfCore(session * s, block_kernels * k, double * host[BCOUNT][BCOUNT], double * rhs[BCOUNT], int nb_slots, cache_stats * stats, char ** log) {
+   cl_int err;
+   int X, Y, i, j;
 
-         void (*clShutdown)(void) = (clGetExtensionFunctionAddressForPlatform != NULL ?
-                                     clGetExtensionFunctionAddressForPlatform(platfs[p], "clShutdown") :
-                                    (clGetExtensionFunctionAddress != NULL ?
-                                     clGetExtensionFunctionAddress("clShutdown"):
-                                     NULL));
+   size_t size = k->n * k->n * sizeof(double);
+   size_t diag_size = packedSize(k->n, 16) * sizeof(double);
 
-         if (clShutdown != NULL) {
-            clShutdown();
-         }
+   tile_cache * c;
+   err = createTileCache(s, s->cq, nb_slots, size, RHS_ID(BCOUNT), k->prof, &c, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+
+   int block_y[BLOCK_ID(BCOUNT, 0)], block_x[BLOCK_ID(BCOUNT, 0)];
+   for (Y=0; Y<BCOUNT; Y++) {
+      for (X=0; X<=Y; X++) {
+         cacheData(c, BLOCK_ID(Y,X), host[Y][X], X == Y ? diag_size : size);
+         block_y[BLOCK_ID(Y,X)] = Y;
+         block_x[BLOCK_ID(Y,X)] = X;
+      }
+      if (rhs != NULL) {
+         cacheData(c, RHS_ID(Y), rhs[Y], k->n * k->nrhs * sizeof(double));
       }
    }
 
-   printf("\nDone.\n");
+   // Buffers of the blocks and right-hand sides of the current task
+   cl_mem bufs[BCOUNT][BCOUNT];
+   cl_mem rhs_bufs[BCOUNT];
+   block_task tasks[BLOCK_TASKS + SOLVE_TASKS];
+   int nb = blockTasks(k, bufs, tasks);
+   if (rhs != NULL) {
+      nb += solveTasks(k, bufs, rhs_bufs, tasks + nb);
+   }
 
+   // Blocks of the prefetched tasks and of the current one must fit
+   int depth = min(CACHE_PREFETCH, nb_slots/3 - 1);
+   int next = 0;
 
+   for (i=0; i<nb && err == CL_SUCCESS; i++) {
+      block_task * t = &tasks[i];
 
-   return 0;
-}
+      for (; next < nb && next <= i + depth && err == CL_SUCCESS; next++) {
+         for (j=0; j<tasks[next].nb_data && err == CL_SUCCESS; j++) {
+            err = cachePrefetch(c, tasks[next].data[j], log);
+         }
+      }
 
-void benchDev(double * mat[BCOUNT][BCOUNT], cl_int nb_dev, cl_device_id * devs) {
+      cl_event wait[3];
+      for (j=0; j<t->nb_data && err == CL_SUCCESS; j++) {
+         int id = t->data[j];
+         cl_mem * buf = (id < RHS_ID(0) ? &bufs[block_y[id]][block_x[id]] : &rhs_bufs[id - RHS_ID(0)]);
+         err = cacheAcquire(c, id, j == t->nb_data-1 ? CACHE_RW : CACHE_R, buf, &wait[j], log);
+      }
 
-   if (nb_dev == 1) {
-      cl_device_id dev = devs[0];
-      size_t dev_name_size;
-      clGetDeviceInfo(dev, CL_DEVICE_NAME, 0, NULL, &dev_name_size);
-      char dev_name[dev_name_size];
-      clGetDeviceInfo(dev, CL_DEVICE_NAME, dev_name_size, dev_name, NULL);
+      cl_event ev = NULL;
+      if (err == CL_SUCCESS) {
+         err = submitBlockTask(s->cq, t, t->nb_data, wait, &ev, log);
+      }
 
-      printf("  - Benchmarking device %s:\n", dev_name);
-   }
-   else {
-      printf("  - Benchmarking SOCL scheduler\n");
+      for (j=0; j<t->nb_data && ev != NULL; j++) {
+         cacheRelease(c, t->data[j], j == t->nb_data-1 ? CACHE_RW : CACHE_R, ev);
+      }
+      if (ev != NULL) clReleaseEvent(ev);
    }
 
-   int errCount;
-   cl_ulong duration;
-   char * log;
-   double maxDiff;
+   if (err == CL_SUCCESS) {
+      err = cacheFlush(c, log);
+   }
+   else clFinish(s->cq);
 
-   int err = performCholesky(mat, N, nb_dev, devs, epsilon, &errCount, &maxDiff, &duration, &log);
+   if (stats != NULL) *stats = c->stats;
+   releaseTileCache(c);
+   return err;
+}
 
-   if (err != CL_SUCCESS) {
-      printf("      - Error %d: %s\n", err, log);
+/* Buffers of factorResidual, NULL until acquired */
+typedef struct {
+   cl_mem a, l;                                 // packed matrices
+   cl_mem staging[2*BCOUNT*(BCOUNT+1)/2];       // blocks uploaded from the host
+   cl_event writes[2*BCOUNT*(BCOUNT+1)/2];
+   int nb_staging;
+   cl_event packs[2*BCOUNT*(BCOUNT+1)/2];
+   int nb_packs;
+} residual_buffers;
+
+/* Give the buffers of factorResidual back to the session (commands must be
+ * complete) */
+void releaseResidual(session * s, residual_buffers * r) {
+   int i;
+
+   for (i=0; i<r->nb_staging; i++) {
+      sessionRelease(s, r->staging[i]);
+      if (r->writes[i] != NULL) clReleaseEvent(r->writes[i]);
    }
-   else {
-      printf("      - Execution time: %.f ms and %s",
-            duration/1000.0, (errCount == 0 ? "succeeded" : "failed"));
-      if (errCount > 0) {
-         printf(" (%d errors, max diff %e, epsilon %e).\n", errCount, maxDiff, epsilon);
-      }
-      else printf(" (epsilon %e)\n", epsilon);
+   for (i=0; i<r->nb_packs; i++) {
+      clReleaseEvent(r->packs[i]);
    }
-   printf("\n");
+   if (r->a != NULL) sessionRelease(s, r->a);
+   if (r->l != NULL) sessionRelease(s, r->l);
 }
 
-cl_int loadKernel(char * kernelFile, char * kernelName, cl_context ctx, cl_int nb_dev, cl_device_id * devs, char **log, cl_kernel * kernel) {
+/* Copy block (Y, X) to packed matrix m on cq, from the device buffer "block"
+ * or, if NULL, from the host block "host" through a staging buffer */
+cl_int packBlock(session * s, cl_command_queue cq, cl_kernel dpack_block, residual_buffers * r, cl_mem m, int Y, int X, cl_mem block, double * host, cl_ulong n, char ** log) {
    cl_int err;
+   cl_event * write = NULL;
+   size_t size = (X == Y ? packedSize(n, 16) : n * n) * sizeof(double);
+
+   if (block == NULL) {
+      err = sessionBuffer(s, size, &block, log);
+      if (err != CL_SUCCESS) {
+         return err;
+      }
+      r->staging[r->nb_staging] = block;
+      write = &r->writes[r->nb_staging++];
 
-   FILE * f = fopen(kernelFile, "r");
-   if (f == NULL) return 1;
+      err = clEnqueueWriteBuffer(cq, block, CL_FALSE, 0, size, host, 0, NULL, write);
+      if (err != CL_SUCCESS) {
+         *log = strdup("Unable to enqueue write buffer command");
+         return err;
+      }
+   }
 
-   fseek(f, 0, SEEK_END);
-   size_t source_size = ftell(f);
-   fseek(f, 0, SEEK_SET);
+   cl_ulong bY = Y, bX = X;
+   err = clSetKernelArg(dpack_block, 0, sizeof(cl_mem), &block);
+   err |= clSetKernelArg(dpack_block, 1, sizeof(cl_mem), &m);
+   err |= clSetKernelArg(dpack_block, 2, sizeof(cl_ulong), &n);
+   err |= clSetKernelArg(dpack_block, 3, sizeof(cl_ulong), &bY);
+   err |= clSetKernelArg(dpack_block, 4, sizeof(cl_ulong), &bX);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to set kernel parameter");
+      return err;
+   }
 
-   char * source = malloc(source_size+1);
-   fread(source, 1, source_size, f);
-   source[source_size] = '\0';
-   fclose(f);
+   size_t dpack_block_global[] = {n,n,1};
+   size_t dpack_block_local[] = {16,16,1};
+   err = clEnqueueNDRangeKernel(cq, dpack_block, 2, NULL, dpack_block_global, dpack_block_local, write != NULL ? 1 : 0, write, &r->packs[r->nb_packs]);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to enqueue kernel execution command");
+      return err;
+   }
+   r->nb_packs++;
 
-   cl_program prg = clCreateProgramWithSource(ctx, 1, (const char**)&source, NULL, NULL);
+   return CL_SUCCESS;
+}
 
-   int d;
-   for (d = 0; d<nb_dev; d++) {
-      cl_device_id dev = devs[d];
+/* Pack mat and its factor to r->a and r->l on cq. The blocks of the factor
+ * are taken from buf, or from res if buf is NULL. */
+cl_int packFactor(session * s, cl_command_queue cq, tile_config c, residual_buffers * r, cl_mem (*buf)[BCOUNT], double * mat[BCOUNT][BCOUNT], double * res[BCOUNT][BCOUNT], cl_ulong n, char ** log) {
+   cl_int err;
+   int X, Y;
 
-      err = clBuildProgram(prg, 1, &dev, NULL, NULL, NULL);
+   char options[64];
+   tileOptions(c, options, sizeof(options));
 
-      if (err != CL_SUCCESS) {
-         size_t log_size;
-         clGetProgramBuildInfo(prg, dev, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-         *log = malloc(log_size);
-         clGetProgramBuildInfo(prg, dev, CL_PROGRAM_BUILD_LOG, log_size, *log, NULL);
-         return err;
-      }
+   cl_kernel dpack_block;
+   err = sessionKernel(s, "dgemm.cl", "dpack_block", options, &dpack_block, log);
+   if (err != CL_SUCCESS) {
+      return err;
    }
 
-   
-   *kernel = clCreateKernel(prg, kernelName, &err);
+   size_t size = packedSize(n*BCOUNT, c.ts) * sizeof(double);
+   err = sessionBuffer(s, size, &r->a, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+   err = sessionBuffer(s, size, &r->l, log);
    if (err != CL_SUCCESS) {
-      char buffer[4096];
-      sprintf(buffer, "Unable to create kernel with name \"%s\" from file %s", kernelName, kernelFile);
-      *log = strdup(buffer);
       return err;
    }
 
-   clReleaseProgram(prg);
+   for (Y=0; Y<BCOUNT; Y++) {
+      for (X=0; X<=Y; X++) {
+         err = packBlock(s, cq, dpack_block, r, r->a, Y, X, NULL, mat[Y][X], n, log);
+         if (err != CL_SUCCESS) {
+            return err;
+         }
+         err = packBlock(s, cq, dpack_block, r, r->l, Y, X, buf != NULL ? buf[Y][X] : NULL, res[Y][X], n, log);
+         if (err != CL_SUCCESS) {
+            return err;
+         }
+      }
+   }
 
    return CL_SUCCESS;
 }
 
-int performCholesky(double * mat[BCOUNT][BCOUNT], cl_ulong n, cl_int nb_dev, cl_device_id * devs, double epsilon, int * errCount, double * maxDiff, cl_ulong * duration, char ** log) {
+/* Backward error ||A - L*Lt|| / ||A|| of the factor of mat, computed on the
+ * first device of the session with the kernels of multi_kernel (see
+ * residual.h). The blocks are copied to the packed layout of packed.h on
+ * the device (the 16x16 tiles of the diagonal blocks are tiles of it): the
+ * factor from buf if it is still on the devices, from res otherwise (out-of-
+ * core mode), and mat from the host. Only the result is read back. */
+cl_int factorResidual(session * s, cl_mem (*buf)[BCOUNT], double * mat[BCOUNT][BCOUNT], double * res[BCOUNT][BCOUNT], cl_ulong n, double * residual, char ** log) {
+
+   tile_config c = {16, 1};
+   cl_command_queue cq = (s->cq != NULL ? s->cq : s->queues[0]);
+
+   residual_buffers r;
+   memset(&r, 0, sizeof(r));
+
+   cl_int err = packFactor(s, cq, c, &r, buf, mat, res, n, log);
+   if (err == CL_SUCCESS) {
+      // Blocking: every command is complete once the result is read
+      err = computeResidual(s, cq, c, r.l, r.a, n*BCOUNT, r.nb_packs, r.packs, residual, log);
+   }
+   if (err != CL_SUCCESS) {
+      clFinish(cq);
+   }
+
+   releaseResidual(s, &r);
+   return err;
+}
+
+/* Factor mat and read the factor back to res (NULL to keep it on the
+ * devices, except in the out-of-core mode), with its backward error in
+ * residual, and checked against L unless check_factor is 0. With right-hand
+ * sides rhs (NULL if none), the solve follows the factorization in the same
+ * pipeline and only its solution is read back to sol, with its backward
+ * error in berr. */
+int performCholesky(session * s, int mode, double * mat[BCOUNT][BCOUNT], double * res[BCOUNT][BCOUNT], double * rhs[BCOUNT], double * sol[BCOUNT], cl_ulong n, double epsilon, int * errCount, double * maxDiff, double * residual, double * berr, cache_stats * stats, profile * prof, cl_ulong * duration, char ** log) {
 
    int x, y, X, Y;
    cl_int err;
 
    size_t size = n * n * sizeof(double);
+   size_t diag_size = packedSize(n, 16) * sizeof(double);
+   size_t rhs_size = n * NRHS * sizeof(double);
 
-   double * matR[BCOUNT][BCOUNT];
-   for (Y=0; Y<BCOUNT; Y++) {
-      for(X=0; X<=Y; X++) {
-         matR[Y][X] = malloc(size);
-         memset(matR[Y][X], 0, size);
-      }
+   // Kernels are only built by the first factorization of the session
+   cl_kernel dpotrf, dtrsm, dgemm, dtrsm_block, dgemm_block, dsyrk, dtrsm_rhs, dgemm_rhs;
+   err = sessionSubGroupKernel(s, "dpotrf.cl", "dpotrf", "dpotrf_sg", NULL, 16, 16, &dpotrf, NULL, log);
+   if (err != CL_SUCCESS) {
+      return err;
    }
-
-   cl_context ctx = clCreateContext(NULL, nb_dev, devs, NULL, NULL, &err);
+   err = sessionKernel(s, "dtrsm.cl", "dtrsm", NULL, &dtrsm, log);
    if (err != CL_SUCCESS) {
-      *log = strdup("Unable to create context");
       return err;
    }
-
-   cl_device_id dev;
-
-   // Compile for every device
-   cl_kernel dpotrf, dtrsm, dgemm, dtrsm_block, dgemm_block;
-   err = loadKernel("dpotrf.cl", "dpotrf", ctx, nb_dev, devs, log, &dpotrf);
+   err = sessionKernel(s, "dgemm.cl", "dgemm", NULL, &dgemm, log);
    if (err != CL_SUCCESS) {
       return err;
    }
-   err = loadKernel("dtrsm.cl", "dtrsm", ctx, nb_dev, devs, log, &dtrsm);
+   // Register-blocked version (4x4 elements per work-item) when the buffer size allows it
+   int dgemm_block_v2 = (n % 64 == 0);
+   err = sessionKernel(s, dgemm_block_v2 ? "dgemm_block_v2.cl" : "dgemm_block.cl", "dgemm_block", NULL, &dgemm_block, log);
    if (err != CL_SUCCESS) {
       return err;
    }
-   err = loadKernel("dgemm.cl", "dgemm", ctx, nb_dev, devs, log, &dgemm);
+   // Tuned rows per work-item of the first device, the tile size is the one
+   // of the packed diagonal blocks
+   tile_config tile;
+   if (!loadTileConfig(s->devs[0], &tile) || tile.ts != 16) {
+      tile.ts = 16;
+      tile.wpt = TILE_DEFAULT_WPT;
+   }
+   char options[64];
+   tileOptions(tile, options, sizeof(options));
+   err = sessionKernel(s, "dtrsm_block.cl", "dtrsm_block", options, &dtrsm_block, log);
    if (err != CL_SUCCESS) {
       return err;
    }
-   err = loadKernel("dgemm_block.cl", "dgemm_block", ctx, nb_dev, devs, log, &dgemm_block);
+   err = sessionKernel(s, "dsyrk.cl", "dsyrk", dgemm_block_v2 ? "-D MT=4" : "-D MT=1", &dsyrk, log);
    if (err != CL_SUCCESS) {
       return err;
    }
-   err = loadKernel("dtrsm_block.cl", "dtrsm_block", ctx, nb_dev, devs, log, &dtrsm_block);
+   err = sessionKernel(s, "dpotrs.cl", "dtrsm_rhs", NULL, &dtrsm_rhs, log);
    if (err != CL_SUCCESS) {
       return err;
    }
-
-   // If more than one device, we are using SOCL to perform scheduling (=> dev = NULL)
-   dev = (nb_dev == 1 ? devs[0] : NULL);
-
-   cl_command_queue cq = clCreateCommandQueue(ctx, dev, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | CL_QUEUE_PROFILING_ENABLE, &err);
+   err = sessionKernel(s, "dpotrs.cl", "dgemm_rhs", NULL, &dgemm_rhs, log);
    if (err != CL_SUCCESS) {
-      *log = strdup("Unable to create command queue");
       return err;
    }
 
-   cl_mem buf[BCOUNT][BCOUNT];
-   cl_event events[BCOUNT][BCOUNT];
-
-   for (Y=0; Y<BCOUNT; Y++) {
-      for (X=0; X<=Y; X++) {
+   block_kernels k = {dpotrf, dtrsm, dgemm, dtrsm_block, dgemm_block, dsyrk, dtrsm_rhs, dgemm_rhs, dgemm_block_v2, tile, n, NRHS, prof};
+   struct timespec start, end;
 
+   // Only computed when the factor is read back
+   *residual = 0.0;
 
-         buf[Y][X] = clCreateBuffer(ctx, CL_MEM_READ_WRITE, size, NULL, &err);
-         if (err != CL_SUCCESS) {
-            *log = strdup("Unable to allocate buffer");
-            return err;
+   if (mode == SCHED_OUT_OF_CORE) {
+      // Factored in place in host memory, transfers are part of the time
+      if (res != mat) {
+         for (Y=0; Y<BCOUNT; Y++) {
+            for (X=0; X<=Y; X++) {
+               memcpy(res[Y][X], mat[Y][X], X == Y ? diag_size : size);
+            }
          }
-
-
-         err = clEnqueueWriteBuffer(cq, buf[Y][X], 0, 0, size, mat[Y][X], 0, NULL, &events[Y][X]);
-         if (err != CL_SUCCESS) {
-            *log = strdup("Unable to enqueue write buffer command");
-            return err;
+      }
+      if (rhs != NULL) {
+         for (Y=0; Y<BCOUNT; Y++) {
+            memcpy(sol[Y], rhs[Y], rhs_size);
          }
       }
-   }
 
-   clFinish(cq);
+      // Too few slots are rejected by the cache
+      int slots = cacheSlots(s->devs[0], size, CACHE_BLOCKS);
 
-   struct timespec start, end;
-   clock_gettime(CLOCK_MONOTONIC, &start);
-
-   cl_event ev;
-
-   int step;
-
-   for (step=0; step<BCOUNT; step++) {
-
-      /******************** Diagonal block ***********************/
+      clock_gettime(CLOCK_MONOTONIC, &start);
 
-      err = clSetKernelArg(dpotrf, 0, sizeof(cl_mem), &buf[step][step]);
-      err |= clSetKernelArg(dpotrf, 1, sizeof(cl_ulong), &n);
-      err |= clSetKernelArg(dtrsm, 0, sizeof(cl_mem), &buf[step][step]);
-      err |= clSetKernelArg(dtrsm, 1, sizeof(cl_ulong), &n);
-      err |= clSetKernelArg(dgemm, 0, sizeof(cl_mem), &buf[step][step]);
-      err |= clSetKernelArg(dgemm, 1, sizeof(cl_ulong), &n);
+      err = factorOutOfCore(s, &k, res, rhs != NULL ? sol : NULL, slots, stats, log);
       if (err != CL_SUCCESS) {
-         *log = strdup("Unable to set kernel parameter");
          return err;
       }
 
-      cl_long i;
-      for (i=0; i<n/16; i++) {
-
-         err = clSetKernelArg(dpotrf, 2, sizeof(cl_ulong), &i);
-         err |= clSetKernelArg(dgemm, 2, sizeof(cl_ulong), &i);
-         err |= clSetKernelArg(dtrsm, 2, sizeof(cl_ulong), &i);
-         if (err != CL_SUCCESS) {
-            *log = strdup("Unable to set kernel parameter");
-            return err;
-         }
-
-         size_t dpotrf_global[] = {16,16,1};
-         size_t dpotrf_local[] = {16,16,1};
+      clock_gettime(CLOCK_MONOTONIC, &end);
 
-         err = clEnqueueNDRangeKernel(cq, dpotrf, 2, NULL, dpotrf_global, dpotrf_local, 1, &events[step][step], &ev);
-         if (err != CL_SUCCESS) {
-            *log = strdup("Unable to enqueue kernel execution command");
-            return err;
-         }
-         clReleaseEvent(events[step][step]);
-         events[step][step] = ev;
+      // Not part of the time, the factor is only in host memory
+      err = factorResidual(s, NULL, mat, res, n, residual, log);
+      if (err != CL_SUCCESS) {
+         return err;
+      }
+   }
+   else {
+      schedule sc;
+      err = createSchedule(s, mode, &sc, log);
+      if (err != CL_SUCCESS) {
+         return err;
+      }
 
-         size_t r = n - (i+1)*16;
+      // Transfers are part of the time: they overlap the factorization
+      clock_gettime(CLOCK_MONOTONIC, &start);
 
-         if (r > 0) {
+      // Blocks are uploaded to the device that owns them, in column order
+      for (X=0; X<BCOUNT; X++) {
+         for (Y=X; Y<BCOUNT; Y++) {
 
-            size_t dtrsm_global[] = {16,r,1};
-            size_t dtrsm_local[] = {16,16,1};
-            err = clEnqueueNDRangeKernel(cq, dtrsm, 2, NULL, dtrsm_global, dtrsm_local, 1, &events[step][step], &ev);
+            err = sessionBuffer(s, X == Y ? diag_size : size, &sc.buf[Y][X], log);
             if (err != CL_SUCCESS) {
-               *log = strdup("Unable to enqueue kernel execution command");
                return err;
             }
-            clReleaseEvent(events[step][step]);
-            events[step][step] = ev;
 
-            size_t dgemm_global[] = {r, r,1};
-            size_t dgemm_local[] = {16,16,1};
-            err = clEnqueueNDRangeKernel(cq, dgemm, 2, NULL, dgemm_global, dgemm_local, 1, &events[step][step], &ev);
+            err = clEnqueueWriteBuffer(sc.transfer[OWNER(&sc,Y,X)], sc.buf[Y][X], CL_FALSE, 0, X == Y ? diag_size : size, mat[Y][X], 0, NULL, &sc.events[Y][X]);
             if (err != CL_SUCCESS) {
-               *log = strdup("Unable to enqueue kernel execution command");
+               *log = strdup("Unable to enqueue write buffer command");
                return err;
             }
-            clReleaseEvent(events[step][step]);
-            events[step][step] = ev;
+            profileRecord(prof, sc.events[Y][X], "write", 0, X == Y ? diag_size : size);
+            profileAnnotate(prof, 0, NULL, "write (%d,%d)", Y, X);
          }
       }
 
-      /*********** SUB-DIAGONAL BLOCKS *******************/
-      err = clSetKernelArg(dtrsm_block, 0, sizeof(cl_mem), &buf[step][step]);
-      if (err != CL_SUCCESS) {
-         *log = strdup("Unable to set kernel parameter");
-         return err;
-      }
+      // Right-hand sides last: they are only needed once column 0 is final
+      for (Y=0; Y<BCOUNT && rhs != NULL; Y++) {
 
-      X = step;
-      for (Y=step+1; Y<BCOUNT; Y++) {
-         err = clSetKernelArg(dtrsm_block, 1, sizeof(cl_mem), &buf[Y][X]);
+         err = sessionBuffer(s, rhs_size, &sc.rhs[Y], log);
          if (err != CL_SUCCESS) {
-            *log = strdup("Unable to set kernel parameter");
             return err;
          }
 
-         size_t dtrsm_block_global[] = {N,N,1};
-         size_t dtrsm_block_local[] = {N,1,1};
-
-         cl_event deps[] = {events[step][step], events[Y][X]};
-         err = clEnqueueNDRangeKernel(cq, dtrsm_block, 2, NULL, dtrsm_block_global, dtrsm_block_local, 2, deps, &ev);
+         err = clEnqueueWriteBuffer(sc.transfer[sc.rhs_location[Y]], sc.rhs[Y], CL_FALSE, 0, rhs_size, rhs[Y], 0, NULL, &sc.rhs_events[Y]);
          if (err != CL_SUCCESS) {
-            *log = strdup("Unable to enqueue kernel execution command");
+            *log = strdup("Unable to enqueue write buffer command");
             return err;
          }
-         clReleaseEvent(events[Y][X]);
-         events[Y][X] = ev;
+         profileRecord(prof, sc.rhs_events[Y], "write", 0, rhs_size);
+         profileAnnotate(prof, 0, NULL, "write rhs %d", Y);
       }
 
+      cl_uint d;
+      for (d=0; d<sc.nb_q; d++) {
+         clFlush(sc.transfer[d]);
+      }
 
-      /*********** OTHER BLOCKS *******************/
-      for (Y=step+1; Y<BCOUNT; Y++) {
-         for (X=step+1; X<=Y; X++) {
-            err = clSetKernelArg(dgemm_block, 0, sizeof(cl_mem), &buf[Y][step]);
-            err |= clSetKernelArg(dgemm_block, 1, sizeof(cl_mem), &buf[X][step]);
-            err |= clSetKernelArg(dgemm_block, 2, sizeof(cl_mem), &buf[Y][X]);
-            if (err != CL_SUCCESS) {
-               *log = strdup("Unable to set kernel parameter");
-               return err;
-            }
+      if (mode == SCHED_DYNAMIC) {
+         // Tasks only wait for each other: blocks must be on the devices
+         finishSchedule(&sc);
+         err = factorDynamic(s, &sc, &k, log);
+      }
+      else {
+         sc.res = res;
+         err = factorStatic(s, &sc, &k, log);
+         if (err == CL_SUCCESS && rhs != NULL) {
+            err = solveStatic(s, &sc, &k, log);
+         }
+      }
+      if (err != CL_SUCCESS) {
+         return err;
+      }
+
+      // Solution
+      for (Y=0; Y<BCOUNT && rhs != NULL; Y++) {
+         err = clEnqueueReadBuffer(sc.transfer[sc.rhs_location[Y]], sc.rhs[Y], CL_FALSE, 0, rhs_size, sol[Y], 1, &sc.rhs_events[Y], &sc.rhs_reads[Y]);
+         if (err != CL_SUCCESS) {
+            *log = strdup("Unable to enqueue read buffer command");
+            return err;
+         }
+         profileRecord(prof, sc.rhs_reads[Y], "read", 0, rhs_size);
+         profileAnnotate(prof, 1, &sc.rhs_events[Y], "read rhs %d", Y);
+      }
 
-            size_t dgemm_block_global[] = {N,N,1};
-            size_t dgemm_block_local[] = {16,16,1};
+      // Blocks that have not been read back yet
+      for (Y=0; Y<BCOUNT && res != NULL; Y++) {
+         for (X=0; X<=Y; X++) {
+            if (sc.reads[Y][X] != NULL) continue;
 
-            cl_event deps[] = {events[Y][step], events[X][step], events[Y][X]};
-            err = clEnqueueNDRangeKernel(cq, dgemm_block, 2, NULL, dgemm_block_global, dgemm_block_local, 3, deps, &ev);
+            err = clEnqueueReadBuffer(sc.transfer[sc.location[Y][X]], sc.buf[Y][X], CL_FALSE, 0, X == Y ? diag_size : size, res[Y][X], 1, &sc.events[Y][X], &sc.reads[Y][X]);
             if (err != CL_SUCCESS) {
-               *log = strdup("Unable to enqueue kernel execution command");
+               *log = strdup("Unable to enqueue read buffer command");
                return err;
             }
-            clReleaseEvent(events[Y][X]);
-            events[Y][X] = ev;
+            profileRecord(prof, sc.reads[Y][X], "read", 0, X == Y ? diag_size : size);
+            profileAnnotate(prof, 1, &sc.events[Y][X], "read (%d,%d)", Y, X);
          }
       }
 
-   }
-
-   clFinish(cq);
-
-   clock_gettime(CLOCK_MONOTONIC, &end);
+      finishSchedule(&sc);
 
+      clock_gettime(CLOCK_MONOTONIC, &end);
 
-   for (Y=0; Y<BCOUNT; Y++) {
-      for (X=0; X<=Y; X++) {
+      // Not part of the time, on the blocks of the factor still on the devices
+      if (res != NULL) {
+         err = factorResidual(s, sc.buf, mat, res, n, residual, log);
+      }
 
-         err = clEnqueueReadBuffer(cq, buf[Y][X], 0, 0, size, matR[Y][X], 1, &events[Y][X], &ev);
-         if (err != CL_SUCCESS) {
-            *log = strdup("Unable to enqueue read buffer command");
-            return err;
-         }
-         clReleaseEvent(events[Y][X]);
-         events[Y][X] = ev;
+      releaseSchedule(s, &sc);
+      if (err != CL_SUCCESS) {
+         return err;
       }
    }
 
-   clFinish(cq);
-
-   *duration = end.tv_nsec - start.tv_nsec + (end.tv_sec-start.tv_sec) * 10e9;
-
-   for (Y=0; Y<BCOUNT; Y++) {
-      for (X=0; X<=Y; X++) {
-         clReleaseMemObject(buf[Y][X]);
-         clReleaseEvent(events[Y][X]);
+   if (prof != NULL) {
+      err = profileCollect(prof, log);
+      if (err != CL_SUCCESS) {
+         return err;
       }
    }
-   clReleaseKernel(dpotrf);
-   clReleaseKernel(dtrsm);
-   clReleaseKernel(dgemm);
-   clReleaseKernel(dtrsm_block);
-   clReleaseKernel(dgemm_block);
-   clReleaseCommandQueue(cq);
-   clReleaseContext(ctx);
+
+   *duration = end.tv_nsec - start.tv_nsec + (end.tv_sec-start.tv_sec) * 1e9;
 
 
 /*   for (y=0; y<n*BCOUNT; y++) {
@@ -447,7 +1736,7 @@ int performCholesky(double * mat[BCOUNT][BCOUNT], cl_ulong n, cl_int nb_dev, cl_
          Y = y/N;
          int y2 = y % N;
          int x2 = x % N;
-         printf("%.3f ", matR[Y][X][y2*n+x2]);
+         printf("%.3f ", res[Y][X][y2*n+x2]);
       }
       printf("\n");
    }*/
@@ -456,19 +1745,45 @@ int performCholesky(double * mat[BCOUNT][BCOUNT], cl_ulong n, cl_int nb_dev, cl_
    *errCount = 0;
    *maxDiff = 0.0;
 
-   for (y=0; y<n*BCOUNT; y++) {
+   for (y=0; y<n*BCOUNT && res != NULL && check_factor; y++) {
       for (x=0; x<=y; x++) {
          X = x/N;
          Y = y/N;
          int y2 = y % N;
          int x2 = x % N;
-         double diff = fabs(matR[Y][X][y2*n+x2]-L(x,y));
-         if (diff > epsilon) {
+         double diff = fabs(res[Y][X][X == Y ? packedIndex(y2, x2, 16) : y2*n+x2]-L(x,y));
+         if (!(diff <= epsilon)) {      // NaN counts as an error
             *errCount += 1;
             if (diff > *maxDiff) *maxDiff = diff;
          }
       }
    }
 
+   // Normwise backward error of the solution, ||B - A X|| / (||A|| ||X||)
+   // (infinity norms), the worst of every right-hand side
+   *berr = 0.0;
+
+   int j;
+   for (j=0; j<NRHS && rhs != NULL; j++) {
+      double rnorm = 0.0, anorm = 0.0, xnorm = 0.0;
+
+      for (y=0; y<n*BCOUNT; y++) {
+         double r = rhs[y/n][(y%n)*NRHS + j];
+         double a = 0.0;
+         for (x=0; x<n*BCOUNT; x++) {
+            double v = symmetric(mat, y, x);
+            r -= v * sol[x/n][(x%n)*NRHS + j];
+            a += fabs(v);
+         }
+         double xi = fabs(sol[y/n][(y%n)*NRHS + j]);
+         if (fabs(r) > rnorm || isnan(r)) rnorm = fabs(r);      // NaN propagates
+         if (a > anorm) anorm = a;
+         if (xi > xnorm || isnan(xi)) xnorm = xi;
+      }
+
+      double e = rnorm / (anorm * xnorm);
+      if (e > *berr || isnan(e)) *berr = e;
+   }
+
    return 0;
 }
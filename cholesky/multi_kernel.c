@@ -1,12 +1,40 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include <float.h>
 #include <string.h>
 #include <CL/cl.h>
 
+#include "session.h"
+#include "packed.h"
+#include "matgen.h"
+#include "profiling.h"
+#include "tuning.h"
+#include "refine.h"
+#include "residual.h"
+
 #define min(a,b) ( a < b ? a : b)
 
-int performCholesky(double * matN, cl_ulong n, cl_device_id dev, int * errCount, cl_ulong * duration, char ** log);
+// Input matrix with the packed layout of packed.h, for tile size ts, in a
+// host buffer of the session
+typedef struct {
+   host_buffer hb;
+   cl_ulong n;
+   size_t ts;
+} packed_matrix;
+
+int performCholesky(session * s, tile_config c, const host_buffer * matN, cl_ulong n, int * errCount, double * residual, profile * prof, cl_ulong * duration, char ** log);
+/* Solve A x = b: A is factored in single precision on the device and x is
+ * refined on the host with double precision residuals. When refinement does
+ * not converge (A too ill-conditioned for a single precision factor), A is
+ * factored again in double precision, if the device supports it ("fp64").
+ * "precision" receives the precision of the factor x was computed with (32
+ * or 64), or 0 if x did not converge. The duration includes transfers. */
+int performMixedSolve(session * s, tile_config c, const host_buffer * matN, cl_ulong n, const double * b, double * x, int fp64,
+                      int * precision, int * iterations, double * berr, profile * prof, cl_ulong * duration, char ** log);
+cl_int benchTileConfig(tile_config c, cl_ulong * duration, void * arg, char ** log);
+cl_int generateMatrix(session * s, packed_matrix * mat, size_t ts, char ** log);
 
 #pragma weak clGetExtensionFunctionAddressForPlatform
 extern void * clGetExtensionFunctionAddressForPlatform(cl_platform_id, const char *);
@@ -18,24 +46,100 @@ extern void * clGetExtensionFunctionAddress(const char *);
  * cholesky factorization on A (and we should find L back)*/
 
 #define L(x,y) (100.0 / ((double)(x+y)+100.0))
+// Default matrix size (any size can be given on the command line)
 #define N 512
+// Maximum accepted backward error ||A - L*Lt|| / ||A||, in units of n*eps
+// (same criterion as the LAPACK test suite)
+#define RESIDUAL_THRESHOLD 30.0
+// Matrix size and factorizations per candidate when tuning the tile configuration
+#define TUNE_SIZE 1024
+#define TUNE_TRIES 2
+
+double factor(size_t x, size_t y, void * arg) {
+   return L(x,y);
+}
 
-int main() {
+double * element(size_t y, size_t x, void * arg) {
+   packed_matrix * mat = arg;
+   return (double *)mat->hb.ptr + packedIndex(y, x, mat->ts);
+}
 
-   int x, y, z;
+/* (Re)generate the matrix with the layout of tile size ts, directly in host
+ * memory the device reads (see sessionCopyToDevice) */
+cl_int generateMatrix(session * s, packed_matrix * mat, size_t ts, char ** log) {
+   if (mat->hb.mem != NULL && mat->ts == ts) return CL_SUCCESS;
 
-   double * matN = malloc(N * N * sizeof(double));
+   if (mat->hb.mem != NULL) {
+      releaseHostBuffer(s, &mat->hb);
+      mat->hb.mem = NULL;
+   }
 
+   // Lower triangle only, with the packed layout of packed.h (padding included)
+   size_t size = packedSize(mat->n, ts) * sizeof(double);
+   cl_int err = sessionHostBuffer(s, size, &mat->hb, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+   memset(mat->hb.ptr, 0, size);
+   mat->ts = ts;
 
    /* compute matN = L*Lt */
-   printf("Computing input matrix (size = %d)...\n", N);
-   for (y=0; y<N; y++) {
-      for (x=0; x<=y; x++) {
-         matN[y*N+x] = 0.0;
-         for (z=0; z <= min(x,y); z++) {
-            matN[y*N+x] += L(z,y) * L(z,x);
-         }
-      }
+   generateSPD(mat->n, factor, element, mat, 0);
+
+   return CL_SUCCESS;
+}
+
+typedef struct {
+   session * s;
+   packed_matrix mat;
+} tune_arg;
+
+cl_int benchTileConfig(tile_config c, cl_ulong * duration, void * arg, char ** log) {
+   tune_arg * t = arg;
+   int errCount;
+
+   cl_int err = generateMatrix(t->s, &t->mat, c.ts, log);
+   if (err == CL_SUCCESS) {
+      err = performCholesky(t->s, c, &t->mat.hb, t->mat.n, &errCount, NULL, NULL, duration, log);
+   }
+   if (err == CL_SUCCESS && errCount > 0) {
+      *log = strdup("Wrong result");
+      err = CL_INVALID_VALUE;
+   }
+
+   if (err == CL_SUCCESS) {
+      printf("        tile %2dx%-2d %d row%s per work-item: %.3f ms\n", c.ts, c.ts, c.wpt, c.wpt > 1 ? "s" : " ", *duration/1e6);
+   }
+   else {
+      printf("        tile %2dx%-2d %d row%s per work-item: failed (%s)\n", c.ts, c.ts, c.wpt, c.wpt > 1 ? "s" : " ", *log);
+   }
+
+   return err;
+}
+
+static int hasDouble(cl_device_id dev) {
+   size_t size;
+   clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, 0, NULL, &size);
+   char ext[size];
+   clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, size, ext, NULL);
+   return (strstr(ext, "cl_khr_fp64") != NULL);
+}
+
+int main(int argc, char ** argv) {
+
+   int n = (argc > 1 ? atoi(argv[1]) : N);
+   // Factorizations per device, all run through the same session
+   int runs = (argc > 2 ? atoi(argv[2]) : 1);
+
+   // Tile configuration: stored one of each device (or the default one),
+   // given one ("<ts>" or "<ts>x<rows per work-item>") or tuned ("tune")
+   int tune = (argc > 3 && strcmp(argv[3], "tune") == 0);
+   tile_config forced;
+   int force = (argc > 3 && !tune);
+
+   if (n <= 0 || runs <= 0 || (force && !parseTileConfig(argv[3], &forced))) {
+      fprintf(stderr, "Usage: %s [matrix size] [runs] [tile size[xrows per work-item]|tune]\n", argv[0]);
+      return 1;
    }
 
    cl_uint nb_platf;
@@ -76,18 +180,101 @@ int main() {
          printf("  - Benchmarking device %s:\n", dev_name);
 
          int errCount;
+         double residual;
          cl_ulong duration;
          char * log;
 
-         int err = performCholesky(matN, N, devs[d], &errCount, &duration, &log);
+         session * s = NULL;
+         int err = createSession(1, &devs[d], &s, &log);
 
-         if (err != CL_SUCCESS) {
-            printf("      - Error %d: %s\n", err, log);
+         // Generated again in the host memory of each session
+         packed_matrix mat = {{NULL}, n, 0};
+
+         tile_config c;
+         const char * origin;
+         if (force) {
+            c = forced;
+            origin = "given";
+         }
+         else if (err == CL_SUCCESS && tune) {
+            printf("      - Tuning (size = %d):\n", TUNE_SIZE);
+            tune_arg t = {s, {{NULL}, TUNE_SIZE, 0}};
+            err = tuneTileConfig(devs[d], benchTileConfig, &t, TUNE_TRIES, &c, &log);
+            if (t.mat.hb.mem != NULL) releaseHostBuffer(s, &t.mat.hb);
+            origin = "tuned";
          }
          else {
-            printf("      - Execution time: %.f ms and %s (%d errors).\n", 
-               duration/1000.0, (errCount == 0 ? "succeeded" : "failed"), errCount);
+            origin = (loadTileConfig(devs[d], &c) ? "stored" : "default");
+         }
+
+         // Devices without double precision only run mixed-precision solves
+         int fp64 = hasDouble(devs[d]);
+
+         // Mixed-precision solve of A x = b, with b such that the solution is 1
+         double * b = malloc(n * sizeof(double));
+         double * x = malloc(n * sizeof(double));
+
+         if (err == CL_SUCCESS) {
+            printf("      - Tile %dx%d, %d row%s per work-item (%s)\n", c.ts, c.ts, c.wpt, c.wpt > 1 ? "s" : "", origin);
+            printf("      - Computing input matrix (size = %d)...\n", n);
+            err = generateMatrix(s, &mat, c.ts, &log);
+         }
+
+         if (err == CL_SUCCESS) {
+            int i;
+            for (i=0; i<n; i++) {
+               x[i] = 1.0;
+            }
+            packedSymv(mat.hb.ptr, n, c.ts, x, b);
+
+            if (!fp64) printf("      - No double precision support: mixed-precision solves only\n");
+         }
+
+         int run;
+         for (run=0; run<runs && err == CL_SUCCESS; run++) {
+            profile * prof = createProfile();
+
+            if (fp64) {
+               err = performCholesky(s, c, &mat.hb, n, &errCount, &residual, prof, &duration, &log);
+
+               if (err == CL_SUCCESS) {
+                  int ok = (errCount == 0 && residual <= RESIDUAL_THRESHOLD * n * DBL_EPSILON);
+                  printf("      - Execution time: %.3f ms and %s (%d errors, residual %e).\n", 
+                     duration/1e6, (ok ? "succeeded" : "failed"), errCount, residual);
+                  profileReport(prof, stdout, "          ");
+               }
+               releaseProfile(prof);
+               prof = createProfile();
+            }
+
+            int precision, iterations;
+            double berr;
+            if (err == CL_SUCCESS) {
+               err = performMixedSolve(s, c, &mat.hb, n, b, x, fp64, &precision, &iterations, &berr, prof, &duration, &log);
+            }
+
+            if (err == CL_SUCCESS) {
+               double ferr = 0.0;
+               int i;
+               for (i=0; i<n; i++) {
+                  if (!(fabs(x[i] - 1.0) <= ferr)) ferr = fabs(x[i] - 1.0);      // NaN propagates
+               }
+               printf("      - Mixed-precision solve: %.3f ms and %s (%s, %d refinement iteration%s, backward error %e, error %e).\n",
+                  duration/1e6, (precision != 0 ? "succeeded" : "failed"),
+                  (precision == 32 ? "single precision factor" : precision == 64 ? "fell back to double precision" : "no convergence"),
+                  iterations, iterations != 1 ? "s" : "", berr, ferr);
+               profileReport(prof, stdout, "          ");
+            }
+            releaseProfile(prof);
          }
+
+         free(b);
+         free(x);
+
+         if (err != CL_SUCCESS) {
+            printf("      - Error %d: %s\n", err, log);
+         }
+         if (s != NULL) releaseSession(s);
          printf("\n");
       }
 
@@ -113,199 +300,323 @@ int main() {
    return 0;
 }
 
-cl_int loadKernel(char * kernelFile, char * kernelName, cl_context ctx, cl_device_id dev, char **log, cl_kernel * kernel) {
-   cl_int err;
-
-   FILE * f = fopen(kernelFile, "r");
-   if (f == NULL) return 1;
+/* Kernels of the factorization, in double precision or in single precision
+ * (mixed-precision solves) */
+typedef struct {
+   cl_kernel dpotrf_panel, dgemm, dgemm_panel;
+} factor_kernels;
 
-   fseek(f, 0, SEEK_END);
-   size_t source_size = ftell(f);
-   fseek(f, 0, SEEK_SET);
-
-   char * source = malloc(source_size+1);
-   fread(source, 1, source_size, f);
-   source[source_size] = '\0';
-   fclose(f);
+/* Kernels are only built by the first factorization of the session (per
+ * configuration and precision) */
+cl_int factorKernels(session * s, tile_config c, int single, factor_kernels * k, char ** log) {
+   cl_int err;
 
-   cl_program prg = clCreateProgramWithSource(ctx, 1, (const char**)&source, NULL, NULL);
-   err = clBuildProgram(prg, 1, &dev, NULL, NULL, NULL);
+   char options[64];
+   tileOptions(c, options, sizeof(options));
+   if (single) {
+      strncat(options, " -D SINGLE", sizeof(options) - strlen(options) - 1);
+   }
 
+   err = sessionKernel(s, "dpotrf_panel.cl", "dpotrf_panel", options, &k->dpotrf_panel, log);
    if (err != CL_SUCCESS) {
-      size_t log_size;
-      clGetProgramBuildInfo(prg, dev, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-      *log = malloc(log_size);
-      clGetProgramBuildInfo(prg, dev, CL_PROGRAM_BUILD_LOG, log_size, *log, NULL);
       return err;
    }
-
-   
-   *kernel = clCreateKernel(prg, kernelName, &err);
+   err = sessionKernel(s, "dgemm.cl", "dgemm", options, &k->dgemm, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+   err = sessionKernel(s, "dgemm.cl", "dgemm_panel", options, &k->dgemm_panel, log);
    if (err != CL_SUCCESS) {
-      char buffer[4096];
-      sprintf(buffer, "Unable to create kernel with name \"%s\" from file %s", kernelName, kernelFile);
-      *log = strdup(buffer);
       return err;
    }
-
-   clReleaseProgram(prg);
 
    return CL_SUCCESS;
 }
 
-int performCholesky(double * matN, cl_ulong n, cl_device_id dev, int * errCount, cl_ulong * duration, char ** log) {
+/* Objects a run gets from the session, given back by releaseRun whether it
+ * succeeded or not */
+typedef struct {
+   int nb_host_buffers;
+   host_buffer * host_buffers[1];
+   int nb_buffers;
+   cl_mem buffers[3];
+   int nb_events;
+   cl_event events[3];
+   cl_long nb_col;
+   cl_event * col;               // last command writing each block column
+} run_objects;
+
+/* Give the objects of r back to the session once its commands are complete
+ * and return err */
+cl_int releaseRun(session * s, run_objects * r, cl_int err) {
+   int i;
+
+   clFinish(s->cq);
+
+   for (i=0; i<r->nb_col; i++) {
+      clReleaseEvent(r->col[i]);
+   }
+   for (i=0; i<r->nb_events; i++) {
+      clReleaseEvent(r->events[i]);
+   }
+   for (i=0; i<r->nb_buffers; i++) {
+      sessionRelease(s, r->buffers[i]);
+   }
+   for (i=0; i<r->nb_host_buffers; i++) {
+      releaseHostBuffer(s, r->host_buffers[i]);
+   }
 
-   cl_event ev_writeA, ev_readA;
-   int x, y;
-   cl_int err;
+   return err;
+}
 
-   size_t size = n * n * sizeof(double);
+/* Enqueue the factorization of the packed matrix bufA (of the precision of
+ * the kernels). col[j] is the last command writing block column j (nb
+ * events, updated), "done" a buffer of nb ints for dpotrf_panel. */
+cl_int enqueueFactorization(session * s, tile_config c, factor_kernels * k, cl_mem bufA, cl_mem done, cl_ulong n, cl_event * col, profile * prof, char ** log) {
 
-   double * matB = malloc(size);
-   memset(matB, 0, size);
+   cl_int err;
 
+   // Tile size and work-group height
+   const size_t ts = c.ts;
+   const size_t rts = c.ts / c.wpt;
 
-   cl_context ctx = clCreateContext(NULL, 1, &dev, NULL, NULL, &err);
-   if (err != CL_SUCCESS) {
-      *log = strdup("Unable to create context");
-      return err;
-   }
+   cl_command_queue cq = s->cq;
 
-   cl_command_queue cq = clCreateCommandQueue(ctx, dev, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | CL_QUEUE_PROFILING_ENABLE, &err);
-   if (err != CL_SUCCESS) {
-      *log = strdup("Unable to create command queue");
-      return err;
-   }
+   // Number of blocks per row/column, the last one may be partial
+   cl_long nb = (n+ts-1)/ts;
 
-   cl_kernel dpotrf, dtrsm, dgemm;
-   err = loadKernel("dpotrf.cl", "dpotrf", ctx, dev, log, &dpotrf);
-   if (err != CL_SUCCESS) {
-      return err;
-   }
-   err = loadKernel("dtrsm.cl", "dtrsm", ctx, dev, log, &dtrsm);
-   if (err != CL_SUCCESS) {
-      return err;
-   }
-   err = loadKernel("dgemm.cl", "dgemm", ctx, dev, log, &dgemm);
-   if (err != CL_SUCCESS) {
-      return err;
-   }
+   // dgemm skips the first block column, updated by dgemm_panel (look-ahead)
+   cl_ulong first = 1;
 
-   cl_mem bufA = clCreateBuffer(ctx, CL_MEM_READ_WRITE, size, NULL, &err);
+   // Work-groups of dpotrf_panel done with each step, zero before the first one
+   cl_event ev_done;
+   cl_int zero = 0;
+   err = clEnqueueFillBuffer(cq, done, &zero, sizeof(zero), 0, nb*sizeof(cl_int), 1, &col[0], &ev_done);
    if (err != CL_SUCCESS) {
-      *log = strdup("Unable to allocate buffer");
+      *log = strdup("Unable to enqueue fill buffer command");
       return err;
    }
-
-   err = clEnqueueWriteBuffer(cq, bufA, 0, 0, size, matN, 0, NULL, &ev_writeA);
-   if (err != CL_SUCCESS) {
-      *log = strdup("Unable to enqueue write buffer command");
-      return err;
-   }
-
-   err = clSetKernelArg(dpotrf, 0, sizeof(bufA), &bufA);
-   err |= clSetKernelArg(dpotrf, 1, sizeof(cl_ulong), &n);
-   err |= clSetKernelArg(dtrsm, 0, sizeof(bufA), &bufA);
-   err |= clSetKernelArg(dtrsm, 1, sizeof(cl_ulong), &n);
-   err |= clSetKernelArg(dgemm, 0, sizeof(bufA), &bufA);
-   err |= clSetKernelArg(dgemm, 1, sizeof(cl_ulong), &n);
+   clReleaseEvent(col[0]);
+   col[0] = ev_done;
+
+   err = clSetKernelArg(k->dpotrf_panel, 0, sizeof(bufA), &bufA);
+   err |= clSetKernelArg(k->dpotrf_panel, 1, sizeof(cl_ulong), &n);
+   err |= clSetKernelArg(k->dpotrf_panel, 3, sizeof(done), &done);
+   err |= clSetKernelArg(k->dgemm, 0, sizeof(bufA), &bufA);
+   err |= clSetKernelArg(k->dgemm, 1, sizeof(cl_ulong), &n);
+   err |= clSetKernelArg(k->dgemm, 3, sizeof(cl_ulong), &first);
+   err |= clSetKernelArg(k->dgemm_panel, 0, sizeof(bufA), &bufA);
+   err |= clSetKernelArg(k->dgemm_panel, 1, sizeof(cl_ulong), &n);
    if (err != CL_SUCCESS) {
       *log = strdup("Unable to set kernel parameter");
       return err;
    }
 
-   cl_event dep = ev_writeA;
-   clRetainEvent(ev_writeA);
-   clFinish(cq);
-
-   struct timespec start, end;
-   clock_gettime(CLOCK_MONOTONIC, &start);
-
-   cl_long i;
-   for (i=0; i<n/16; i++) {
+   // The trailing update of step i is split in two (look-ahead): block column
+   // i+1 is updated first, so that the next diagonal block and its panel can
+   // be processed while the rest of the trailing matrix (block columns i+2
+   // and after) is being updated.
+   cl_long i, j;
+   for (i=0; i<nb; i++) {
 
       cl_event ev;
 
-      err = clSetKernelArg(dpotrf, 2, sizeof(cl_ulong), &i);
-      err |= clSetKernelArg(dgemm, 2, sizeof(cl_ulong), &i);
-      err |= clSetKernelArg(dtrsm, 2, sizeof(cl_ulong), &i);
+      err = clSetKernelArg(k->dpotrf_panel, 2, sizeof(cl_ulong), &i);
+      err |= clSetKernelArg(k->dgemm, 2, sizeof(cl_ulong), &i);
+      err |= clSetKernelArg(k->dgemm_panel, 2, sizeof(cl_ulong), &i);
       if (err != CL_SUCCESS) {
          *log = strdup("Unable to set kernel parameter");
          return err;
       }
 
-      size_t dpotrf_global[] = {16,16,1};
-      size_t dpotrf_local[] = {16,16,1};
+      // Partial edge blocks are masked by the kernels
+      cl_long r = (cl_long)n - (i+1)*ts;
+      if (r > 0) r = (r+ts-1)/ts*ts;
 
-      err = clEnqueueNDRangeKernel(cq, dpotrf, 2, NULL, dpotrf_global, dpotrf_local, 1, &dep, &ev);
+      // Diagonal block and the blocks below it (a single work-group for the last one)
+      size_t dpotrf_panel_global[] = {ts,(r > 0 ? r : ts)/c.wpt,1};
+      size_t dpotrf_panel_local[] = {ts,rts,1};
+
+      err = clEnqueueNDRangeKernel(cq, k->dpotrf_panel, 2, NULL, dpotrf_panel_global, dpotrf_panel_local, 1, &col[i], &ev);
       if (err != CL_SUCCESS) {
          *log = strdup("Unable to enqueue kernel execution command");
          return err;
       }
-      clReleaseEvent(dep);
-      dep = ev;
-
-      size_t r = n - (i+1)*16;
+      profileRecord(prof, ev, "dpotrf_panel", (double)ts*ts*ts/3 + (double)ts*ts*r, 0);
+      clReleaseEvent(col[i]);
+      col[i] = ev;
 
       if (r > 0) {
 
-         size_t dtrsm_global[] = {16,r,1};
-         size_t dtrsm_local[] = {16,16,1};
-         err = clEnqueueNDRangeKernel(cq, dtrsm, 2, NULL, dtrsm_global, dtrsm_local, 1, &dep, &ev);
+         // Look-ahead: block column i+1
+         size_t dgemm_panel_global[] = {r,rts,1};
+         size_t dgemm_panel_local[] = {ts,rts,1};
+         cl_event panel_deps[] = {col[i], col[i+1]};
+         err = clEnqueueNDRangeKernel(cq, k->dgemm_panel, 2, NULL, dgemm_panel_global, dgemm_panel_local, 2, panel_deps, &ev);
          if (err != CL_SUCCESS) {
             *log = strdup("Unable to enqueue kernel execution command");
             return err;
          }
-         clReleaseEvent(dep);
-         dep = ev;
-
-         size_t dgemm_global[] = {r, r,1};
-         size_t dgemm_local[] = {16,16,1};
-         err = clEnqueueNDRangeKernel(cq, dgemm, 2, NULL, dgemm_global, dgemm_local, 1, &dep, &ev);
-         if (err != CL_SUCCESS) {
-            *log = strdup("Unable to enqueue kernel execution command");
-            return err;
+         profileRecord(prof, ev, "dgemm_panel", 2.0*ts*ts*r, 0);
+         clReleaseEvent(col[i+1]);
+         col[i+1] = ev;
+
+         // Rest of the trailing matrix (lower triangle of blocks only)
+         if (r > ts) {
+            size_t t = (r/ts-1)*(r/ts)/2;
+            size_t dgemm_global[] = {ts*t,rts,1};
+            size_t dgemm_local[] = {ts,rts,1};
+            cl_event deps[] = {col[i], col[i+2]};
+            err = clEnqueueNDRangeKernel(cq, k->dgemm, 2, NULL, dgemm_global, dgemm_local, 2, deps, &ev);
+            if (err != CL_SUCCESS) {
+               *log = strdup("Unable to enqueue kernel execution command");
+               return err;
+            }
+            profileRecord(prof, ev, "dgemm", 2.0*ts*ts*ts*t, 0);
+            for (j=i+2; j<nb; j++) {
+               clReleaseEvent(col[j]);
+               col[j] = ev;
+               clRetainEvent(ev);
+            }
+            clReleaseEvent(ev);
          }
-         clReleaseEvent(dep);
-         dep = ev;
       }
    }
 
+   return CL_SUCCESS;
+}
+
+int performCholesky(session * s, tile_config c, const host_buffer * matN, cl_ulong n, int * errCount, double * residual, profile * prof, cl_ulong * duration, char ** log) {
+
+   cl_event ev_writeA, ev_readA;
+   int x, y;
+   cl_int err;
+
+   const size_t ts = c.ts;
+
+   size_t size = packedSize(n, ts) * sizeof(double);
+
+   cl_command_queue cq = s->cq;
+
+   factor_kernels k;
+   err = factorKernels(s, c, 0, &k, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+
+   run_objects r;
+   memset(&r, 0, sizeof(r));
+
+   // The factor is computed in host memory usable by the device: in place on
+   // devices sharing host memory, through pinned memory on the others. A is
+   // written to it by the device, matN is kept for the next runs.
+   host_buffer hbA;
+   err = sessionHostBuffer(s, size, &hbA, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+   r.host_buffers[r.nb_host_buffers++] = &hbA;
+
+   cl_mem bufA;
+   err = sessionCopyToDevice(s, cq, matN, &hbA, 0, NULL, &bufA, &ev_writeA, log);
+   if (err != CL_SUCCESS) {
+      return releaseRun(s, &r, err);
+   }
+   r.buffers[r.nb_buffers++] = bufA;
+   r.events[r.nb_events++] = ev_writeA;
+   profileRecord(prof, ev_writeA, "write", 0, size);
+
+   // Keep a copy of A on the device to compute the residual
+   cl_mem bufA0 = NULL;
+   cl_event ev_copyA = NULL;
+   if (residual != NULL) {
+      err = sessionBuffer(s, size, &bufA0, log);
+      if (err != CL_SUCCESS) {
+         return releaseRun(s, &r, err);
+      }
+      r.buffers[r.nb_buffers++] = bufA0;
+      err = clEnqueueCopyBuffer(cq, bufA, bufA0, 0, 0, size, 1, &ev_writeA, &ev_copyA);
+      if (err != CL_SUCCESS) {
+         *log = strdup("Unable to enqueue copy buffer command");
+         return releaseRun(s, &r, err);
+      }
+      r.events[r.nb_events++] = ev_copyA;
+      profileRecord(prof, ev_copyA, "copy", 0, size);
+   }
+
+   // Number of blocks per row/column, the last one may be partial
+   cl_long nb = (n+ts-1)/ts;
+
+   cl_mem bufDone;
+   err = sessionBuffer(s, nb*sizeof(cl_int), &bufDone, log);
+   if (err != CL_SUCCESS) {
+      return releaseRun(s, &r, err);
+   }
+   r.buffers[r.nb_buffers++] = bufDone;
+
+   // Last command writing each block column
+   cl_event col[nb];
+   cl_long j;
+   for (j=0; j<nb; j++) {
+      col[j] = (ev_copyA != NULL ? ev_copyA : ev_writeA);
+      clRetainEvent(col[j]);
+   }
+   r.col = col;
+   r.nb_col = nb;
+   clFinish(cq);
+
+   struct timespec start, end;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   err = enqueueFactorization(s, c, &k, bufA, bufDone, n, col, prof, log);
+   if (err != CL_SUCCESS) {
+      return releaseRun(s, &r, err);
+   }
+
    clFinish(cq);
 
    clock_gettime(CLOCK_MONOTONIC, &end);
 
-   err = clEnqueueReadBuffer(cq, bufA, 0, 0, size, matB, 1, &dep, &ev_readA);
+   // Before the factor is handed back to the host (kernels must not use mapped buffers)
+   if (residual != NULL) {
+      err = computeResidual(s, cq, c, bufA, bufA0, n, nb, col, residual, log);
+      if (err != CL_SUCCESS) {
+         return releaseRun(s, &r, err);
+      }
+   }
+
+   err = sessionToHost(s, cq, &hbA, bufA, nb, col, &ev_readA, log);
    if (err != CL_SUCCESS) {
-      *log = strdup("Unable to enqueue read buffer command");
-      return err;
+      return releaseRun(s, &r, err);
    }
+   r.events[r.nb_events++] = ev_readA;
+   profileRecord(prof, ev_readA, s->host_mode == HOST_MAPPED ? "map" : "read", 0, size);
 
    clFinish(cq);
 
+   double * matB = hbA.ptr;
+
+   if (prof != NULL) {
+      err = profileCollect(prof, log);
+      if (err != CL_SUCCESS) {
+         return releaseRun(s, &r, err);
+      }
+   }
+
 
    clGetEventInfo(ev_writeA, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &err, NULL);
    if (err != CL_SUCCESS) {
       *log = strdup("Error with Write Buffer Command");
-      return err;
+      return releaseRun(s, &r, err);
    }
 
    clGetEventInfo(ev_readA, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &err, NULL);
    if (err != CL_SUCCESS) {
       *log = strdup("Error with Read Buffer Command");
-      return err;
+      return releaseRun(s, &r, err);
    }
 
-   *duration = end.tv_nsec - start.tv_nsec + (end.tv_sec-start.tv_sec) * 10e9;
-
-   clReleaseEvent(ev_readA);
-   clReleaseEvent(ev_writeA);
-   clReleaseMemObject(bufA);
-   clReleaseKernel(dpotrf);
-   clReleaseKernel(dtrsm);
-   clReleaseKernel(dgemm);
-   clReleaseCommandQueue(cq);
-   clReleaseContext(ctx);
+   *duration = end.tv_nsec - start.tv_nsec + (end.tv_sec-start.tv_sec) * 1e9;
 
 
 /*   for (y=0; y<n; y++) {
@@ -318,7 +629,7 @@ int performCholesky(double * matN, cl_ulong n, cl_device_id dev, int * errCount,
 
    for (y=0; y<n; y++) {
       for (x=0; x<=y; x++) {
-         printf("%.2f ", matB[y*n+x]);
+         printf("%.2f ", matB[packedIndex(y, x, ts)]);
       }
       printf("\n");
    }*/
@@ -327,11 +638,156 @@ int performCholesky(double * matN, cl_ulong n, cl_device_id dev, int * errCount,
    *errCount = 0;
    for (y=0; y<n; y++) {
       for (x=0; x<=y; x++) {
-         if (fabs(matB[y*n+x]-L(x,y)) > 10e-9) {
+         if (!(fabs(matB[packedIndex(y, x, ts)]-L(x,y)) <= 10e-9)) {      // NaN counts as an error
             *errCount += 1;
          }
       }
    }
 
-   return 0;
+   return releaseRun(s, &r, CL_SUCCESS);
+}
+
+/* Factor the packed matrix "a" (float if "single", double otherwise) on the
+ * device, the factor is written to "l" (same layout and precision, may be a) */
+cl_int factorOnDevice(session * s, tile_config c, int single, const host_buffer * a, host_buffer * l, cl_ulong n, profile * prof, char ** log) {
+
+   cl_event ev_write, ev_read;
+   cl_int err;
+
+   size_t size = packedSize(n, c.ts) * (single ? sizeof(float) : sizeof(double));
+
+   cl_command_queue cq = s->cq;
+
+   factor_kernels k;
+   err = factorKernels(s, c, single, &k, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+
+   // a and l belong to the caller
+   run_objects r;
+   memset(&r, 0, sizeof(r));
+
+   // Factored in place in l, a is written to it unless it is l
+   cl_mem buf;
+   if (a == l) err = sessionToDevice(s, cq, l, 0, NULL, &buf, &ev_write, log);
+   else err = sessionCopyToDevice(s, cq, a, l, 0, NULL, &buf, &ev_write, log);
+   if (err != CL_SUCCESS) {
+      return releaseRun(s, &r, err);
+   }
+   r.buffers[r.nb_buffers++] = buf;
+   r.events[r.nb_events++] = ev_write;
+   profileRecord(prof, ev_write, (a == l && s->host_mode == HOST_MAPPED) ? "unmap" : "write", 0, size);
+
+   cl_long nb = (n+c.ts-1)/c.ts;
+
+   cl_mem bufDone;
+   err = sessionBuffer(s, nb*sizeof(cl_int), &bufDone, log);
+   if (err != CL_SUCCESS) {
+      return releaseRun(s, &r, err);
+   }
+   r.buffers[r.nb_buffers++] = bufDone;
+
+   cl_event col[nb];
+   cl_long j;
+   for (j=0; j<nb; j++) {
+      col[j] = ev_write;
+      clRetainEvent(col[j]);
+   }
+   r.col = col;
+   r.nb_col = nb;
+
+   err = enqueueFactorization(s, c, &k, buf, bufDone, n, col, prof, log);
+   if (err != CL_SUCCESS) {
+      return releaseRun(s, &r, err);
+   }
+
+   err = sessionToHost(s, cq, l, buf, nb, col, &ev_read, log);
+   if (err != CL_SUCCESS) {
+      return releaseRun(s, &r, err);
+   }
+   r.events[r.nb_events++] = ev_read;
+   profileRecord(prof, ev_read, s->host_mode == HOST_MAPPED ? "map" : "read", 0, size);
+
+   return releaseRun(s, &r, CL_SUCCESS);
+}
+
+int performMixedSolve(session * s, tile_config c, const host_buffer * matN, cl_ulong n, const double * b, double * x, int fp64,
+                      int * precision, int * iterations, double * berr, profile * prof, cl_ulong * duration, char ** log) {
+
+   cl_int err;
+   size_t i;
+
+   size_t count = packedSize(n, c.ts);
+
+   // Kernels of both precisions are built before timing
+   factor_kernels k;
+   err = factorKernels(s, c, 1, &k, log);
+   if (err == CL_SUCCESS && fp64) {
+      err = factorKernels(s, c, 0, &k, log);
+   }
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+
+   // Single precision copy of A (same packed layout), replaced by its factor
+   host_buffer hbF;
+   err = sessionHostBuffer(s, count * sizeof(float), &hbF, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+   const double * matA = matN->ptr;
+   float * matF = hbF.ptr;
+   for (i=0; i<count; i++) {
+      matF[i] = (float)matA[i];
+   }
+
+   struct timespec start, end;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   err = factorOnDevice(s, c, 1, &hbF, &hbF, n, prof, log);
+   if (err != CL_SUCCESS) {
+      releaseHostBuffer(s, &hbF);
+      return err;
+   }
+
+   // A factor that is not positive definite in single precision is caught
+   // by refinement as well (NaN)
+   int converged = refineSolve(matA, hbF.ptr, 1, n, c.ts, b, x, REFINE_MAX_ITER, iterations, berr);
+   *precision = (converged ? 32 : 0);
+   releaseHostBuffer(s, &hbF);
+
+   // Too ill-conditioned for a single precision factor: double precision one
+   if (!converged && fp64) {
+      host_buffer hbL;
+      err = sessionHostBuffer(s, count * sizeof(double), &hbL, log);
+      if (err != CL_SUCCESS) {
+         return err;
+      }
+
+      err = factorOnDevice(s, c, 0, matN, &hbL, n, prof, log);
+      if (err != CL_SUCCESS) {
+         releaseHostBuffer(s, &hbL);
+         return err;
+      }
+
+      int it;
+      converged = refineSolve(matA, hbL.ptr, 0, n, c.ts, b, x, REFINE_MAX_ITER, &it, berr);
+      *precision = (converged ? 64 : 0);
+      *iterations += it;
+      releaseHostBuffer(s, &hbL);
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   if (prof != NULL) {
+      err = profileCollect(prof, log);
+      if (err != CL_SUCCESS) {
+         return err;
+      }
+   }
+
+   *duration = end.tv_nsec - start.tv_nsec + (end.tv_sec-start.tv_sec) * 1e9;
+
+   return CL_SUCCESS;
 }
@@ -0,0 +1,36 @@
+#ifndef PACKED_H
+#define PACKED_H
+
+#include <stddef.h>
+
+/* Packed lower-triangular tile storage
+ *
+ * A symmetric matrix of size n is stored as the lower triangle of its ts x ts
+ * tiles, one row of tiles after the other. Off-diagonal tiles are stored
+ * full (row-major, ts*ts elements) and diagonal tiles only store their lower
+ * triangle (row-major, ts*(ts+1)/2 elements). Partial tiles on the edges are
+ * padded to full size.
+ *
+ * Kernels addressing this layout have their own copy of these functions,
+ * with the tile size given at build time (-D TS=<ts>).
+ */
+
+// Offset of tile (Y, X) with X <= Y
+static inline size_t packedTileOffset(size_t Y, size_t X, size_t ts) {
+   return Y*(Y+1)/2*(ts*ts) - Y*(ts*ts - ts*(ts+1)/2) + X*(ts*ts);
+}
+
+// Offset of element (y, x) with x <= y
+static inline size_t packedIndex(size_t y, size_t x, size_t ts) {
+   size_t Y = y/ts, X = x/ts;
+   y %= ts;
+   x %= ts;
+   return packedTileOffset(Y, X, ts) + (X == Y ? y*(y+1)/2 + x : y*ts + x);
+}
+
+// Number of elements of a packed matrix of size n
+static inline size_t packedSize(size_t n, size_t ts) {
+   return packedTileOffset((n+ts-1)/ts, 0, ts);
+}
+
+#endif
@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <CL/cl.h>
+
+#include "profiling.h"
+
+profile * createProfile(void) {
+   return calloc(1, sizeof(profile));
+}
+
+void profileRecord(profile * p, cl_event ev, const char * name, double flops, double bytes) {
+   if (p == NULL) return;
+
+   if (p->nb_records == p->max_records) {
+      p->max_records = (p->max_records == 0 ? 256 : 2*p->max_records);
+      p->records = realloc(p->records, p->max_records * sizeof(profile_record));
+   }
+
+   profile_record * r = &p->records[p->nb_records++];
+   memset(r, 0, sizeof(profile_record));
+   r->event = ev;
+   r->name = name;
+   r->flops = flops;
+   r->bytes = bytes;
+   clRetainEvent(ev);
+}
+
+void profileAnnotate(profile * p, cl_uint nb_wait, const cl_event * wait, const char * format, ...) {
+   if (p == NULL || p->nb_records == 0) return;
+
+   profile_record * r = &p->records[p->nb_records-1];
+
+   va_list args;
+   va_start(args, format);
+   vsnprintf(r->label, sizeof(r->label), format, args);
+   va_end(args);
+
+   // Events are retained by the profile, so a handle identifies one record.
+   // Dependencies are usually recent: search backward.
+   free(r->deps);
+   r->deps = malloc(nb_wait * sizeof(int));
+   r->nb_deps = 0;
+
+   cl_uint w;
+   int i;
+   for (w=0; w<nb_wait; w++) {
+      for (i=p->nb_records-2; i>=0; i--) {
+         if (p->records[i].event == wait[w]) {
+            r->deps[r->nb_deps++] = i;
+            break;
+         }
+      }
+   }
+}
+
+cl_int profileCollect(profile * p, char ** log) {
+   int i;
+   for (i=0; i<p->nb_records; i++) {
+      profile_record * r = &p->records[i];
+      cl_int err = clGetEventProfilingInfo(r->event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &r->queued, NULL);
+      err |= clGetEventProfilingInfo(r->event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &r->submit, NULL);
+      err |= clGetEventProfilingInfo(r->event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &r->start, NULL);
+      err |= clGetEventProfilingInfo(r->event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &r->end, NULL);
+      err |= clGetEventInfo(r->event, CL_EVENT_COMMAND_QUEUE, sizeof(cl_command_queue), &r->queue, NULL);
+      if (err != CL_SUCCESS) {
+         *log = strdup("Unable to get event profiling info");
+         return err;
+      }
+
+      // No device for queues of platforms that schedule commands themselves
+      if (clGetCommandQueueInfo(r->queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &r->device, NULL) != CL_SUCCESS) {
+         r->device = NULL;
+      }
+   }
+   return CL_SUCCESS;
+}
+
+static int byStart(const void * a, const void * b) {
+   const profile_record * ra = *(const profile_record **)a;
+   const profile_record * rb = *(const profile_record **)b;
+   return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+void profileReport(profile * p, FILE * f, const char * indent) {
+   int i, k, g;
+
+   if (p->nb_records == 0) return;
+
+   profile_record ** sorted = malloc(p->nb_records * sizeof(profile_record *));
+   for (i=0; i<p->nb_records; i++) sorted[i] = &p->records[i];
+   qsort(sorted, p->nb_records, sizeof(profile_record *), byStart);
+
+   // Devices in order of first use: commands of other devices do not hide
+   // the idle time of a device
+   cl_device_id * devices = malloc(p->nb_records * sizeof(cl_device_id));
+   int * group = malloc(p->nb_records * sizeof(int));
+   int nb_groups = 0;
+   for (i=0; i<p->nb_records; i++) {
+      for (g=0; g<nb_groups && devices[g] != p->records[i].device; g++);
+      if (g == nb_groups) devices[nb_groups++] = p->records[i].device;
+      group[i] = g;
+   }
+
+   double * gap = malloc(p->nb_records * sizeof(double));
+   int * done = calloc(p->nb_records, sizeof(int));
+
+   for (g=0; g<nb_groups; g++) {
+
+      if (nb_groups > 1) {
+         char dev_name[256] = "any device";
+         if (devices[g] != NULL) clGetDeviceInfo(devices[g], CL_DEVICE_NAME, sizeof(dev_name), dev_name, NULL);
+         fprintf(f, "%sdevice %d (%s):\n", indent, g, dev_name);
+      }
+
+      // Device idle time before each command: time between the end of every
+      // command of the device started before it and its own start
+      cl_ulong first = 0, last = 0, busy = 0;
+      int started = 0;
+      for (i=0; i<p->nb_records; i++) {
+         profile_record * r = sorted[i];
+         if (group[r - p->records] != g) continue;
+         if (!started) {
+            first = last = r->start;
+            started = 1;
+         }
+         gap[r - p->records] = (r->start > last ? r->start - last : 0);
+         if (r->end > last) {
+            busy += r->end - (r->start > last ? r->start : last);
+            last = r->end;
+         }
+      }
+
+      fprintf(f, "%s%-12s %6s %10s %10s %10s %11s %9s %9s\n", indent,
+            "command", "count", "total(ms)", "avg(us)", "gaps(ms)", "submit(us)", "GFLOP/s", "GB/s");
+
+      // Aggregate per kind of command, in order of first appearance
+      for (i=0; i<p->nb_records; i++) {
+         if (done[i] || group[i] != g) continue;
+
+         const char * name = p->records[i].name;
+         int count = 0;
+         double time = 0.0, gaps = 0.0, submit = 0.0, flops = 0.0, bytes = 0.0;
+
+         for (k=i; k<p->nb_records; k++) {
+            profile_record * r = &p->records[k];
+            if (done[k] || group[k] != g || strcmp(r->name, name) != 0) continue;
+            done[k] = 1;
+            count += 1;
+            time += r->end - r->start;
+            gaps += gap[k];
+            submit += r->submit - r->queued;
+            flops += r->flops;
+            bytes += r->bytes;
+         }
+
+         fprintf(f, "%s%-12s %6d %10.3f %10.2f %10.3f %11.2f", indent,
+               name, count, time/1e6, time/count/1e3, gaps/1e6, submit/count/1e3);
+         if (flops > 0.0 && time > 0.0) fprintf(f, " %9.2f", flops/time);
+         else fprintf(f, " %9s", "-");
+         if (bytes > 0.0 && time > 0.0) fprintf(f, " %9.2f\n", bytes/time);
+         else fprintf(f, " %9s\n", "-");
+      }
+
+      fprintf(f, "%sdevice span %.3f ms, busy %.3f ms, idle %.3f ms\n", indent,
+            (last-first)/1e6, busy/1e6, (last-first-busy)/1e6);
+   }
+
+   free(sorted);
+   free(devices);
+   free(group);
+   free(gap);
+   free(done);
+}
+
+// JSON string contents: labels and device names are plain text, quotes and
+// control characters are dropped
+static void jsonString(FILE * f, const char * s) {
+   for (; *s != '\0'; s++) {
+      if (*s != '"' && *s != '\\' && (unsigned char)*s >= ' ') fputc(*s, f);
+   }
+}
+
+static void traceSeparator(FILE * f, int * nb_events) {
+   if (*nb_events > 0) fprintf(f, ",\n");
+   *nb_events += 1;
+}
+
+void profileTrace(profile * p, FILE * f, int pid, const char * title, int * nb_events) {
+   int i, k;
+
+   if (p->nb_records == 0) return;
+
+   profile_record ** sorted = malloc(p->nb_records * sizeof(profile_record *));
+   for (i=0; i<p->nb_records; i++) sorted[i] = &p->records[i];
+   qsort(sorted, p->nb_records, sizeof(profile_record *), byStart);
+
+   // Timestamps relative to the first command, in microseconds
+   cl_ulong first = sorted[0]->start;
+
+   // Track of each record: its queue (queues numbered in order of first use)
+   // and a lane of the queue, the first one that is free when it starts
+   int * lane = malloc(p->nb_records * sizeof(int));
+   cl_command_queue * queues = malloc(p->nb_records * sizeof(cl_command_queue));
+   int * nb_lanes = malloc(p->nb_records * sizeof(int));
+   cl_ulong (*lane_end)[PROFILE_LANES] = malloc(p->nb_records * sizeof(*lane_end));
+   int nb_queues = 0;
+
+   int q, l;
+   for (i=0; i<p->nb_records; i++) {
+      profile_record * r = sorted[i];
+      int idx = r - p->records;
+
+      for (q=0; q<nb_queues && queues[q] != r->queue; q++);
+      if (q == nb_queues) {
+         queues[q] = r->queue;
+         nb_lanes[q] = 0;
+         nb_queues += 1;
+      }
+
+      for (l=0; l<nb_lanes[q] && lane_end[q][l] > r->start; l++);
+      if (l == PROFILE_LANES) {
+         // More concurrent commands than lanes: the span nests in the last one
+         l = PROFILE_LANES-1;
+      }
+      else if (l == nb_lanes[q]) {
+         nb_lanes[q] += 1;
+         lane_end[q][l] = 0;
+      }
+      if (r->end > lane_end[q][l]) lane_end[q][l] = r->end;
+
+      lane[idx] = q*PROFILE_LANES + l;
+   }
+
+   traceSeparator(f, nb_events);
+   fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"", pid);
+   jsonString(f, title);
+   fprintf(f, "\"}}");
+
+   for (q=0; q<nb_queues; q++) {
+      // Track name: device of the queue (none when the platform schedules
+      // the commands itself)
+      char dev_name[256] = "any device";
+      cl_device_id dev = NULL;
+      clGetCommandQueueInfo(queues[q], CL_QUEUE_DEVICE, sizeof(cl_device_id), &dev, NULL);
+      if (dev != NULL) clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(dev_name), dev_name, NULL);
+
+      for (l=0; l<nb_lanes[q]; l++) {
+         traceSeparator(f, nb_events);
+         fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"", pid, q*PROFILE_LANES+l);
+         jsonString(f, dev_name);
+         fprintf(f, " (queue %d, lane %d)\"}}", q, l);
+      }
+   }
+
+   for (i=0; i<p->nb_records; i++) {
+      profile_record * r = &p->records[i];
+      traceSeparator(f, nb_events);
+      fprintf(f, "{\"name\":\"");
+      jsonString(f, r->label[0] != '\0' ? r->label : r->name);
+      fprintf(f, "\",\"cat\":\"");
+      jsonString(f, r->name);
+      fprintf(f, "\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+            "\"args\":{\"queued\":%.3f,\"submit\":%.3f}}",
+            pid, lane[i], (r->start-first)/1e3, (r->end-r->start)/1e3,
+            ((cl_long)r->queued-(cl_long)first)/1e3, ((cl_long)r->submit-(cl_long)first)/1e3);
+   }
+
+   // Flow arrows from the end of each awaited command to the start of the
+   // command waiting for it. Flow ids are global to the file: the event
+   // count is used as id.
+   for (i=0; i<p->nb_records; i++) {
+      profile_record * r = &p->records[i];
+      for (k=0; k<r->nb_deps; k++) {
+         profile_record * d = &p->records[r->deps[k]];
+         cl_ulong from = (d->end > d->start ? d->end-1 : d->end);
+         int id = *nb_events;
+         traceSeparator(f, nb_events);
+         fprintf(f, "{\"name\":\"dependency\",\"cat\":\"dependency\",\"ph\":\"s\",\"id\":%d,"
+               "\"pid\":%d,\"tid\":%d,\"ts\":%.3f}", id, pid, lane[r->deps[k]], (from-first)/1e3);
+         traceSeparator(f, nb_events);
+         fprintf(f, "{\"name\":\"dependency\",\"cat\":\"dependency\",\"ph\":\"f\",\"bp\":\"e\",\"id\":%d,"
+               "\"pid\":%d,\"tid\":%d,\"ts\":%.3f}", id, pid, lane[i], (r->start-first)/1e3);
+      }
+   }
+
+   free(sorted);
+   free(lane);
+   free(queues);
+   free(nb_lanes);
+   free(lane_end);
+}
+
+void releaseProfile(profile * p) {
+   int i;
+   for (i=0; i<p->nb_records; i++) {
+      clReleaseEvent(p->records[i].event);
+      free(p->records[i].deps);
+   }
+   free(p->records);
+   free(p);
+}
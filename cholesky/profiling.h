@@ -0,0 +1,66 @@
+#ifndef PROFILING_H
+#define PROFILING_H
+
+#include <stdio.h>
+#include <CL/cl.h>
+
+// Max tracks per command queue in traces
+#define PROFILE_LANES 8
+
+/* Collect the profiling information of enqueued commands (the command queue
+ * must have been created with CL_QUEUE_PROFILING_ENABLE) and report the time
+ * spent per kind of command. */
+
+typedef struct {
+   cl_event event;
+   const char * name;      // kind of command (kernel name, "write", ...)
+   double flops;           // floating point operations performed
+   double bytes;           // bytes transferred
+   cl_ulong queued, submit, start, end;
+   cl_command_queue queue;
+   cl_device_id device;    // device of the queue (NULL if not bound to one)
+
+   // Optional annotations for traces (see profileAnnotate)
+   char label[48];
+   int nb_deps;
+   int * deps;             // indices of the records of the awaited commands
+} profile_record;
+
+typedef struct {
+   int nb_records;
+   int max_records;
+   profile_record * records;
+} profile;
+
+profile * createProfile(void);
+
+/* Record command "ev" (retained until the profile is released). "name" must
+ * be a string that outlives the profile. */
+void profileRecord(profile * p, cl_event ev, const char * name, double flops, double bytes);
+
+/* Annotate the last recorded command with a label (printf format) and the
+ * events it waited for. Events that were not recorded are ignored. */
+void profileAnnotate(profile * p, cl_uint nb_wait, const cl_event * wait, const char * format, ...);
+
+/* Read the timestamps of every recorded command. Commands must be complete. */
+cl_int profileCollect(profile * p, char ** log);
+
+/* Print, per device (commands of all its queues, in order of first use) and
+ * per kind of command: number of commands, total and average time, device
+ * idle time before its commands (launch gaps), submission latency and
+ * achieved GFLOP/s or GB/s, then the span, busy and idle time of the
+ * device. */
+void profileReport(profile * p, FILE * f, const char * indent);
+
+/* Append the collected commands to a Chrome trace-event file (JSON array
+ * format, viewable with chrome://tracing or Perfetto) as process "pid" named
+ * "title". Each command queue gets its own tracks, commands that overlap on
+ * a queue are spread over several lanes, and dependencies given to
+ * profileAnnotate are drawn as flow arrows. "nb_events" counts the events
+ * already written to the file (start at 0) and is updated. The caller
+ * writes the enclosing "[" and "]". */
+void profileTrace(profile * p, FILE * f, int pid, const char * title, int * nb_events);
+
+void releaseProfile(profile * p);
+
+#endif
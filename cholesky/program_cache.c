@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <CL/cl.h>
+
+#include "program_cache.h"
+
+#define CACHE_MAGIC "CLPCACHE"
+
+/* FNV-1a 64-bit hash */
+static cl_ulong hash(cl_ulong h, const void * data, size_t size) {
+   const unsigned char * p = data;
+   size_t i;
+   for (i=0; i<size; i++) {
+      h ^= p[i];
+      h *= 0x100000001b3ULL;
+   }
+   return h;
+}
+
+static cl_ulong hashString(cl_ulong h, const char * s) {
+   // Include the terminating null byte to separate fields
+   return hash(h, s, strlen(s)+1);
+}
+
+static cl_ulong hashDeviceInfo(cl_ulong h, cl_device_id dev, cl_device_info param) {
+   size_t size;
+   if (clGetDeviceInfo(dev, param, 0, NULL, &size) != CL_SUCCESS) return hashString(h, "");
+   char value[size];
+   clGetDeviceInfo(dev, param, size, value, NULL);
+   return hash(h, value, size);
+}
+
+static cl_ulong hashPlatformInfo(cl_ulong h, cl_platform_id platf, cl_platform_info param) {
+   size_t size;
+   if (clGetPlatformInfo(platf, param, 0, NULL, &size) != CL_SUCCESS) return hashString(h, "");
+   char value[size];
+   clGetPlatformInfo(platf, param, size, value, NULL);
+   return hash(h, value, size);
+}
+
+static cl_ulong hashDevice(cl_ulong h, cl_device_id dev) {
+   h = hashDeviceInfo(h, dev, CL_DEVICE_NAME);
+   h = hashDeviceInfo(h, dev, CL_DEVICE_VENDOR);
+   h = hashDeviceInfo(h, dev, CL_DRIVER_VERSION);
+   h = hashDeviceInfo(h, dev, CL_DEVICE_VERSION);
+
+   cl_platform_id platf;
+   if (clGetDeviceInfo(dev, CL_DEVICE_PLATFORM, sizeof(platf), &platf, NULL) == CL_SUCCESS) {
+      h = hashPlatformInfo(h, platf, CL_PLATFORM_NAME);
+      h = hashPlatformInfo(h, platf, CL_PLATFORM_VERSION);
+   }
+
+   return h;
+}
+
+static cl_ulong cacheKey(cl_device_id dev, const char * source, const char * options) {
+   cl_ulong h = 0xcbf29ce484222325ULL;
+
+   h = hashString(h, source);
+   h = hashString(h, options != NULL ? options : "");
+
+   return hashDevice(h, dev);
+}
+
+cl_ulong deviceKey(cl_device_id dev) {
+   return hashDevice(0xcbf29ce484222325ULL, dev);
+}
+
+char * cacheDir(void) {
+   char path[4096];
+
+   char * dir = getenv("CHOLESKY_CACHE_DIR");
+   if (dir != NULL) {
+      if (dir[0] == '\0') return NULL;
+      snprintf(path, sizeof(path), "%s", dir);
+   }
+   else if (getenv("XDG_CACHE_HOME") != NULL) {
+      snprintf(path, sizeof(path), "%s/cholesky", getenv("XDG_CACHE_HOME"));
+   }
+   else if (getenv("HOME") != NULL) {
+      snprintf(path, sizeof(path), "%s/.cache", getenv("HOME"));
+      mkdir(path, 0755);
+      snprintf(path, sizeof(path), "%s/.cache/cholesky", getenv("HOME"));
+   }
+   else return NULL;
+
+   mkdir(path, 0755);
+
+   struct stat st;
+   if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) return NULL;
+
+   return strdup(path);
+}
+
+static void cacheFile(char * path, size_t size, const char * dir, cl_ulong key) {
+   snprintf(path, size, "%s/%016llx.bin", dir, (unsigned long long)key);
+}
+
+/* Load a binary from the cache. Returns NULL if it is missing or invalid. */
+static unsigned char * loadBinary(const char * dir, cl_ulong key, size_t * size) {
+   char path[4096];
+   cacheFile(path, sizeof(path), dir, key);
+
+   FILE * f = fopen(path, "rb");
+   if (f == NULL) return NULL;
+
+   char magic[8];
+   cl_ulong fkey;
+   cl_ulong fsize;
+   if (fread(magic, 1, 8, f) != 8 || memcmp(magic, CACHE_MAGIC, 8) != 0
+         || fread(&fkey, sizeof(fkey), 1, f) != 1 || fkey != key
+         || fread(&fsize, sizeof(fsize), 1, f) != 1) {
+      fclose(f);
+      return NULL;
+   }
+
+   unsigned char * binary = malloc(fsize);
+   if (binary == NULL || fread(binary, 1, fsize, f) != fsize) {
+      free(binary);
+      fclose(f);
+      return NULL;
+   }
+   fclose(f);
+
+   *size = fsize;
+   return binary;
+}
+
+/* Store a binary in the cache (written to a temporary file first so that
+ * concurrent runs never see a partial file) */
+static void storeBinary(const char * dir, cl_ulong key, const unsigned char * binary, size_t size) {
+   char path[4096], tmp[4096+32];
+   cacheFile(path, sizeof(path), dir, key);
+   snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+
+   FILE * f = fopen(tmp, "wb");
+   if (f == NULL) return;
+
+   cl_ulong fsize = size;
+   int ok = (fwrite(CACHE_MAGIC, 1, 8, f) == 8
+         && fwrite(&key, sizeof(key), 1, f) == 1
+         && fwrite(&fsize, sizeof(fsize), 1, f) == 1
+         && fwrite(binary, 1, size, f) == size);
+
+   if (fclose(f) != 0 || !ok || rename(tmp, path) != 0) {
+      unlink(tmp);
+   }
+}
+
+/* Try to create and build the program from cached binaries (all devices must hit) */
+static cl_program fromCache(cl_context ctx, cl_uint nb_dev, const cl_device_id * devs, const char * options, const char * dir, cl_ulong * keys) {
+   size_t sizes[nb_dev];
+   unsigned char * binaries[nb_dev];
+   cl_uint d;
+   int hit = 1;
+
+   for (d=0; d<nb_dev; d++) {
+      binaries[d] = (hit ? loadBinary(dir, keys[d], &sizes[d]) : NULL);
+      if (binaries[d] == NULL) hit = 0;
+   }
+
+   cl_program prg = NULL;
+
+   if (hit) {
+      cl_int err;
+      cl_int status[nb_dev];
+      prg = clCreateProgramWithBinary(ctx, nb_dev, devs, sizes, (const unsigned char **)binaries, status, &err);
+      if (err == CL_SUCCESS) {
+         err = clBuildProgram(prg, nb_dev, devs, options, NULL, NULL);
+         if (err != CL_SUCCESS) {
+            clReleaseProgram(prg);
+            prg = NULL;
+         }
+      }
+      else prg = NULL;
+   }
+
+   for (d=0; d<nb_dev; d++) {
+      free(binaries[d]);
+   }
+
+   return prg;
+}
+
+/* Store the binaries of a program built from source */
+static void toCache(cl_program prg, cl_uint nb_dev, const cl_device_id * devs, const char * dir, cl_ulong * keys) {
+   cl_uint nb_prg_dev;
+   if (clGetProgramInfo(prg, CL_PROGRAM_NUM_DEVICES, sizeof(nb_prg_dev), &nb_prg_dev, NULL) != CL_SUCCESS) return;
+
+   cl_device_id prg_devs[nb_prg_dev];
+   size_t sizes[nb_prg_dev];
+   unsigned char * binaries[nb_prg_dev];
+
+   if (clGetProgramInfo(prg, CL_PROGRAM_DEVICES, sizeof(prg_devs), prg_devs, NULL) != CL_SUCCESS) return;
+   if (clGetProgramInfo(prg, CL_PROGRAM_BINARY_SIZES, sizeof(sizes), sizes, NULL) != CL_SUCCESS) return;
+
+   cl_uint i, d;
+   for (i=0; i<nb_prg_dev; i++) {
+      binaries[i] = (sizes[i] > 0 ? malloc(sizes[i]) : NULL);
+   }
+
+   if (clGetProgramInfo(prg, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL) == CL_SUCCESS) {
+      // Binaries are returned in the order of the program's devices
+      for (i=0; i<nb_prg_dev; i++) {
+         for (d=0; d<nb_dev; d++) {
+            if (prg_devs[i] == devs[d] && binaries[i] != NULL) {
+               storeBinary(dir, keys[d], binaries[i], sizes[i]);
+            }
+         }
+      }
+   }
+
+   for (i=0; i<nb_prg_dev; i++) {
+      free(binaries[i]);
+   }
+}
+
+cl_int buildProgram(cl_context ctx, cl_uint nb_dev, const cl_device_id * devs, const char * source, const char * options, cl_program * prg, char ** log) {
+   cl_int err;
+   cl_uint d;
+
+   char * dir = cacheDir();
+   cl_ulong keys[nb_dev];
+
+   if (dir != NULL) {
+      for (d=0; d<nb_dev; d++) {
+         keys[d] = cacheKey(devs[d], source, options);
+      }
+
+      *prg = fromCache(ctx, nb_dev, devs, options, dir, keys);
+      if (*prg != NULL) {
+         free(dir);
+         return CL_SUCCESS;
+      }
+   }
+
+   *prg = clCreateProgramWithSource(ctx, 1, &source, NULL, &err);
+   if (err != CL_SUCCESS) {
+      free(dir);
+      *log = strdup("Unable to create program");
+      return err;
+   }
+
+   err = clBuildProgram(*prg, nb_dev, devs, options, NULL, NULL);
+
+   if (err != CL_SUCCESS) {
+      // Report the log of the first device that failed
+      for (d=0; d<nb_dev; d++) {
+         cl_build_status status;
+         clGetProgramBuildInfo(*prg, devs[d], CL_PROGRAM_BUILD_STATUS, sizeof(status), &status, NULL);
+         if (status != CL_BUILD_SUCCESS || d == nb_dev-1) {
+            size_t log_size;
+            clGetProgramBuildInfo(*prg, devs[d], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+            *log = malloc(log_size);
+            clGetProgramBuildInfo(*prg, devs[d], CL_PROGRAM_BUILD_LOG, log_size, *log, NULL);
+            break;
+         }
+      }
+      free(dir);
+      return err;
+   }
+
+   if (dir != NULL) {
+      toCache(*prg, nb_dev, devs, dir, keys);
+      free(dir);
+   }
+
+   return CL_SUCCESS;
+}
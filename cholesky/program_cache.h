@@ -0,0 +1,28 @@
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+#include <CL/cl.h>
+
+/* Build a program from source for the given devices.
+ *
+ * Compiled binaries are stored on disk and reused by later runs. They are
+ * keyed by a hash of the source, the build options and the identity of the
+ * device (name, vendor, driver and OpenCL versions, platform), so any change
+ * to one of them triggers a rebuild.
+ *
+ * The cache directory is $CHOLESKY_CACHE_DIR, or $XDG_CACHE_HOME/cholesky
+ * or $HOME/.cache/cholesky by default. Set CHOLESKY_CACHE_DIR to an empty
+ * string to disable the cache.
+ *
+ * On build failure, *log is set to the build log of the failing device.
+ */
+cl_int buildProgram(cl_context ctx, cl_uint nb_dev, const cl_device_id * devs, const char * source, const char * options, cl_program * prg, char ** log);
+
+/* Return the cache directory (created if needed, to be freed) or NULL if the
+ * cache is disabled. Other per-device data can be stored there. */
+char * cacheDir(void);
+
+/* Hash of the identity of a device, as used for the keys of the cache */
+cl_ulong deviceKey(cl_device_id dev);
+
+#endif
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "packed.h"
+#include "refine.h"
+
+static inline double factorElement(const void * l, int single, size_t y, size_t x, size_t ts) {
+   size_t i = packedIndex(y, x, ts);
+   return (single ? ((const float *)l)[i] : ((const double *)l)[i]);
+}
+
+void packedSymv(const double * a, size_t n, size_t ts, const double * x, double * y) {
+   size_t i, j;
+
+   memset(y, 0, n * sizeof(double));
+
+   for (i=0; i<n; i++) {
+      for (j=0; j<=i; j++) {
+         double v = a[packedIndex(i, j, ts)];
+         y[i] += v * x[j];
+         if (j != i) y[j] += v * x[i];
+      }
+   }
+}
+
+/* r = b - A x, accumulated in extended precision: rounding errors of the
+ * products would otherwise be of the order of the tolerance of refineSolve
+ * (sqrt(n) * eps) and keep x from converging */
+static void residual(const double * a, size_t n, size_t ts, const double * b, const double * x, double * r) {
+   long double * acc = malloc(n * sizeof(long double));
+   size_t i, j;
+
+   for (i=0; i<n; i++) {
+      acc[i] = b[i];
+   }
+
+   for (i=0; i<n; i++) {
+      for (j=0; j<=i; j++) {
+         long double v = a[packedIndex(i, j, ts)];
+         acc[i] -= v * x[j];
+         if (j != i) acc[j] -= v * x[i];
+      }
+   }
+
+   for (i=0; i<n; i++) {
+      r[i] = acc[i];
+   }
+   free(acc);
+}
+
+/* z = (L*Lt)^-1 z */
+static void choleskySolve(const void * l, int single, size_t n, size_t ts, double * z) {
+   size_t i, j;
+
+   // L w = z
+   for (i=0; i<n; i++) {
+      double v = z[i];
+      for (j=0; j<i; j++) {
+         v -= factorElement(l, single, i, j, ts) * z[j];
+      }
+      z[i] = v / factorElement(l, single, i, i, ts);
+   }
+
+   // Lt z = w, one row of L (column of Lt) after the other
+   for (i=n; i-- > 0;) {
+      z[i] /= factorElement(l, single, i, i, ts);
+      for (j=0; j<i; j++) {
+         z[j] -= factorElement(l, single, i, j, ts) * z[i];
+      }
+   }
+}
+
+static double normInf(const double * v, size_t n) {
+   double m = 0.0;
+   size_t i;
+   for (i=0; i<n; i++) {
+      if (!(fabs(v[i]) <= m)) m = fabs(v[i]);      // NaN propagates
+   }
+   return m;
+}
+
+/* ||A|| (infinity norm) of a symmetric matrix, lower triangle stored */
+static double packedNormInf(const double * a, size_t n, size_t ts) {
+   double * sums = calloc(n, sizeof(double));
+   size_t i, j;
+
+   for (i=0; i<n; i++) {
+      for (j=0; j<=i; j++) {
+         double v = fabs(a[packedIndex(i, j, ts)]);
+         sums[i] += v;
+         if (j != i) sums[j] += v;
+      }
+   }
+
+   double m = normInf(sums, n);
+   free(sums);
+   return m;
+}
+
+int refineSolve(const double * a, const void * l, int single, size_t n, size_t ts,
+                const double * b, double * x, int max_iter, int * iterations, double * berr) {
+
+   double * r = malloc(n * sizeof(double));
+   size_t i;
+
+   // Unit roundoff of double precision (as LAPACK dlamch('E'))
+   double tol = sqrt((double)n) * (DBL_EPSILON / 2);
+   double anorm = packedNormInf(a, n, ts);
+
+   memcpy(x, b, n * sizeof(double));
+   choleskySolve(l, single, n, ts, x);
+
+   int it = 0, converged = 0;
+   double previous = INFINITY;
+
+   for (;;) {
+      residual(a, n, ts, b, x, r);
+
+      double rnorm = normInf(r, n), xnorm = normInf(x, n);
+      *berr = (rnorm == 0.0 ? 0.0 : rnorm / (anorm * xnorm));
+
+      if (rnorm <= tol * anorm * xnorm) {
+         converged = 1;
+         break;
+      }
+
+      // Diverging (NaN included): the factor is not accurate enough
+      if (it == max_iter || !(rnorm <= previous)) break;
+      previous = rnorm;
+
+      choleskySolve(l, single, n, ts, r);
+      for (i=0; i<n; i++) {
+         x[i] += r[i];
+      }
+      it += 1;
+   }
+
+   *iterations = it;
+   free(r);
+   return converged;
+}
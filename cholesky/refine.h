@@ -0,0 +1,31 @@
+#ifndef REFINE_H
+#define REFINE_H
+
+#include <stddef.h>
+
+/* Solves with a Cholesky factor and iterative refinement (host side)
+ *
+ * Matrices use the packed layout of packed.h with tile size ts. A is in
+ * double precision, its factor L in double or single precision. Solutions
+ * are refined with residuals b - A x computed in double precision, so that a
+ * single precision factor gives a double precision solution as long as A is
+ * not too ill-conditioned (about 1/eps of single precision).
+ */
+
+// Maximum refinement iterations (as LAPACK dsposv)
+#define REFINE_MAX_ITER 30
+
+/* y = A x, A symmetric (lower triangle stored) */
+void packedSymv(const double * a, size_t n, size_t ts, const double * x, double * y);
+
+/* Solve A x = b with L Lt = A (L is float if "single", double otherwise),
+ * refining x until the normwise backward error ||b - A x|| / (||A|| ||x||)
+ * (infinity norms) is below sqrt(n) * eps of double precision.
+ *
+ * Stops after max_iter refinement iterations, or earlier when the residual
+ * grows or is NaN. Returns 1 if x converged, 0 otherwise. "iterations"
+ * and "berr" receive the iterations done and the final backward error. */
+int refineSolve(const double * a, const void * l, int single, size_t n, size_t ts,
+                const double * b, double * x, int max_iter, int * iterations, double * berr);
+
+#endif
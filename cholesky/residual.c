@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include "session.h"
+#include "tuning.h"
+#include "residual.h"
+
+/* dresidual_norm built for the largest power of 2 work-group size, up to
+ * 256, that every device of the session runs it with */
+static cl_int normKernel(session * s, const char * tile_options, cl_kernel * kernel, size_t * wg, char ** log) {
+   cl_uint d;
+   size_t max = 256;
+
+   for (d=0; d<s->nb_dev; d++) {
+      size_t dev_max = 0;
+      clGetDeviceInfo(s->devs[d], CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(dev_max), &dev_max, NULL);
+      if (dev_max > 0 && dev_max < max) max = dev_max;
+   }
+
+   // The limit of the kernel itself may be lower (registers, local memory)
+   for (;;) {
+      for (*wg=256; *wg>max; *wg/=2);
+
+      char options[96];
+      snprintf(options, sizeof(options), "%s -D NORM_WG=%d", tile_options, (int)*wg);
+      cl_int err = sessionKernel(s, "dgemm.cl", "dresidual_norm", options, kernel, log);
+      if (err != CL_SUCCESS) {
+         return err;
+      }
+
+      size_t kernel_max = *wg;
+      for (d=0; d<s->nb_dev; d++) {
+         size_t k_max = 0;
+         clGetKernelWorkGroupInfo(*kernel, s->devs[d], CL_KERNEL_WORK_GROUP_SIZE, sizeof(k_max), &k_max, NULL);
+         if (k_max > 0 && k_max < kernel_max) kernel_max = k_max;
+      }
+      if (kernel_max == *wg) {
+         return CL_SUCCESS;
+      }
+      max = kernel_max;
+   }
+}
+
+/* Enqueue both kernels and read the result (blocking) */
+static cl_int enqueueResidual(cl_command_queue cq, tile_config c, cl_kernel dresidual, cl_kernel dresidual_norm, size_t norm_wg,
+                              cl_mem bufL, cl_mem bufA, cl_ulong n, cl_ulong t, cl_mem bufPartial, cl_mem bufResult,
+                              cl_uint nb_wait, const cl_event * wait, cl_event * ev, double * residual, char ** log) {
+   cl_int err;
+
+   err = clSetKernelArg(dresidual, 0, sizeof(cl_mem), &bufL);
+   err |= clSetKernelArg(dresidual, 1, sizeof(cl_mem), &bufA);
+   err |= clSetKernelArg(dresidual, 2, sizeof(cl_ulong), &n);
+   err |= clSetKernelArg(dresidual, 3, sizeof(cl_mem), &bufPartial);
+   err |= clSetKernelArg(dresidual_norm, 0, sizeof(cl_mem), &bufPartial);
+   err |= clSetKernelArg(dresidual_norm, 1, sizeof(cl_ulong), &t);
+   err |= clSetKernelArg(dresidual_norm, 2, sizeof(cl_mem), &bufResult);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to set kernel parameter");
+      return err;
+   }
+
+   size_t rts = c.ts/c.wpt;
+   size_t dresidual_global[] = {c.ts*t,rts,1};
+   size_t dresidual_local[] = {c.ts,rts,1};
+   err = clEnqueueNDRangeKernel(cq, dresidual, 2, NULL, dresidual_global, dresidual_local, nb_wait, wait, &ev[0]);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to enqueue kernel execution command");
+      return err;
+   }
+
+   size_t dresidual_norm_global[] = {norm_wg,1,1};
+   size_t dresidual_norm_local[] = {norm_wg,1,1};
+   err = clEnqueueNDRangeKernel(cq, dresidual_norm, 1, NULL, dresidual_norm_global, dresidual_norm_local, 1, &ev[0], &ev[1]);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to enqueue kernel execution command");
+      return err;
+   }
+
+   err = clEnqueueReadBuffer(cq, bufResult, 1, 0, sizeof(double), residual, 1, &ev[1], NULL);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to read residual");
+      return err;
+   }
+
+   return CL_SUCCESS;
+}
+
+cl_int computeResidual(session * s, cl_command_queue cq, tile_config c, cl_mem bufL, cl_mem bufA, cl_ulong n,
+                       cl_uint nb_wait, const cl_event * wait, double * residual, char ** log) {
+
+   cl_int err;
+
+   char options[64];
+   tileOptions(c, options, sizeof(options));
+
+   cl_kernel dresidual, dresidual_norm;
+   size_t norm_wg;
+   err = sessionKernel(s, "dgemm.cl", "dresidual", options, &dresidual, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+   err = normKernel(s, options, &dresidual_norm, &norm_wg, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+
+   // One work-group per tile of the lower triangle of tiles
+   cl_ulong nb = (n+c.ts-1)/c.ts;
+   cl_ulong t = nb*(nb+1)/2;
+
+   cl_mem bufPartial = NULL, bufResult = NULL;
+   cl_event ev[2] = {NULL, NULL};
+
+   err = sessionBuffer(s, 2*t*sizeof(double), &bufPartial, log);
+   if (err == CL_SUCCESS) {
+      err = sessionBuffer(s, sizeof(double), &bufResult, log);
+   }
+   if (err == CL_SUCCESS) {
+      err = enqueueResidual(cq, c, dresidual, dresidual_norm, norm_wg, bufL, bufA, n, t, bufPartial, bufResult, nb_wait, wait, ev, residual, log);
+   }
+   if (err != CL_SUCCESS) {
+      // The buffers are only given back once the commands are complete
+      clFinish(cq);
+   }
+
+   if (ev[0] != NULL) clReleaseEvent(ev[0]);
+   if (ev[1] != NULL) clReleaseEvent(ev[1]);
+   if (bufPartial != NULL) sessionRelease(s, bufPartial);
+   if (bufResult != NULL) sessionRelease(s, bufResult);
+
+   return err;
+}
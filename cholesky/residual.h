@@ -0,0 +1,26 @@
+#ifndef RESIDUAL_H
+#define RESIDUAL_H
+
+#include <CL/cl.h>
+
+#include "session.h"
+#include "tuning.h"
+
+/* Residual-based validation of a factorization (device side)
+ *
+ * The normwise backward error ||A - L*Lt|| / ||A|| (Frobenius norms) is
+ * computed by the kernels of dgemm.cl, built with the tile configuration of
+ * the factorization: L*Lt is accumulated tile by tile with the tile product
+ * of the trailing updates. The sums of the tiles are then reduced by a
+ * single work-group, as large as the devices allow (up to 256). Only the
+ * result is read back, so validating a factor does not need the reference
+ * factor of the input.
+ */
+
+/* Backward error of factor bufL of bufA, both with the packed layout of
+ * packed.h (tile size c.ts), computed on cq after the commands of the wait
+ * list */
+cl_int computeResidual(session * s, cl_command_queue cq, tile_config c, cl_mem bufL, cl_mem bufA, cl_ulong n,
+                       cl_uint nb_wait, const cl_event * wait, double * residual, char ** log);
+
+#endif
@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <CL/cl.h>
+
+#include "runtime.h"
+
+cl_int createRuntime(session * s, int nb_data, profile * prof, runtime ** rt, char ** log) {
+   if (s->nb_dev > 64) {
+      *log = strdup("Too many devices for the runtime");
+      return CL_INVALID_VALUE;
+   }
+
+   runtime * r = calloc(1, sizeof(runtime));
+   r->s = s;
+   r->prof = prof;
+
+   r->ready = calloc(s->nb_dev, sizeof(int *));
+   r->nb_ready = calloc(s->nb_dev, sizeof(int));
+   r->in_flight = calloc(s->nb_dev, sizeof(int));
+
+   r->nb_data = nb_data;
+   r->bufs = calloc(nb_data, sizeof(cl_mem));
+   r->valid = calloc(nb_data, sizeof(cl_ulong));
+   r->location = calloc(nb_data, sizeof(int));
+   r->last_writer = malloc(nb_data * sizeof(int));
+   r->nb_readers = calloc(nb_data, sizeof(int));
+   r->readers = calloc(nb_data, sizeof(int *));
+
+   int i;
+   for (i=0; i<nb_data; i++) {
+      r->last_writer[i] = -1;
+   }
+
+   pthread_mutex_init(&r->lock, NULL);
+   pthread_cond_init(&r->cond, NULL);
+
+   *rt = r;
+   return CL_SUCCESS;
+}
+
+void runtimeData(runtime * rt, int id, cl_mem buf, int location) {
+   rt->bufs[id] = buf;
+   rt->location[id] = location;
+   rt->valid[id] = 1ULL << location;
+}
+
+int runtimeLocation(runtime * rt, int id) {
+   return rt->location[id];
+}
+
+/* Add edge pred -> t (once) */
+static void addDependency(runtime * rt, int pred, int t) {
+   rt_task * task = &rt->tasks[t];
+   int i;
+
+   if (pred < 0) return;
+   for (i=0; i<task->nb_pred; i++) {
+      if (task->pred[i] == pred) return;
+   }
+
+   task->pred = realloc(task->pred, (task->nb_pred+1) * sizeof(int));
+   task->pred[task->nb_pred++] = pred;
+
+   rt_task * p = &rt->tasks[pred];
+   p->succ = realloc(p->succ, (p->nb_succ+1) * sizeof(int));
+   p->succ[p->nb_succ++] = t;
+}
+
+int runtimeTask(runtime * rt, task_submit submit, void * arg, double cost, int nb_data, const int * data, const int * modes) {
+   if (rt->nb_tasks == rt->max_tasks) {
+      rt->max_tasks = (rt->max_tasks == 0 ? 64 : 2*rt->max_tasks);
+      rt->tasks = realloc(rt->tasks, rt->max_tasks * sizeof(rt_task));
+   }
+
+   int t = rt->nb_tasks++;
+   rt_task * task = &rt->tasks[t];
+   memset(task, 0, sizeof(rt_task));
+   task->rt = rt;
+   task->submit = submit;
+   task->arg = arg;
+   task->cost = cost;
+   task->nb_data = nb_data;
+   task->device = -1;
+
+   int i, k;
+   for (i=0; i<nb_data; i++) {
+      int id = data[i];
+      task->data[i] = id;
+      task->modes[i] = modes[i];
+
+      // Read after write
+      addDependency(rt, rt->last_writer[id], t);
+
+      if (modes[i] == ACCESS_RW) {
+         // Write after read: every reader since the last write
+         for (k=0; k<rt->nb_readers[id]; k++) {
+            addDependency(rt, rt->readers[id][k], t);
+         }
+         rt->nb_readers[id] = 0;
+         rt->last_writer[id] = t;
+      }
+      else {
+         rt->readers[id] = realloc(rt->readers[id], (rt->nb_readers[id]+1) * sizeof(int));
+         rt->readers[id][rt->nb_readers[id]++] = t;
+      }
+   }
+
+   task->nb_pred_left = task->nb_pred;
+   return t;
+}
+
+/* Device of the data written by a task (or read if it writes nothing) */
+static int affinity(runtime * rt, rt_task * task) {
+   int i;
+   for (i=0; i<task->nb_data; i++) {
+      if (task->modes[i] == ACCESS_RW) return rt->location[task->data[i]];
+   }
+   return (task->nb_data > 0 ? rt->location[task->data[0]] : 0);
+}
+
+/* Called with the lock held */
+static void pushReady(runtime * rt, int t) {
+   int d = affinity(rt, &rt->tasks[t]);
+   rt->ready[d] = realloc(rt->ready[d], (rt->nb_ready[d]+1) * sizeof(int));
+   rt->ready[d][rt->nb_ready[d]++] = t;
+}
+
+/* Highest priority ready task of device d, or -1 */
+static int highest(runtime * rt, int d) {
+   int i, best = -1;
+   for (i=0; i<rt->nb_ready[d]; i++) {
+      if (best == -1 || rt->tasks[rt->ready[d][i]].priority > rt->tasks[rt->ready[d][best]].priority) {
+         best = i;
+      }
+   }
+   return best;
+}
+
+/* Take a task for device d: its own ready task of highest priority, else
+ * the one of highest priority of another device (work stealing). Called
+ * with the lock held. */
+static int pick(runtime * rt, int d) {
+   int from = d;
+   int i = highest(rt, d);
+
+   if (i == -1) {
+      cl_uint o;
+      for (o=0; o<rt->s->nb_dev; o++) {
+         int j = highest(rt, o);
+         if (j != -1 && (i == -1 || rt->tasks[rt->ready[o][j]].priority > rt->tasks[rt->ready[from][i]].priority)) {
+            i = j;
+            from = o;
+         }
+      }
+      if (i == -1) return -1;
+   }
+
+   int t = rt->ready[from][i];
+   rt->ready[from][i] = rt->ready[from][--rt->nb_ready[from]];
+   return t;
+}
+
+static void CL_CALLBACK taskComplete(cl_event ev, cl_int status, void * arg) {
+   rt_task * task = arg;
+   runtime * rt = task->rt;
+
+   pthread_mutex_lock(&rt->lock);
+
+   if (status < 0 && rt->failed == CL_SUCCESS) {
+      rt->failed = status;
+   }
+
+   int i;
+   for (i=0; i<task->nb_succ; i++) {
+      int s = task->succ[i];
+      if (--rt->tasks[s].nb_pred_left == 0) {
+         pushReady(rt, s);
+      }
+   }
+
+   rt->in_flight[task->device] -= 1;
+   rt->completed += 1;
+
+   pthread_cond_signal(&rt->cond);
+   pthread_mutex_unlock(&rt->lock);
+}
+
+/* Migrate the data of a task to its device on the transfer queue and submit
+ * it after the migrations on the queue of the device (without the lock:
+ * callbacks may be run by the calling thread) */
+static cl_int dispatch(runtime * rt, rt_task * task, cl_ulong migrate, char ** log) {
+   cl_command_queue cq = rt->s->queues[task->device];
+   cl_int err = CL_SUCCESS;
+   int i;
+
+   cl_event deps[task->nb_pred + TASK_MAX_DATA];
+   int nb_deps = 0, nb_migrations = 0;
+
+   for (i=0; i<task->nb_data; i++) {
+      if (!(migrate & (1ULL << i))) continue;
+
+      cl_event ev;
+      err = clEnqueueMigrateMemObjects(rt->s->transfer[task->device], 1, &rt->bufs[task->data[i]], 0, 0, NULL, &ev);
+      if (err != CL_SUCCESS) {
+         *log = strdup("Unable to enqueue migrate command");
+         break;
+      }
+      size_t size = 0;
+      clGetMemObjectInfo(rt->bufs[task->data[i]], CL_MEM_SIZE, sizeof(size), &size, NULL);
+      profileRecord(rt->prof, ev, "migrate", 0, size);
+      deps[nb_deps++] = ev;
+      nb_migrations += 1;
+   }
+
+   if (nb_migrations > 0) {
+      clFlush(rt->s->transfer[task->device]);
+   }
+
+   // Complete (only given for traces), unlike the migrations
+   for (i=0; i<task->nb_pred; i++) {
+      deps[nb_deps++] = rt->tasks[task->pred[i]].done;
+   }
+
+   if (err == CL_SUCCESS) {
+      err = task->submit(cq, task->arg, nb_deps, nb_deps > 0 ? deps : NULL, &task->done, log);
+   }
+   for (i=0; i<nb_migrations; i++) {
+      clReleaseEvent(deps[i]);
+   }
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+
+   err = clSetEventCallback(task->done, CL_COMPLETE, taskComplete, task);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to set event callback");
+      return err;
+   }
+
+   return CL_SUCCESS;
+}
+
+cl_int runtimeRun(runtime * rt, char ** log) {
+   cl_uint nb_dev = rt->s->nb_dev;
+   cl_int err = CL_SUCCESS;
+   int t, i;
+
+   // Priorities: longest path to the end. Successors are always inserted
+   // after their predecessors, so reverse insertion order is a valid order.
+   for (t=rt->nb_tasks-1; t>=0; t--) {
+      rt_task * task = &rt->tasks[t];
+      double longest = 0.0;
+      for (i=0; i<task->nb_succ; i++) {
+         if (rt->tasks[task->succ[i]].priority > longest) longest = rt->tasks[task->succ[i]].priority;
+      }
+      task->priority = task->cost + longest;
+   }
+
+   pthread_mutex_lock(&rt->lock);
+
+   for (t=0; t<rt->nb_tasks; t++) {
+      if (rt->tasks[t].nb_pred_left == 0) pushReady(rt, t);
+   }
+
+   rt_task * batch[nb_dev * RUNTIME_DEPTH];
+   cl_ulong migrate[nb_dev * RUNTIME_DEPTH];
+   int flying = 0;
+
+   while (rt->completed < rt->nb_tasks && rt->failed == CL_SUCCESS && err == CL_SUCCESS) {
+
+      // Fill every device up to RUNTIME_DEPTH tasks. Data locations are
+      // updated here so that affinities of later ready tasks are known.
+      int nb = 0;
+      cl_uint d;
+      for (d=0; d<nb_dev; d++) {
+         while (rt->in_flight[d] < RUNTIME_DEPTH && (t = pick(rt, d)) != -1) {
+            rt_task * task = &rt->tasks[t];
+            task->device = d;
+            migrate[nb] = 0;
+            for (i=0; i<task->nb_data; i++) {
+               int id = task->data[i];
+               if (!(rt->valid[id] & (1ULL << d))) {
+                  migrate[nb] |= 1ULL << i;
+                  rt->valid[id] |= 1ULL << d;
+               }
+               if (task->modes[i] == ACCESS_RW) {
+                  rt->valid[id] = 1ULL << d;
+                  rt->location[id] = d;
+               }
+            }
+            rt->in_flight[d] += 1;
+            batch[nb++] = task;
+         }
+      }
+
+      if (nb == 0) {
+         pthread_cond_wait(&rt->cond, &rt->lock);
+         continue;
+      }
+
+      pthread_mutex_unlock(&rt->lock);
+
+      for (i=0; i<nb && err == CL_SUCCESS; i++) {
+         err = dispatch(rt, batch[i], migrate[i], log);
+         if (err == CL_SUCCESS) flying += 1;
+      }
+      for (d=0; d<nb_dev; d++) {
+         clFlush(rt->s->queues[d]);
+      }
+
+      pthread_mutex_lock(&rt->lock);
+   }
+
+   // On failure, wait for the submitted tasks (their callbacks use the runtime)
+   while (rt->completed < flying) {
+      pthread_cond_wait(&rt->cond, &rt->lock);
+   }
+
+   if (err == CL_SUCCESS && rt->failed != CL_SUCCESS) {
+      err = rt->failed;
+      *log = strdup("A task failed");
+   }
+
+   pthread_mutex_unlock(&rt->lock);
+
+   return err;
+}
+
+void releaseRuntime(runtime * rt) {
+   int i;
+   cl_uint d;
+
+   for (i=0; i<rt->nb_tasks; i++) {
+      if (rt->tasks[i].done != NULL) clReleaseEvent(rt->tasks[i].done);
+      free(rt->tasks[i].pred);
+      free(rt->tasks[i].succ);
+   }
+   free(rt->tasks);
+
+   for (i=0; i<rt->nb_data; i++) {
+      free(rt->readers[i]);
+   }
+   free(rt->readers);
+   free(rt->nb_readers);
+   free(rt->last_writer);
+   free(rt->location);
+   free(rt->valid);
+   free(rt->bufs);
+
+   for (d=0; d<rt->s->nb_dev; d++) {
+      free(rt->ready[d]);
+   }
+   free(rt->ready);
+   free(rt->nb_ready);
+   free(rt->in_flight);
+
+   pthread_mutex_destroy(&rt->lock);
+   pthread_cond_destroy(&rt->cond);
+   free(rt);
+}
@@ -0,0 +1,110 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include <pthread.h>
+#include <CL/cl.h>
+
+#include "session.h"
+#include "profiling.h"
+
+/* Dynamic task runtime
+ *
+ * Tasks are inserted in a sequential order, with the data (device buffers)
+ * they read or write. Dependencies are inferred from these accesses (read
+ * after write, write after read, write after write), which builds the task
+ * graph. runtimeRun then executes it on every device of the session:
+ *
+ *  - a task becomes ready when all its predecessors are complete (event
+ *    callbacks), and goes to the ready list of the device that holds the
+ *    data it writes;
+ *  - each device has at most RUNTIME_DEPTH tasks in flight, on the queue
+ *    of the device in the session. It runs its ready task of highest priority, or steals the one
+ *    of highest priority from other devices when it has none;
+ *  - the priority of a task is the cost of the longest path from it to the
+ *    end of the graph, so the critical path goes first;
+ *  - data are migrated to the device before the task, on the transfer
+ *    queue of the device (buffers are shared by the context, only the
+ *    devices holding their last version are tracked).
+ */
+
+// Access modes of task data
+#define ACCESS_R 1
+#define ACCESS_RW 3
+
+// Max tasks in flight per device
+#define RUNTIME_DEPTH 2
+// Max data accessed by a task
+#define TASK_MAX_DATA 4
+
+/* Enqueue the commands of a task on cq (in-order) and return the event of
+ * the last one. "deps" are the (complete) events of its predecessors. */
+typedef cl_int (*task_submit)(cl_command_queue cq, void * arg, cl_uint nb_deps, const cl_event * deps, cl_event * done, char ** log);
+
+struct runtime;
+
+typedef struct {
+   struct runtime * rt;
+   task_submit submit;
+   void * arg;
+   double cost;
+   double priority;
+
+   int nb_data;
+   int data[TASK_MAX_DATA];
+   int modes[TASK_MAX_DATA];
+
+   int nb_pred, nb_pred_left;
+   int * pred;
+   int nb_succ;
+   int * succ;
+
+   int device;
+   cl_event done;
+} rt_task;
+
+typedef struct runtime {
+   session * s;
+   profile * prof;
+
+   int nb_data;
+   cl_mem * bufs;
+   cl_ulong * valid;             // devices holding the last version (bit mask)
+   int * location;               // device that wrote the last version
+   int * last_writer;            // task index or -1
+   int * nb_readers;             // readers since the last write
+   int ** readers;
+
+   int nb_tasks, max_tasks;
+   rt_task * tasks;
+
+   // Execution state (protected by lock)
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   int ** ready;                 // ready tasks per device
+   int * nb_ready;
+   int * in_flight;
+   int completed;
+   cl_int failed;
+} runtime;
+
+/* Create a runtime for the devices of the session with nb_data data. Tasks
+ * run on the queues of the session, commands are recorded in prof (may be
+ * NULL). */
+cl_int createRuntime(session * s, int nb_data, profile * prof, runtime ** rt, char ** log);
+
+/* Register buffer buf as data id, last written by device "location" */
+void runtimeData(runtime * rt, int id, cl_mem buf, int location);
+
+/* Insert a task accessing nb_data data with the given modes. "arg" must
+ * live until the runtime has run. Returns the task index. */
+int runtimeTask(runtime * rt, task_submit submit, void * arg, double cost, int nb_data, const int * data, const int * modes);
+
+/* Execute every task and wait for their completion */
+cl_int runtimeRun(runtime * rt, char ** log);
+
+/* Device holding the last version of data id */
+int runtimeLocation(runtime * rt, int id);
+
+void releaseRuntime(runtime * rt);
+
+#endif
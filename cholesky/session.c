@@ -0,0 +1,544 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include "program_cache.h"
+#include "session.h"
+
+/* Source of kernelFile with the lines #include "file" replaced by the source
+ * of file (in the current directory too), so that cached binaries are keyed
+ * by the code actually built. NULL if a file cannot be read. */
+static char * readSource(const char * kernelFile, int depth, char ** log) {
+   char buffer[4096];
+   if (depth > 8) {
+      snprintf(buffer, sizeof(buffer), "Too many nested includes in kernel file %s", kernelFile);
+      *log = strdup(buffer);
+      return NULL;
+   }
+
+   FILE * f = fopen(kernelFile, "r");
+   if (f == NULL) {
+      snprintf(buffer, sizeof(buffer), "Unable to open kernel file %s", kernelFile);
+      *log = strdup(buffer);
+      return NULL;
+   }
+
+   fseek(f, 0, SEEK_END);
+   size_t source_size = ftell(f);
+   fseek(f, 0, SEEK_SET);
+
+   char * source = malloc(source_size+1);
+   size_t len = 0;
+   char line[4096];
+   while (fgets(line, sizeof(line), f) != NULL) {
+      char * inc = NULL;
+      if (sscanf(line, " #include \"%4095[^\"]\"", buffer) == 1) {
+         inc = readSource(buffer, depth+1, log);
+         if (inc == NULL) {
+            free(source);
+            fclose(f);
+            return NULL;
+         }
+      }
+
+      const char * text = (inc != NULL ? inc : line);
+      size_t text_len = strlen(text);
+      if (len+text_len > source_size) {
+         source_size = len+text_len;
+         source = realloc(source, source_size+1);
+      }
+      memcpy(source+len, text, text_len);
+      len += text_len;
+      free(inc);
+   }
+   source[len] = '\0';
+   fclose(f);
+
+   return source;
+}
+
+static cl_int loadKernel(const char * kernelFile, const char * kernelName, const char * options, cl_context ctx, cl_uint nb_dev, const cl_device_id * devs, char **log, cl_kernel * kernel) {
+   cl_int err;
+
+   char * source = readSource(kernelFile, 0, log);
+   if (source == NULL) {
+      return 1;
+   }
+
+   // Compile for every device (compiled binaries are cached on disk)
+   cl_program prg;
+   err = buildProgram(ctx, nb_dev, devs, source, options, &prg, log);
+   free(source);
+
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+
+   *kernel = clCreateKernel(prg, kernelName, &err);
+   if (err != CL_SUCCESS) {
+      char buffer[4096];
+      sprintf(buffer, "Unable to create kernel with name \"%s\" from file %s", kernelName, kernelFile);
+      *log = strdup(buffer);
+      clReleaseProgram(prg);
+      return err;
+   }
+
+   clReleaseProgram(prg);
+
+   return CL_SUCCESS;
+}
+
+cl_int createSession(cl_uint nb_dev, const cl_device_id * devs, session ** s, char ** log) {
+   cl_int err;
+
+   session * ses = calloc(1, sizeof(session));
+
+   ses->ctx = clCreateContext(NULL, nb_dev, devs, NULL, NULL, &err);
+   if (err != CL_SUCCESS) {
+      free(ses);
+      *log = strdup("Unable to create context");
+      return err;
+   }
+
+   ses->nb_dev = nb_dev;
+   ses->devs = malloc(nb_dev * sizeof(cl_device_id));
+   memcpy(ses->devs, devs, nb_dev * sizeof(cl_device_id));
+
+   // Zero copy only if every device works in host memory (CPUs, integrated GPUs)
+   ses->host_mode = HOST_MAPPED;
+   cl_uint d;
+   for (d=0; d<nb_dev; d++) {
+      cl_bool unified = CL_FALSE;
+      clGetDeviceInfo(devs[d], CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, NULL);
+      if (!unified) ses->host_mode = HOST_PINNED;
+   }
+
+   cl_command_queue_properties props = CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | CL_QUEUE_PROFILING_ENABLE;
+
+   ses->queues = calloc(nb_dev, sizeof(cl_command_queue));
+   ses->transfer = calloc(nb_dev, sizeof(cl_command_queue));
+
+   for (d=0; d<nb_dev; d++) {
+      ses->queues[d] = clCreateCommandQueue(ses->ctx, devs[d], props, &err);
+      if (err == CL_SUCCESS) {
+         ses->transfer[d] = clCreateCommandQueue(ses->ctx, devs[d], CL_QUEUE_PROFILING_ENABLE, &err);
+      }
+      if (err != CL_SUCCESS) {
+         releaseSession(ses);
+         *log = strdup("Unable to create command queue");
+         return err;
+      }
+   }
+
+   if (nb_dev == 1) {
+      ses->cq = ses->queues[0];
+      clRetainCommandQueue(ses->cq);
+   }
+   else {
+      // SOCL performs the scheduling of queues without device (dev = NULL),
+      // other platforms refuse them
+      ses->cq = clCreateCommandQueue(ses->ctx, NULL, props, &err);
+      if (err != CL_SUCCESS) ses->cq = NULL;
+   }
+
+   *s = ses;
+   return CL_SUCCESS;
+}
+
+cl_int sessionKernel(session * s, const char * file, const char * name, const char * options, cl_kernel * kernel, char ** log) {
+   int k;
+   if (options == NULL) options = "";
+
+   for (k=0; k<s->nb_kernels; k++) {
+      if (strcmp(s->kernels[k].file, file) == 0 && strcmp(s->kernels[k].name, name) == 0
+            && strcmp(s->kernels[k].options, options) == 0) {
+         if (s->kernels[k].kernel == NULL) {
+            *log = strdup("Kernel failed to build earlier in the session");
+            return CL_INVALID_KERNEL;
+         }
+         *kernel = s->kernels[k].kernel;
+         return CL_SUCCESS;
+      }
+   }
+
+   // Failures are recorded as well (NULL kernel), the build is not retried
+   cl_int err = loadKernel(file, name, options, s->ctx, s->nb_dev, s->devs, log, kernel);
+
+   s->kernels = realloc(s->kernels, (s->nb_kernels+1) * sizeof(session_kernel));
+   s->kernels[s->nb_kernels].file = strdup(file);
+   s->kernels[s->nb_kernels].name = strdup(name);
+   s->kernels[s->nb_kernels].options = strdup(options);
+   s->kernels[s->nb_kernels].kernel = (err == CL_SUCCESS ? *kernel : NULL);
+   s->nb_kernels += 1;
+
+   return err;
+}
+
+static int hasSubGroups(cl_device_id dev) {
+   size_t size;
+   clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, 0, NULL, &size);
+   char ext[size];
+   clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, size, ext, NULL);
+   return (strstr(ext, "cl_khr_subgroups") != NULL);
+}
+
+/* Largest sub-group of "kernel" on "dev" for a work-group of "local"
+ * work-items, 0 if unknown */
+static size_t subGroupSize(cl_kernel kernel, cl_device_id dev, size_t local) {
+#ifdef CL_VERSION_2_1
+   size_t sg;
+   if (clGetKernelSubGroupInfo(kernel, dev, CL_KERNEL_MAX_SUB_GROUP_SIZE_FOR_NDRANGE, sizeof(local), &local, sizeof(sg), &sg, NULL) == CL_SUCCESS) {
+      return sg;
+   }
+#endif
+   return 0;
+}
+
+/* OpenCL C version of the device (major*10 + minor), 0 if unknown */
+static int openCLCVersion(cl_device_id dev) {
+   size_t size;
+   if (clGetDeviceInfo(dev, CL_DEVICE_OPENCL_C_VERSION, 0, NULL, &size) != CL_SUCCESS) {
+      return 0;
+   }
+   char version[size];
+   clGetDeviceInfo(dev, CL_DEVICE_OPENCL_C_VERSION, size, version, NULL);
+
+   int major, minor;
+   if (sscanf(version, "OpenCL C %d.%d", &major, &minor) != 2) {
+      return 0;
+   }
+   return major*10 + minor;
+}
+
+size_t sessionSubGroupSize(session * s, cl_kernel kernel, size_t local) {
+   size_t sg = 0;
+   cl_uint d;
+
+   for (d=0; d<s->nb_dev; d++) {
+      size_t dev_sg = (hasSubGroups(s->devs[d]) ? subGroupSize(kernel, s->devs[d], local) : 0);
+      if (d == 0 || dev_sg < sg) sg = dev_sg;
+   }
+   return sg;
+}
+
+cl_int sessionSubGroupKernel(session * s, const char * file, const char * name, const char * sg_name, const char * options,
+                             size_t local, size_t min_size, cl_kernel * kernel, size_t * sg_size, char ** log) {
+   cl_uint d;
+
+   int sg = 1, version = 0;
+   for (d=0; d<s->nb_dev; d++) {
+      sg = sg && hasSubGroups(s->devs[d]);
+      int v = openCLCVersion(s->devs[d]);
+      if (d == 0 || v < version) version = v;
+   }
+
+   if (sg) {
+      // Compilers may only define cl_khr_subgroups for OpenCL C 2.0 and later
+      if (options == NULL) options = "";
+      char sg_options[strlen(options) + 32];
+      if (version >= 20) {
+         sprintf(sg_options, "%s%s-cl-std=CL%d.%d", options, *options ? " " : "", version/10, version%10);
+      }
+      else strcpy(sg_options, options);
+
+      // Any failure falls back to the other kernel
+      char * sg_log = NULL;
+      if (sessionKernel(s, file, sg_name, sg_options, kernel, &sg_log) == CL_SUCCESS) {
+         size_t size = sessionSubGroupSize(s, *kernel, local);
+         if (size >= min_size) {
+            if (sg_size != NULL) *sg_size = size;
+            return CL_SUCCESS;
+         }
+      }
+      free(sg_log);
+   }
+
+   if (sg_size != NULL) *sg_size = 0;
+   return sessionKernel(s, file, name, options, kernel, log);
+}
+
+cl_int sessionBuffer(session * s, size_t size, cl_mem * buf, char ** log) {
+   cl_int err;
+   int b, best = -1;
+
+   // Smallest free buffer large enough
+   for (b=0; b<s->nb_buffers; b++) {
+      if (!s->buffers[b].used && s->buffers[b].size >= size
+            && (best == -1 || s->buffers[b].size < s->buffers[best].size)) {
+         best = b;
+      }
+   }
+
+   if (best != -1) {
+      s->buffers[best].used = 1;
+      *buf = s->buffers[best].mem;
+      return CL_SUCCESS;
+   }
+
+   cl_mem mem = clCreateBuffer(s->ctx, CL_MEM_READ_WRITE, size, NULL, &err);
+
+   if (err == CL_MEM_OBJECT_ALLOCATION_FAILURE || err == CL_OUT_OF_RESOURCES) {
+      // Free buffers that are too small and retry
+      for (b=0; b<s->nb_buffers; ) {
+         if (!s->buffers[b].used) {
+            clReleaseMemObject(s->buffers[b].mem);
+            s->buffers[b] = s->buffers[s->nb_buffers-1];
+            s->nb_buffers -= 1;
+         }
+         else b++;
+      }
+      mem = clCreateBuffer(s->ctx, CL_MEM_READ_WRITE, size, NULL, &err);
+   }
+
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to allocate buffer");
+      return err;
+   }
+
+   s->buffers = realloc(s->buffers, (s->nb_buffers+1) * sizeof(session_buffer));
+   s->buffers[s->nb_buffers].mem = mem;
+   s->buffers[s->nb_buffers].size = size;
+   s->buffers[s->nb_buffers].used = 1;
+   s->nb_buffers += 1;
+
+   *buf = mem;
+   return CL_SUCCESS;
+}
+
+void sessionRelease(session * s, cl_mem buf) {
+   int b;
+   for (b=0; b<s->nb_buffers; b++) {
+      if (s->buffers[b].mem == buf) {
+         s->buffers[b].used = 0;
+         return;
+      }
+   }
+}
+
+/* Map the whole of a pooled host buffer (blocking) */
+static cl_int mapHostBuffer(session * s, session_host_buffer * h) {
+   cl_int err;
+   h->ptr = clEnqueueMapBuffer(s->queues[0], h->mem, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, h->size, 0, NULL, NULL, &err);
+   return err;
+}
+
+static void freeHostBuffer(session * s, session_host_buffer * h) {
+   cl_event ev;
+   if (h->ptr != NULL && clEnqueueUnmapMemObject(s->queues[0], h->mem, h->ptr, 0, NULL, &ev) == CL_SUCCESS) {
+      clWaitForEvents(1, &ev);
+      clReleaseEvent(ev);
+   }
+   clReleaseMemObject(h->mem);
+}
+
+static session_host_buffer * findHostBuffer(session * s, cl_mem mem) {
+   int b;
+   for (b=0; b<s->nb_host_buffers; b++) {
+      if (s->host_buffers[b].mem == mem) return &s->host_buffers[b];
+   }
+   return NULL;
+}
+
+cl_int sessionHostBuffer(session * s, size_t size, host_buffer * hb, char ** log) {
+   cl_int err;
+   int b, best = -1;
+
+   // Smallest free buffer large enough (free buffers stay mapped)
+   for (b=0; b<s->nb_host_buffers; b++) {
+      if (!s->host_buffers[b].used && s->host_buffers[b].size >= size
+            && (best == -1 || s->host_buffers[b].size < s->host_buffers[best].size)) {
+         best = b;
+      }
+   }
+
+   if (best == -1) {
+      cl_mem mem = clCreateBuffer(s->ctx, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &err);
+
+      if (err == CL_MEM_OBJECT_ALLOCATION_FAILURE || err == CL_OUT_OF_RESOURCES || err == CL_OUT_OF_HOST_MEMORY) {
+         // Free buffers that are too small and retry
+         for (b=0; b<s->nb_host_buffers; ) {
+            if (!s->host_buffers[b].used) {
+               freeHostBuffer(s, &s->host_buffers[b]);
+               s->host_buffers[b] = s->host_buffers[s->nb_host_buffers-1];
+               s->nb_host_buffers -= 1;
+            }
+            else b++;
+         }
+         mem = clCreateBuffer(s->ctx, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &err);
+      }
+
+      if (err != CL_SUCCESS) {
+         *log = strdup("Unable to allocate host buffer");
+         return err;
+      }
+
+      session_host_buffer h = {mem, NULL, size, 0};
+      err = mapHostBuffer(s, &h);
+      if (err != CL_SUCCESS) {
+         clReleaseMemObject(mem);
+         *log = strdup("Unable to map host buffer");
+         return err;
+      }
+
+      s->host_buffers = realloc(s->host_buffers, (s->nb_host_buffers+1) * sizeof(session_host_buffer));
+      best = s->nb_host_buffers;
+      s->host_buffers[best] = h;
+      s->nb_host_buffers += 1;
+   }
+
+   s->host_buffers[best].used = 1;
+   hb->mem = s->host_buffers[best].mem;
+   hb->ptr = s->host_buffers[best].ptr;
+   hb->size = size;
+
+   return CL_SUCCESS;
+}
+
+cl_int sessionToDevice(session * s, cl_command_queue cq, host_buffer * hb, cl_uint nb_wait, const cl_event * wait, cl_mem * buf, cl_event * ev, char ** log) {
+   cl_int err;
+
+   if (s->host_mode == HOST_MAPPED) {
+      err = clEnqueueUnmapMemObject(cq, hb->mem, hb->ptr, nb_wait, wait, ev);
+      if (err != CL_SUCCESS) {
+         *log = strdup("Unable to enqueue unmap command");
+         return err;
+      }
+      hb->ptr = NULL;
+      *buf = hb->mem;
+      return CL_SUCCESS;
+   }
+
+   err = sessionBuffer(s, hb->size, buf, log);
+   if (err != CL_SUCCESS) {
+      return err;
+   }
+
+   err = clEnqueueWriteBuffer(cq, *buf, CL_FALSE, 0, hb->size, hb->ptr, nb_wait, wait, ev);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to enqueue write buffer command");
+      return err;
+   }
+
+   return CL_SUCCESS;
+}
+
+cl_int sessionCopyToDevice(session * s, cl_command_queue cq, const host_buffer * src, host_buffer * hb, cl_uint nb_wait, const cl_event * wait, cl_mem * buf, cl_event * ev, char ** log) {
+   cl_int err;
+   cl_event ev_unmap = NULL;
+
+   if (s->host_mode == HOST_MAPPED) {
+      // hb is handed over first, then written
+      err = clEnqueueUnmapMemObject(cq, hb->mem, hb->ptr, nb_wait, wait, &ev_unmap);
+      if (err != CL_SUCCESS) {
+         *log = strdup("Unable to enqueue unmap command");
+         return err;
+      }
+      hb->ptr = NULL;
+      *buf = hb->mem;
+      nb_wait = 1;
+      wait = &ev_unmap;
+   }
+   else {
+      err = sessionBuffer(s, hb->size, buf, log);
+      if (err != CL_SUCCESS) {
+         return err;
+      }
+   }
+
+   err = clEnqueueWriteBuffer(cq, *buf, CL_FALSE, 0, hb->size, src->ptr, nb_wait, wait, ev);
+   if (ev_unmap != NULL) clReleaseEvent(ev_unmap);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to enqueue write buffer command");
+      return err;
+   }
+
+   return CL_SUCCESS;
+}
+
+cl_int sessionToHost(session * s, cl_command_queue cq, host_buffer * hb, cl_mem buf, cl_uint nb_wait, const cl_event * wait, cl_event * ev, char ** log) {
+   cl_int err;
+
+   if (s->host_mode == HOST_MAPPED) {
+      // Mapped entirely, as it is kept in the pool
+      session_host_buffer * h = findHostBuffer(s, hb->mem);
+      hb->ptr = clEnqueueMapBuffer(cq, hb->mem, CL_FALSE, CL_MAP_READ | CL_MAP_WRITE, 0, h->size, nb_wait, wait, ev, &err);
+      if (err != CL_SUCCESS) {
+         *log = strdup("Unable to enqueue map command");
+         return err;
+      }
+      return CL_SUCCESS;
+   }
+
+   err = clEnqueueReadBuffer(cq, buf, CL_FALSE, 0, hb->size, hb->ptr, nb_wait, wait, ev);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to enqueue read buffer command");
+      return err;
+   }
+
+   return CL_SUCCESS;
+}
+
+void releaseHostBuffer(session * s, host_buffer * hb) {
+   session_host_buffer * h = findHostBuffer(s, hb->mem);
+   if (h == NULL) return;
+
+   h->ptr = hb->ptr;             // mapped again by sessionToHost
+   h->used = 0;
+
+   // Still handed over to the devices by a failed run: free buffers stay
+   // mapped, or leave the pool
+   if (h->ptr == NULL && mapHostBuffer(s, h) != CL_SUCCESS) {
+      clReleaseMemObject(h->mem);
+      *h = s->host_buffers[s->nb_host_buffers-1];
+      s->nb_host_buffers -= 1;
+   }
+}
+
+void releaseSession(session * s) {
+   int i;
+
+   // Commands left by a failed run must not use the objects released here
+   if (s->cq != NULL) clFinish(s->cq);
+   for (i=0; i<(int)s->nb_dev; i++) {
+      if (s->queues != NULL && s->queues[i] != NULL) clFinish(s->queues[i]);
+      if (s->transfer != NULL && s->transfer[i] != NULL) clFinish(s->transfer[i]);
+   }
+
+   for (i=0; i<s->nb_buffers; i++) {
+      clReleaseMemObject(s->buffers[i].mem);
+   }
+   free(s->buffers);
+
+   for (i=0; i<s->nb_host_buffers; i++) {
+      freeHostBuffer(s, &s->host_buffers[i]);
+   }
+   free(s->host_buffers);
+
+   for (i=0; i<s->nb_kernels; i++) {
+      if (s->kernels[i].kernel != NULL) clReleaseKernel(s->kernels[i].kernel);
+      free(s->kernels[i].file);
+      free(s->kernels[i].name);
+      free(s->kernels[i].options);
+   }
+   free(s->kernels);
+
+   if (s->cq != NULL) clReleaseCommandQueue(s->cq);
+   if (s->queues != NULL) {
+      cl_uint d;
+      for (d=0; d<s->nb_dev; d++) {
+         if (s->queues[d] != NULL) clReleaseCommandQueue(s->queues[d]);
+      }
+      free(s->queues);
+   }
+   if (s->transfer != NULL) {
+      cl_uint d;
+      for (d=0; d<s->nb_dev; d++) {
+         if (s->transfer[d] != NULL) clReleaseCommandQueue(s->transfer[d]);
+      }
+      free(s->transfer);
+   }
+   clReleaseContext(s->ctx);
+   free(s->devs);
+   free(s);
+}
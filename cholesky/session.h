@@ -0,0 +1,127 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <CL/cl.h>
+
+/* A session owns the OpenCL objects needed to run factorizations on a set
+ * of devices: context, command queue, compiled kernels and a pool of device
+ * buffers. Create it once and run as many factorizations as needed through
+ * it, so that setup costs are only paid once.
+ *
+ * A session is not thread-safe: kernel arguments are shared by every user.
+ */
+
+typedef struct {
+   char * file;
+   char * name;
+   char * options;
+   cl_kernel kernel;
+} session_kernel;
+
+typedef struct {
+   cl_mem mem;
+   size_t size;
+   int used;
+} session_buffer;
+
+/* Host memory usable by the devices (see sessionHostBuffer) */
+typedef struct {
+   cl_mem mem;
+   void * ptr;                   // host address while mapped
+   size_t size;
+} host_buffer;
+
+typedef struct {
+   cl_mem mem;
+   void * ptr;                   // host address while free (mapped entirely)
+   size_t size;
+   int used;
+} session_host_buffer;
+
+// Host buffer strategies
+#define HOST_MAPPED 1            // devices share host memory: used in place
+#define HOST_PINNED 2            // discrete devices: pinned staging for transfers
+
+typedef struct {
+   cl_context ctx;
+   cl_uint nb_dev;
+   cl_device_id * devs;
+   cl_command_queue cq;          // see createSession
+   cl_command_queue * queues;    // one queue per device
+   cl_command_queue * transfer;  // in-order transfer queue per device
+   int host_mode;                // HOST_MAPPED if every device shares host memory
+
+   int nb_kernels;
+   session_kernel * kernels;
+
+   int nb_buffers;
+   session_buffer * buffers;
+
+   int nb_host_buffers;
+   session_host_buffer * host_buffers;
+} session;
+
+/* Create a session for the given devices, with an out-of-order profiling
+ * queue per device, and an in-order one for transfers that overlap it.
+ * With a single device, cq is the queue of the device. With more than one
+ * device, cq is a queue that is not bound to a device, for platforms that
+ * schedule commands themselves (SOCL), or NULL if the platform does not
+ * support it: commands must then be distributed over the device queues by
+ * the caller. */
+cl_int createSession(cl_uint nb_dev, const cl_device_id * devs, session ** s, char ** log);
+
+/* Return the kernel "name" from "file" built with "options" (may be NULL),
+ * built on first use only */
+cl_int sessionKernel(session * s, const char * file, const char * name, const char * options, cl_kernel * kernel, char ** log);
+
+/* Smallest sub-group size over the devices of the session of "kernel" run
+ * in work-groups of "local" work-items, 0 if a device does not support
+ * sub-groups */
+size_t sessionSubGroupSize(session * s, cl_kernel kernel, size_t local);
+
+/* Return kernel "sg_name" from "file" if every device supports sub-groups,
+ * it builds (as OpenCL C 2.0 or later when the devices support it) and runs
+ * work-groups of "local" work-items with sub-groups of at least "min_size"
+ * work-items. Return kernel "name" otherwise (both take the same
+ * arguments). "sg_size" (may be NULL) receives the sub-group size of the
+ * kernel returned, 0 for "name". */
+cl_int sessionSubGroupKernel(session * s, const char * file, const char * name, const char * sg_name, const char * options,
+                             size_t local, size_t min_size, cl_kernel * kernel, size_t * sg_size, char ** log);
+
+/* Get a device buffer of at least "size" bytes from the pool. The pool grows
+ * when no free buffer is large enough. Contents are undefined. */
+cl_int sessionBuffer(session * s, size_t size, cl_mem * buf, char ** log);
+
+/* Give a buffer back to the pool */
+void sessionRelease(session * s, cl_mem buf);
+
+/* Get a host buffer of "size" bytes (CL_MEM_ALLOC_HOST_PTR), mapped for
+ * host access, from the pool of host buffers (grown as sessionBuffer grows
+ * the device one). With HOST_MAPPED, devices use it in place (zero copy).
+ * With HOST_PINNED, it is page-locked memory that transfers use at full
+ * speed. Contents are undefined. */
+cl_int sessionHostBuffer(session * s, size_t size, host_buffer * hb, char ** log);
+
+/* Hand the contents of hb over to the devices after the commands of the wait
+ * list. "buf" is the buffer kernels must use: hb itself (unmapped) with
+ * HOST_MAPPED, or a pool buffer it is copied to with HOST_PINNED. */
+cl_int sessionToDevice(session * s, cl_command_queue cq, host_buffer * hb, cl_uint nb_wait, const cl_event * wait, cl_mem * buf, cl_event * ev, char ** log);
+
+/* As sessionToDevice, with the contents of "src" instead of those of hb
+ * (same size): the devices copy them from src, that stays mapped and is only
+ * read. Inputs that must survive the run are given to the devices this way,
+ * without a copy on the host. */
+cl_int sessionCopyToDevice(session * s, cl_command_queue cq, const host_buffer * src, host_buffer * hb, cl_uint nb_wait, const cl_event * wait, cl_mem * buf, cl_event * ev, char ** log);
+
+/* Hand buf (from sessionToDevice) back to the host after the commands of the
+ * wait list: hb is mapped again, or buf is read into it. hb->ptr is valid
+ * once ev is complete. buf must then be given to sessionRelease. */
+cl_int sessionToHost(session * s, cl_command_queue cq, host_buffer * hb, cl_mem buf, cl_uint nb_wait, const cl_event * wait, cl_event * ev, char ** log);
+
+/* Give hb back to the pool, it must be unused by the devices. It is mapped
+ * again if a failed run left it handed over to them. */
+void releaseHostBuffer(session * s, host_buffer * hb);
+
+void releaseSession(session * s);
+
+#endif
@@ -129,10 +129,10 @@ int main() {
                printf("      - Error %d with kernel %s: %s\n", err, kernelFiles[k], log);
             }
             else {
-               printf("      - kernel %s (grid %ldx%ldx%ld, group %ldx%ldx%ld) took %.f ms and %s (%d errors).\n", 
+               printf("      - kernel %s (grid %ldx%ldx%ld, group %ldx%ldx%ld) took %.3f ms and %s (%d errors).\n", 
                   kernelFiles[k], (long)kernelGridSize[k][0], (long)kernelGridSize[k][1], (long)kernelGridSize[k][2],
                   (long)kernelGroupSize[k][0], (long)kernelGroupSize[k][1], (long)kernelGroupSize[k][2],
-                  duration/1000.0, (errCount == 0 ? "succeeded" : "failed"), errCount);
+                  duration/1e6, (errCount == 0 ? "succeeded" : "failed"), errCount);
             }
          }
          printf("\n");
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include "tile_cache.h"
+
+int cacheSlots(cl_device_id dev, size_t slot_size, int max) {
+   cl_ulong mem = 0;
+   clGetDeviceInfo(dev, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(mem), &mem, NULL);
+
+   cl_ulong fit = (mem / 4 * 3) / slot_size;
+   return (fit < max ? (int)fit : max);
+}
+
+cl_int createTileCache(session * s, cl_command_queue cq, int nb_slots, size_t slot_size, int nb_data, profile * prof, tile_cache ** c, char ** log) {
+   cl_int err;
+
+   // Otherwise the first command pinning all its tiles could not run
+   if (nb_slots < CACHE_MIN_SLOTS) {
+      *log = strdup("Not enough device memory for the tile cache (fewer slots than the tiles of a command)");
+      return CL_OUT_OF_RESOURCES;
+   }
+
+   tile_cache * ca = calloc(1, sizeof(tile_cache));
+   ca->s = s;
+   ca->cq = cq;
+   ca->prof = prof;
+
+   ca->nb_data = nb_data;
+   ca->host = calloc(nb_data, sizeof(void *));
+   ca->sizes = calloc(nb_data, sizeof(size_t));
+   ca->slot_of = malloc(nb_data * sizeof(int));
+   ca->stored = calloc(nb_data, sizeof(cl_event));
+
+   int i;
+   for (i=0; i<nb_data; i++) {
+      ca->slot_of[i] = -1;
+   }
+
+   ca->slots = calloc(nb_slots, sizeof(cache_slot));
+   for (i=0; i<nb_slots; i++) {
+      err = sessionBuffer(s, slot_size, &ca->slots[i].buf, log);
+      if (err != CL_SUCCESS) {
+         releaseTileCache(ca);
+         return err;
+      }
+      ca->slots[i].id = -1;
+      ca->nb_slots += 1;
+   }
+
+   ca->stats.slots = nb_slots;
+
+   *c = ca;
+   return CL_SUCCESS;
+}
+
+void cacheData(tile_cache * c, int id, void * host, size_t size) {
+   c->host[id] = host;
+   c->sizes[id] = size;
+}
+
+/* Event after which no command uses the slot any more (readers included) */
+static cl_int quiesce(tile_cache * c, cache_slot * slot, char ** log) {
+   if (slot->nb_readers == 0) return CL_SUCCESS;
+
+   cl_event ev;
+   cl_int err = clEnqueueMarkerWithWaitList(c->cq, slot->nb_readers, slot->readers, &ev);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to enqueue marker command");
+      return err;
+   }
+
+   int i;
+   for (i=0; i<slot->nb_readers; i++) {
+      clReleaseEvent(slot->readers[i]);
+   }
+   slot->nb_readers = 0;
+
+   // Readers waited for the last writer: the marker comes after it
+   if (slot->valid != NULL) clReleaseEvent(slot->valid);
+   slot->valid = ev;
+   return CL_SUCCESS;
+}
+
+/* Free the least recently used slot that is not pinned. Returns -1 if every
+ * slot is pinned. */
+static int evict(tile_cache * c, char ** log, cl_int * err) {
+   int i, victim = -1;
+
+   *err = CL_SUCCESS;
+   for (i=0; i<c->nb_slots; i++) {
+      cache_slot * slot = &c->slots[i];
+      if (slot->pinned) continue;
+      if (slot->id == -1) return i;
+      if (victim == -1 || slot->last_use < c->slots[victim].last_use) victim = i;
+   }
+   if (victim == -1) return -1;
+
+   cache_slot * slot = &c->slots[victim];
+
+   *err = quiesce(c, slot, log);
+   if (*err != CL_SUCCESS) return -1;
+
+   if (slot->dirty) {
+      int id = slot->id;
+      cl_event ev;
+      *err = clEnqueueReadBuffer(c->cq, slot->buf, CL_FALSE, 0, c->sizes[id], c->host[id], slot->valid == NULL ? 0 : 1, slot->valid == NULL ? NULL : &slot->valid, &ev);
+      if (*err != CL_SUCCESS) {
+         *log = strdup("Unable to enqueue read buffer command");
+         return -1;
+      }
+      profileRecord(c->prof, ev, "store", 0, c->sizes[id]);
+      profileAnnotate(c->prof, slot->valid == NULL ? 0 : 1, &slot->valid, "store %d", id);
+
+      if (c->stored[id] != NULL) clReleaseEvent(c->stored[id]);
+      c->stored[id] = ev;
+
+      // The slot is overwritten after the write back
+      clRetainEvent(ev);
+      clReleaseEvent(slot->valid);
+      slot->valid = ev;
+      slot->dirty = 0;
+      c->stats.stores += 1;
+   }
+
+   c->slot_of[slot->id] = -1;
+   slot->id = -1;
+   c->stats.evictions += 1;
+   return victim;
+}
+
+/* Load tile id in a free slot (evicting one if needed) */
+static cl_int load(tile_cache * c, int id, int * slot_index, char ** log) {
+   cl_int err;
+   int i = evict(c, log, &err);
+   if (i == -1) {
+      if (err == CL_SUCCESS) {
+         *log = strdup("Every slot of the tile cache is in use");
+         err = CL_OUT_OF_RESOURCES;
+      }
+      return err;
+   }
+
+   cache_slot * slot = &c->slots[i];
+
+   // After the last command on the slot and the last write back of the tile
+   cl_event wait[2];
+   cl_uint nb_wait = 0;
+   if (slot->valid != NULL) wait[nb_wait++] = slot->valid;
+   if (c->stored[id] != NULL) wait[nb_wait++] = c->stored[id];
+
+   cl_event ev;
+   err = clEnqueueWriteBuffer(c->cq, slot->buf, CL_FALSE, 0, c->sizes[id], c->host[id], nb_wait, nb_wait > 0 ? wait : NULL, &ev);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to enqueue write buffer command");
+      return err;
+   }
+   profileRecord(c->prof, ev, "load", 0, c->sizes[id]);
+   profileAnnotate(c->prof, nb_wait, wait, "load %d", id);
+
+   if (slot->valid != NULL) clReleaseEvent(slot->valid);
+   slot->valid = ev;
+   slot->id = id;
+   slot->dirty = 0;
+   c->slot_of[id] = i;
+
+   *slot_index = i;
+   return CL_SUCCESS;
+}
+
+cl_int cacheAcquire(tile_cache * c, int id, int mode, cl_mem * buf, cl_event * ev, char ** log) {
+   int i = c->slot_of[id];
+
+   if (i == -1) {
+      cl_int err = load(c, id, &i, log);
+      if (err != CL_SUCCESS) {
+         return err;
+      }
+      c->stats.misses += 1;
+   }
+   else c->stats.hits += 1;
+
+   cache_slot * slot = &c->slots[i];
+   slot->pinned += 1;
+   slot->last_use = ++c->clock;
+
+   // Writers also wait for the readers of the previous version
+   if (mode == CACHE_RW) {
+      cl_int err = quiesce(c, slot, log);
+      if (err != CL_SUCCESS) {
+         slot->pinned -= 1;
+         return err;
+      }
+   }
+
+   *buf = slot->buf;
+   *ev = slot->valid;
+   return CL_SUCCESS;
+}
+
+void cacheRelease(tile_cache * c, int id, int mode, cl_event ev) {
+   cache_slot * slot = &c->slots[c->slot_of[id]];
+   slot->pinned -= 1;
+
+   clRetainEvent(ev);
+   if (mode == CACHE_RW) {
+      clReleaseEvent(slot->valid);
+      slot->valid = ev;
+      slot->dirty = 1;
+   }
+   else {
+      slot->readers = realloc(slot->readers, (slot->nb_readers+1) * sizeof(cl_event));
+      slot->readers[slot->nb_readers++] = ev;
+   }
+}
+
+cl_int cachePrefetch(tile_cache * c, int id, char ** log) {
+   int i = c->slot_of[id];
+
+   if (i == -1) {
+      cl_int err = load(c, id, &i, log);
+      if (err != CL_SUCCESS) {
+         return err;
+      }
+      c->stats.prefetches += 1;
+   }
+
+   // Not evicted before the tiles used until then
+   c->slots[i].last_use = ++c->clock;
+   return CL_SUCCESS;
+}
+
+cl_int cacheFlush(tile_cache * c, char ** log) {
+   cl_int err;
+   int i;
+
+   for (i=0; i<c->nb_slots; i++) {
+      cache_slot * slot = &c->slots[i];
+      if (slot->id == -1 || !slot->dirty) continue;
+
+      int id = slot->id;
+      cl_event ev;
+      err = clEnqueueReadBuffer(c->cq, slot->buf, CL_FALSE, 0, c->sizes[id], c->host[id], 1, &slot->valid, &ev);
+      if (err != CL_SUCCESS) {
+         *log = strdup("Unable to enqueue read buffer command");
+         return err;
+      }
+      profileRecord(c->prof, ev, "store", 0, c->sizes[id]);
+      profileAnnotate(c->prof, 1, &slot->valid, "store %d", id);
+
+      clReleaseEvent(slot->valid);
+      slot->valid = ev;
+      slot->dirty = 0;
+      c->stats.stores += 1;
+   }
+
+   err = clFinish(c->cq);
+   if (err != CL_SUCCESS) {
+      *log = strdup("Unable to finish the cache queue");
+      return err;
+   }
+
+   return CL_SUCCESS;
+}
+
+void releaseTileCache(tile_cache * c) {
+   int i, r;
+
+   for (i=0; i<c->nb_slots; i++) {
+      cache_slot * slot = &c->slots[i];
+      if (slot->valid != NULL) clReleaseEvent(slot->valid);
+      for (r=0; r<slot->nb_readers; r++) {
+         clReleaseEvent(slot->readers[r]);
+      }
+      free(slot->readers);
+      sessionRelease(c->s, slot->buf);
+   }
+   free(c->slots);
+
+   for (i=0; i<c->nb_data; i++) {
+      if (c->stored[i] != NULL) clReleaseEvent(c->stored[i]);
+   }
+   free(c->stored);
+   free(c->slot_of);
+   free(c->sizes);
+   free(c->host);
+   free(c);
+}
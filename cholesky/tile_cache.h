@@ -0,0 +1,96 @@
+#ifndef TILE_CACHE_H
+#define TILE_CACHE_H
+
+#include <CL/cl.h>
+
+#include "session.h"
+#include "profiling.h"
+
+/* Device tile cache for out-of-core factorizations
+ *
+ * The matrix stays in host memory (or in a mapped file), one host array per
+ * tile. Tiles are streamed through a fixed number of device buffers (slots)
+ * on a single queue: a tile is loaded when a command needs it and the least
+ * recently used slot is evicted (and written back if modified) when none is
+ * free. Tiles needed by the next commands can be prefetched, so that their
+ * loads overlap the commands already queued.
+ *
+ * Every command is ordered by events: a command reading a tile waits for its
+ * last writer, a command writing it also waits for its readers, and a slot
+ * is only reused after the commands using its previous tile.
+ */
+
+// Access modes of tiles
+#define CACHE_R 1
+#define CACHE_RW 3
+
+// Max tiles a command accesses (pinned at once), the least number of slots
+#define CACHE_MIN_SLOTS 3
+
+typedef struct {
+   int id;                 // tile in the slot, -1 if free
+   cl_mem buf;
+   int dirty;
+   int pinned;
+   unsigned long last_use;
+   cl_event valid;         // last command writing the slot
+   int nb_readers;         // commands reading it since
+   cl_event * readers;
+} cache_slot;
+
+typedef struct {
+   int slots;
+   int hits, misses;       // acquired tiles found in the cache or loaded
+   int prefetches;         // tiles loaded ahead of time
+   int evictions, stores;  // evicted tiles and tiles written back
+} cache_stats;
+
+typedef struct {
+   session * s;
+   cl_command_queue cq;
+   profile * prof;
+
+   int nb_data;
+   void ** host;
+   size_t * sizes;
+   int * slot_of;          // slot holding each tile, -1 if none
+   cl_event * stored;      // last write back of each tile
+
+   int nb_slots;
+   cache_slot * slots;
+   unsigned long clock;
+
+   cache_stats stats;
+} tile_cache;
+
+/* Number of slots of slot_size bytes that fit the device (at most max),
+ * keeping a quarter of its memory for other uses */
+int cacheSlots(cl_device_id dev, size_t slot_size, int max);
+
+/* Create a cache of nb_slots buffers of slot_size bytes (from the session
+ * pool) for nb_data tiles, with commands enqueued on cq and recorded in prof
+ * (may be NULL). Fails with fewer than CACHE_MIN_SLOTS slots. */
+cl_int createTileCache(session * s, cl_command_queue cq, int nb_slots, size_t slot_size, int nb_data, profile * prof, tile_cache ** c, char ** log);
+
+/* Register the host storage of tile id (at most slot_size bytes). It must
+ * stay valid until the cache is flushed. */
+void cacheData(tile_cache * c, int id, void * host, size_t size);
+
+/* Get the buffer of tile id, loaded if needed, and the event to wait for
+ * before accessing it with the given mode. The tile is pinned until
+ * cacheRelease. */
+cl_int cacheAcquire(tile_cache * c, int id, int mode, cl_mem * buf, cl_event * ev, char ** log);
+
+/* Unpin tile id, accessed with the given mode by the command of event ev */
+void cacheRelease(tile_cache * c, int id, int mode, cl_event ev);
+
+/* Start loading tile id if it is not in the cache */
+cl_int cachePrefetch(tile_cache * c, int id, char ** log);
+
+/* Write every modified tile back to the host and wait for completion */
+cl_int cacheFlush(tile_cache * c, char ** log);
+
+/* Commands of the cache must be complete */
+void releaseTileCache(tile_cache * c);
+
+#endif
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "packed.h"
+#include "tiled_file.h"
+
+#define ALIGNED(s) (((s) + TILED_ALIGN-1) / TILED_ALIGN * TILED_ALIGN)
+
+static size_t fullSize(const tiled_header * h) {
+   return h->block * h->block * sizeof(double);
+}
+
+static size_t diagSize(const tiled_header * h) {
+   return packedSize(h->block, h->tile) * sizeof(double);
+}
+
+// Blocks before (Y, X): Y diagonal ones and Y*(Y-1)/2+X off-diagonal ones
+static size_t blockOffset(const tiled_header * h, size_t Y, size_t X) {
+   return TILED_ALIGN + Y * ALIGNED(diagSize(h)) + (Y*(Y-1)/2 + X) * ALIGNED(fullSize(h));
+}
+
+static size_t fileSize(const tiled_header * h) {
+   size_t B = h->n / h->block;
+   return blockOffset(h, B, 0);
+}
+
+static int mapFile(int fd, size_t size, int writable, tiled_file ** f, char ** log) {
+   void * map = mmap(NULL, size, writable ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED) {
+      close(fd);
+      *log = strdup("Unable to map the matrix file");
+      return -1;
+   }
+
+   tiled_file * tf = malloc(sizeof(tiled_file));
+   tf->fd = fd;
+   tf->size = size;
+   tf->header = map;
+   tf->blocks = tf->header->n / tf->header->block;
+
+   *f = tf;
+   return 0;
+}
+
+int createTiledFile(const char * path, size_t n, size_t block, size_t tile, tiled_file ** f, char ** log) {
+   if (block == 0 || tile == 0 || n % block != 0 || block % tile != 0) {
+      *log = strdup("The matrix size must be a multiple of the block size, itself a multiple of the tile size");
+      return -1;
+   }
+
+   tiled_header h;
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, TILED_MAGIC, sizeof(h.magic));
+   h.version = TILED_VERSION;
+   h.layout = TILED_LOWER_PACKED;
+   h.n = n;
+   h.block = block;
+   h.tile = tile;
+
+   int fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+   if (fd < 0) {
+      char buffer[4096];
+      snprintf(buffer, sizeof(buffer), "Unable to create matrix file %s", path);
+      *log = strdup(buffer);
+      return -1;
+   }
+
+   // Sparse file: blocks read as zero until written
+   size_t size = fileSize(&h);
+   if (ftruncate(fd, size) != 0 || pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+      close(fd);
+      unlink(path);
+      *log = strdup("Unable to write the matrix file");
+      return -1;
+   }
+
+   return mapFile(fd, size, 1, f, log);
+}
+
+int openTiledFile(const char * path, int writable, tiled_file ** f, char ** log) {
+   char buffer[4096];
+
+   int fd = open(path, writable ? O_RDWR : O_RDONLY);
+   if (fd < 0) {
+      snprintf(buffer, sizeof(buffer), "Unable to open matrix file %s", path);
+      *log = strdup(buffer);
+      return -1;
+   }
+
+   tiled_header h;
+   struct stat st;
+   if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || fstat(fd, &st) != 0
+         || memcmp(h.magic, TILED_MAGIC, sizeof(h.magic)) != 0) {
+      close(fd);
+      snprintf(buffer, sizeof(buffer), "%s is not a tiled matrix file", path);
+      *log = strdup(buffer);
+      return -1;
+   }
+
+   if (h.version != TILED_VERSION || h.layout != TILED_LOWER_PACKED
+         || h.block == 0 || h.tile == 0 || h.n % h.block != 0 || h.block % h.tile != 0
+         || (size_t)st.st_size < fileSize(&h)) {
+      close(fd);
+      snprintf(buffer, sizeof(buffer), "Unsupported or truncated matrix file %s", path);
+      *log = strdup(buffer);
+      return -1;
+   }
+
+   return mapFile(fd, fileSize(&h), writable, f, log);
+}
+
+double * tiledBlock(tiled_file * f, size_t Y, size_t X) {
+   return (double *)((char *)f->header + blockOffset(f->header, Y, X));
+}
+
+size_t tiledBlockSize(tiled_file * f, size_t Y, size_t X) {
+   return (X == Y ? diagSize(f->header) : fullSize(f->header));
+}
+
+int syncTiledFile(tiled_file * f, char ** log) {
+   if (msync(f->header, f->size, MS_SYNC) != 0) {
+      *log = strdup("Unable to write the matrix file");
+      return -1;
+   }
+   return 0;
+}
+
+void closeTiledFile(tiled_file * f) {
+   munmap(f->header, f->size);
+   close(f->fd);
+   free(f);
+}
@@ -0,0 +1,68 @@
+#ifndef TILED_FILE_H
+#define TILED_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Tiled binary matrix files
+ *
+ * A file holds the lower triangle of a symmetric matrix of size n, split in
+ * blocks of size "block" as multi_buffer does: block (Y, X) with X <= Y, one
+ * row of blocks after the other. Off-diagonal blocks are stored full (row-
+ * major doubles) and diagonal blocks with the packed layout of packed.h
+ * (tile size "tile"). Every block starts on a TILED_ALIGN boundary, after
+ * the header, so that mapped blocks can be given directly to the OpenCL
+ * transfer functions or used as host buffers.
+ *
+ * Files are mapped in memory (shared mapping): writing to a block writes to
+ * the file.
+ *
+ * multi_buffer only reads files of its own compile-time sizes: n = N*BCOUNT,
+ * block = N and tile = 16 (see multi_buffer.c), it rejects other files.
+ */
+
+#define TILED_MAGIC "CHOLTILE"
+#define TILED_VERSION 1
+
+// Layouts (only one for now)
+#define TILED_LOWER_PACKED 1
+
+#define TILED_ALIGN 4096
+
+typedef struct {
+   char magic[8];
+   uint32_t version;
+   uint32_t layout;
+   uint64_t n;
+   uint64_t block;
+   uint64_t tile;
+   uint32_t factored;      // blocks hold the Cholesky factor
+   uint32_t reserved;
+} tiled_header;
+
+typedef struct {
+   int fd;
+   size_t size;
+   tiled_header * header;  // start of the mapping
+   size_t blocks;          // blocks per row or column
+} tiled_file;
+
+/* Create a file for a matrix of size n (contents set to zero) and map it.
+ * Returns 0 on success. */
+int createTiledFile(const char * path, size_t n, size_t block, size_t tile, tiled_file ** f, char ** log);
+
+/* Map an existing file (read-only unless "writable"). Returns 0 on success. */
+int openTiledFile(const char * path, int writable, tiled_file ** f, char ** log);
+
+/* Start of block (Y, X), X <= Y */
+double * tiledBlock(tiled_file * f, size_t Y, size_t X);
+
+/* Size of block (Y, X) in bytes */
+size_t tiledBlockSize(tiled_file * f, size_t Y, size_t X);
+
+/* Write the modified blocks to the file. Returns 0 on success. */
+int syncTiledFile(tiled_file * f, char ** log);
+
+void closeTiledFile(tiled_file * f);
+
+#endif
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <CL/cl.h>
+
+#include "program_cache.h"
+#include "tuning.h"
+
+int tileConfigs(cl_device_id dev, tile_config * configs, int max) {
+   static const int sizes[] = {8, 16, 32};
+   static const int rows[] = {1, 2, 4};
+
+   size_t max_group = 0;
+   size_t max_items[3] = {0, 0, 0};
+   cl_ulong local_mem = 0;
+   clGetDeviceInfo(dev, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
+   clGetDeviceInfo(dev, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(max_items), max_items, NULL);
+   clGetDeviceInfo(dev, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+
+   int i, j, count = 0;
+   for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+      for (j=0; j<sizeof(rows)/sizeof(rows[0]) && count < max; j++) {
+         int ts = sizes[i], wpt = rows[j];
+
+         // Work-groups of ts x ts/wpt, dpotrf_panel, dtrsm and dgemm keep two tiles
+         // in local memory
+         if ((size_t)ts*ts/wpt > max_group || ts > max_items[0] || ts/wpt > max_items[1]) continue;
+         if (2*ts*ts*sizeof(double) > local_mem) continue;
+
+         configs[count].ts = ts;
+         configs[count].wpt = wpt;
+         count += 1;
+      }
+   }
+
+   return count;
+}
+
+void tileOptions(tile_config c, char * options, size_t size) {
+   snprintf(options, size, "-D TS=%d -D WPT=%d", c.ts, c.wpt);
+}
+
+int parseTileConfig(const char * s, tile_config * c) {
+   int ts, wpt = 1;
+   char end;
+   if (sscanf(s, "%dx%d%c", &ts, &wpt, &end) != 2 && sscanf(s, "%d%c", &ts, &end) != 1) return 0;
+   if (ts <= 0 || wpt <= 0 || ts % wpt != 0) return 0;
+   c->ts = ts;
+   c->wpt = wpt;
+   return 1;
+}
+
+static void tileFile(char * path, size_t size, const char * dir, cl_device_id dev) {
+   snprintf(path, size, "%s/%016llx.tile", dir, (unsigned long long)deviceKey(dev));
+}
+
+int loadTileConfig(cl_device_id dev, tile_config * c) {
+   c->ts = TILE_DEFAULT_TS;
+   c->wpt = TILE_DEFAULT_WPT;
+
+   char * dir = cacheDir();
+   if (dir == NULL) return 0;
+
+   char path[4096];
+   tileFile(path, sizeof(path), dir, dev);
+   free(dir);
+
+   FILE * f = fopen(path, "r");
+   if (f == NULL) return 0;
+
+   tile_config stored;
+   int ok = (fscanf(f, "%d %d", &stored.ts, &stored.wpt) == 2
+         && stored.ts > 0 && stored.wpt > 0 && stored.ts % stored.wpt == 0);
+   fclose(f);
+
+   if (ok) *c = stored;
+   return ok;
+}
+
+void storeTileConfig(cl_device_id dev, tile_config c) {
+   char * dir = cacheDir();
+   if (dir == NULL) return;
+
+   // Written to a temporary file first, as cached binaries
+   char path[4096], tmp[4096+32];
+   tileFile(path, sizeof(path), dir, dev);
+   snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+   free(dir);
+
+   FILE * f = fopen(tmp, "w");
+   if (f == NULL) return;
+
+   int ok = (fprintf(f, "%d %d\n", c.ts, c.wpt) > 0);
+
+   if (fclose(f) != 0 || !ok || rename(tmp, path) != 0) {
+      unlink(tmp);
+   }
+}
+
+cl_int tuneTileConfig(cl_device_id dev, tile_bench bench, void * arg, int tries, tile_config * best, char ** log) {
+   tile_config configs[TILE_MAX_CONFIGS];
+   int count = tileConfigs(dev, configs, TILE_MAX_CONFIGS);
+
+   cl_int err = CL_INVALID_DEVICE;
+   cl_ulong best_time = 0;
+   int found = 0;
+   char * fail_log = NULL;
+
+   if (count == 0) {
+      *log = strdup("No tile configuration fits the device");
+      return err;
+   }
+
+   int i, t;
+   for (i=0; i<count; i++) {
+      cl_ulong time = 0;
+      for (t=0; t<tries; t++) {
+         cl_ulong duration;
+         char * bench_log = NULL;
+         err = bench(configs[i], &duration, arg, &bench_log);
+         if (err != CL_SUCCESS) {
+            // Keep the log of the last failure in case every candidate fails
+            free(fail_log);
+            fail_log = bench_log;
+            break;
+         }
+         if (t == 0 || duration < time) time = duration;
+      }
+
+      if (err == CL_SUCCESS && (!found || time < best_time)) {
+         *best = configs[i];
+         best_time = time;
+         found = 1;
+      }
+   }
+
+   if (!found) {
+      *log = fail_log;
+      return err;
+   }
+   free(fail_log);
+
+   storeTileConfig(dev, *best);
+   return CL_SUCCESS;
+}
@@ -0,0 +1,52 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <CL/cl.h>
+
+/* Tile configurations of the tiled kernels (dpotrf_panel.cl, dgemm.cl,
+ * dpotrf.cl, dtrsm.cl) and per-device autotuning.
+ *
+ * The tile size and the number of rows computed by each work-item are
+ * compile-time constants of the kernels, given as build options. The best
+ * configuration of each device is found by timing every candidate and is
+ * stored in the cache directory of program_cache.h, keyed by the identity
+ * of the device.
+ */
+
+typedef struct {
+   int ts;        // tile size (the packed layout of the matrix depends on it)
+   int wpt;       // rows per work-item (work-groups are ts x ts/wpt)
+} tile_config;
+
+// Configuration used when a device has not been tuned
+#define TILE_DEFAULT_TS 16
+#define TILE_DEFAULT_WPT 1
+
+// Max number of candidate configurations
+#define TILE_MAX_CONFIGS 16
+
+/* Fill "configs" with the candidate configurations the device can run (work-
+ * group size and local memory limits) and return their number */
+int tileConfigs(cl_device_id dev, tile_config * configs, int max);
+
+/* Build options of a configuration ("-D TS=<ts> -D WPT=<wpt>") */
+void tileOptions(tile_config c, char * options, size_t size);
+
+/* Parse "<ts>" or "<ts>x<wpt>". Returns 0 on failure. */
+int parseTileConfig(const char * s, tile_config * c);
+
+/* Get the stored configuration of the device. Returns 0 if the device has
+ * not been tuned (or the cache is disabled), c is then the default one. */
+int loadTileConfig(cl_device_id dev, tile_config * c);
+
+void storeTileConfig(cl_device_id dev, tile_config c);
+
+/* Time a factorization with the given configuration */
+typedef cl_int (*tile_bench)(tile_config c, cl_ulong * duration, void * arg, char ** log);
+
+/* Run "bench" "tries" times for every candidate configuration of the device,
+ * keep the fastest (best time of its tries) and store it. Candidates that
+ * fail are skipped; an error is only returned if all of them fail. */
+cl_int tuneTileConfig(cl_device_id dev, tile_bench bench, void * arg, int tries, tile_config * best, char ** log);
+
+#endif